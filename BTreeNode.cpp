@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <cstring>
 #include "BTreeNode.h"
 using namespace std;
@@ -18,7 +19,7 @@ BTreeNode::BTreeNode(HeapFile &file, BlockID block_id, const KeyProfile& key_pro
 }
 
 BTreeNode::~BTreeNode() {
-    delete this->block;
+    this->file.unpin(this->block);
     this->block = nullptr;
 }
 
@@ -43,38 +44,58 @@ Handle BTreeNode::get_handle(RecordID record_id) const {
     return Handle(handle_block_id, handle_record_id);
 }
 
-// Get the record and turn it into a KeyValue.
+// Get the record and turn it into a KeyValue (see marshal_key for the encoding).
 KeyValue *BTreeNode::get_key(RecordID record_id) const {
-    Dbt *dbt = this->block->get(record_id);
-    char *bytes = (char*)dbt->get_data();
+    uint16_t record_size;
+    const uint8_t *bytes = (const uint8_t *)this->block->view(record_id, record_size);
     KeyValue *key_value = new KeyValue();
     Value value;
     uint offset = 0;
     for (auto const& data_type: this->key_profile) {
         value.data_type = data_type;
         if (data_type == ColumnAttribute::DataType::INT) {
-            value.n = *(int32_t*)(bytes + offset);
+            uint32_t n = (uint32_t)bytes[offset] << 24 | (uint32_t)bytes[offset + 1] << 16
+                         | (uint32_t)bytes[offset + 2] << 8 | bytes[offset + 3];
+            value.n = (int32_t)(n ^ 0x80000000U);
             offset += sizeof(int32_t);
         } else if (data_type == ColumnAttribute::DataType::TEXT) {
-            uint16_t size = *(uint16_t *)(bytes + offset);
-            offset += sizeof(uint16_t);
-            char buffer[DbBlock::BLOCK_SZ];
-            memcpy(buffer, bytes+offset, size);
-            buffer[size] = '\0';
-            value.s = std::string(buffer);  // assume ascii for now
-            offset += size;
+            const char *text = (const char *)bytes + offset;
+            size_t size = strnlen(text, record_size - offset);
+            value.s = std::string(text, size);  // assume ascii for now
+            offset += size + 1;
         } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-            value.n = *(uint8_t*)(bytes + offset);
+            value.n = bytes[offset];
             offset += sizeof(uint8_t);
         } else {
             throw DbRelationError("Only know how to unmarshal INT, TEXT, or BOOLEAN");
         }
         key_value->push_back(value);
     }
-    delete dbt;
     return key_value;
 }
 
+// Number of bytes the key (or a leading part of it) takes in a node (see marshal_key).
+uint BTreeNode::key_size(const KeyProfile& key_profile, const KeyValue* key) {
+    uint size = 0;
+    for (uint i = 0; i < key->size(); i++) {
+        if (key_profile[i] == ColumnAttribute::DataType::INT)
+            size += sizeof(int32_t);
+        else if (key_profile[i] == ColumnAttribute::DataType::TEXT)
+            size += (*key)[i].s.length() + 1;
+        else
+            size += sizeof(uint8_t);
+    }
+    return size;
+}
+
+// Order two marshaled keys the way their KeyValues sort: negative, zero, or positive.
+int BTreeNode::compare_keys(const char *a, uint a_size, const char *b, uint b_size) {
+    int cmp = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (cmp != 0)
+        return cmp;
+    return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+}
+
 // Convert block_id into bytes.
 Dbt *BTreeNode::marshal_block_id(BlockID block_id) {
     char *bytes = new char[sizeof(BlockID)];
@@ -92,49 +113,68 @@ Dbt *BTreeNode::marshal_handle(Handle handle) {
     return dbt;
 }
 
+// Convert handles into bytes, packed one after the other.
+Dbt *BTreeNode::marshal_handles(const Handles &handles) {
+    uint size = (uint)handles.size() * (sizeof(BlockID) + sizeof(RecordID));
+    char *bytes = new char[size];
+    Dbt *dbt = new Dbt(bytes, size);
+    for (auto const &handle : handles) {
+        *(BlockID *)bytes = handle.first;
+        *(RecordID *)(bytes + sizeof(BlockID)) = handle.second;
+        bytes += sizeof(BlockID) + sizeof(RecordID);
+    }
+    return dbt;
+}
+
+// Add the handles packed into bytes by marshal_handles.
+void BTreeNode::unmarshal_handles(const char *bytes, uint size, Handles &handles) {
+    for (uint offset = 0; offset < size; offset += sizeof(BlockID) + sizeof(RecordID))
+        handles.push_back(Handle(*(BlockID *)(bytes + offset), *(RecordID *)(bytes + offset + sizeof(BlockID))));
+}
+
 // Convert KeyValue into bytes.
 Dbt *BTreeNode::marshal_key(const KeyValue *key) {
-    char *bytes = new char[DbBlock::BLOCK_SZ]; // more than we need
+    return marshal_key(this->key_profile, key);
+}
+
+// Convert KeyValue (or a leading part of it) into bytes that sort with memcmp as the
+// KeyValues do: an INT is big-endian with its sign bit flipped, a TEXT is its characters and
+// then a NUL, and a BOOLEAN is a byte.
+Dbt *BTreeNode::marshal_key(const KeyProfile& key_profile, const KeyValue *key) {
+    uint size = key_size(key_profile, key);
+    if (size > DbBlock::BLOCK_SZ)
+        throw DbRelationError("index key too big to marshal");
+    char *buffer = new char[size];
+    uint8_t *bytes = (uint8_t *)buffer;
     uint offset = 0;
-    uint col_num = 0;
-    for (auto const& data_type: this->key_profile) {
-        Value value = (*key)[col_num];
+    for (uint col_num = 0; col_num < key->size(); col_num++) {
+        ColumnAttribute::DataType data_type = key_profile[col_num];
+        const Value &value = (*key)[col_num];
 
         if (data_type == ColumnAttribute::DataType::INT) {
-            if (offset + 4 > DbBlock::BLOCK_SZ - 4)
-                throw DbRelationError("index key too big to marshal");
-
-            *(int32_t*) (bytes + offset) = value.n;
-            offset += sizeof(int32_t);
+            uint32_t n = (uint32_t)value.n ^ 0x80000000U;
+            bytes[offset++] = (uint8_t)(n >> 24);
+            bytes[offset++] = (uint8_t)(n >> 16);
+            bytes[offset++] = (uint8_t)(n >> 8);
+            bytes[offset++] = (uint8_t)n;
 
         } else if (data_type == ColumnAttribute::DataType::TEXT) {
-            u_long size = (uint16_t) value.s.length();
-            if (size > UINT16_MAX)
-                throw DbRelationError("text field too long to marshal");
-            if (offset + 2 + size > DbBlock::BLOCK_SZ)
-                throw DbRelationError("index key too big to marshal");
-
-            *(uint16_t*) (bytes + offset) = (uint16_t) size;
-            offset += sizeof(uint16_t);
-            memcpy(bytes+offset, value.s.c_str(), size); // assume ascii for now
-            offset += size;
+            if (value.s.find('\0') != std::string::npos) {
+                delete[] buffer;
+                throw DbRelationError("text in an index key can't have a NUL character");
+            }
+            memcpy(bytes + offset, value.s.c_str(), value.s.length() + 1); // assume ascii for now
+            offset += value.s.length() + 1;
 
         } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-            if (offset + 1 > DbBlock::BLOCK_SZ - 1)
-                throw DbRelationError("index key too big to marshal");
-
-            *(uint8_t*) (bytes + offset) = (uint8_t)value.n;
-            offset += sizeof(uint8_t);
+            bytes[offset++] = (uint8_t)value.n;
 
         } else {
+            delete[] buffer;
             throw DbRelationError("only know how to marshal INT, TEXT, or BOOLEAN for BTree index");
         }
     }
-    char *right_size_bytes = new char[offset];
-    memcpy(right_size_bytes, bytes, offset);
-    delete[] bytes;
-    Dbt *data = new Dbt(right_size_bytes, offset);
-    return data;
+    return new Dbt(buffer, size);
 }
 
 
@@ -143,12 +183,13 @@ Dbt *BTreeNode::marshal_key(const KeyValue *key) {
  ******************************/
 
 BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile)
-        : BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1) {
+        : BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1), format(KEY_FORMAT) {
     save();
 }
 
 BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile)
-        : BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)) {
+        : BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)),
+          format(this->block->size() < FORMAT ? 1 : get_block_id(FORMAT)) {
 }
 
 void BTreeStat::save() {
@@ -169,6 +210,14 @@ void BTreeStat::save() {
     delete[] (char*)dbt->get_data();
     delete dbt;
 
+    dbt = marshal_block_id(this->format);  // nor is this
+    if (is_new)
+        this->block->add(dbt);
+    else
+        this->block->put(FORMAT, *dbt);
+    delete[] (char*)dbt->get_data();
+    delete dbt;
+
     BTreeNode::save();
 }
 
@@ -206,19 +255,35 @@ BTreeInterior::~BTreeInterior() {
     this->boundaries.clear();
 }
 
+// Which child key must be under: the one left of the first boundary past it.
+uint BTreeInterior::child_position(const KeyValue* key) const {
+    if (key == nullptr)
+        return 0;
+    // last pointer is correct if we don't find an earlier boundary (a bulk-loaded node may have only first)
+    auto past = std::upper_bound(this->boundaries.begin(), this->boundaries.end(), key,
+                                 [](const KeyValue* key, const KeyValue* boundary) { return *key < *boundary; });
+    return (uint)(past - this->boundaries.begin());
+}
+
+// The same as child_position then child_id, but straight from the block: record 1 is first,
+// then boundary i is record 2i + 2 and the pointer right of it 2i + 3 (save writes them in order).
+BlockID BTreeInterior::search(const SlottedPage *block, const Dbt &key) {
+    uint lo = 0, hi = (block->size() - 1) / 2;
+    uint16_t size;
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        const char *boundary = block->view((RecordID)(2 * mid + 2), size);
+        if (compare_keys(boundary, size, (const char *)key.get_data(), key.get_size()) > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return *(const BlockID *)block->view((RecordID)(2 * lo + 1), size);
+}
+
 // Get next block down in tree where key must be.
 BTreeNode *BTreeInterior::find(const KeyValue* key, uint depth) const {
-    BlockID down = this->pointers.back();  // last pointer is correct if we don't find an earlier boundary
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *boundary = this->boundaries[i];
-        if (*boundary > *key) {
-            if (i > 0)
-                down = this->pointers[i - 1];
-            else
-                down = this->first;
-            break;
-        }
-    }
+    BlockID down = child_id(child_position(key));
     if (depth == 2)
         return new BTreeLeaf(this->file, down, this->key_profile, false);
     else
@@ -230,6 +295,7 @@ void BTreeInterior::save() {
     Dbt *dbt;
     this->block->clear();
     dbt = marshal_block_id(this->first);
+    this->block->add(dbt);
     delete[] (char *) dbt->get_data();
     delete dbt;
     for (uint i = 0; i < this->boundaries.size(); i++) {
@@ -248,70 +314,122 @@ void BTreeInterior::save() {
     BTreeNode::save();
 }
 
+// Add a boundary, block_id pair past all the others (no size check; caller calls save).
+void BTreeInterior::append(const KeyValue* boundary, BlockID block_id) {
+    this->boundaries.push_back(new KeyValue(*boundary));
+    this->pointers.push_back(block_id);
+}
+
+// Replace boundary i, unless the node would no longer fit in its block (caller calls save).
+bool BTreeInterior::set_boundary(uint i, const KeyValue* boundary) {
+    if (used() - key_size(this->key_profile, this->boundaries[i]) + key_size(this->key_profile, boundary) > CAPACITY)
+        return false;
+    delete this->boundaries[i];
+    this->boundaries[i] = new KeyValue(*boundary);
+    return true;
+}
+
+// Take out boundary i and the pointer to its right (caller calls save).
+void BTreeInterior::remove(uint i) {
+    delete this->boundaries[i];
+    this->boundaries.erase(this->boundaries.begin() + i);
+    this->pointers.erase(this->pointers.begin() + i);
+}
+
+// Bytes of the block the node takes: first pointer, then a (boundary, pointer) per child.
+uint BTreeInterior::used() const {
+    uint used = sizeof(BlockID) + 4;
+    for (auto const boundary : this->boundaries)
+        used += key_size(this->key_profile, boundary) + sizeof(BlockID) + 2 * 4;
+    return used;
+}
+
+// Merge right into this node, with separator (the boundary between them) over right's first.
+bool BTreeInterior::absorb(const KeyValue* separator, BTreeInterior *right) {
+    uint added = key_size(this->key_profile, separator) + sizeof(BlockID) + 2 * 4;
+    if (used() + added + right->used() - (sizeof(BlockID) + 4) > CAPACITY)
+        return false;
+    append(separator, right->first);
+    for (uint i = 0; i < right->boundaries.size(); i++)
+        append(right->boundaries[i], right->pointers[i]);
+    return true;
+}
+
+// Rotate children from the fuller node to the other through the separator between them.
+KeyValue BTreeInterior::balance(const KeyValue* separator, BTreeInterior *right) {
+    KeyValue boundary = *separator;
+    while (right->underfull() && this->boundaries.size() > 1) {
+        // our last child becomes right's first
+        right->boundaries.insert(right->boundaries.begin(), new KeyValue(boundary));
+        right->pointers.insert(right->pointers.begin(), right->first);
+        right->first = this->pointers.back();
+        boundary = *this->boundaries.back();
+        delete this->boundaries.back();
+        this->boundaries.pop_back();
+        this->pointers.pop_back();
+    }
+    while (underfull() && right->boundaries.size() > 1) {
+        // right's first child becomes our last
+        append(&boundary, right->first);
+        right->first = right->pointers.front();
+        boundary = *right->boundaries.front();
+        delete right->boundaries.front();
+        right->boundaries.erase(right->boundaries.begin());
+        right->pointers.erase(right->pointers.begin());
+    }
+    return boundary;
+}
+
 // Insert boundary, block_id pair into block.
 Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
     Dbt *dbt;
 
-    bool inserted = false;
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *check = this->boundaries[i];
-        if (*boundary == *check) {
-            this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
-            this->pointers.insert(this->pointers.begin() + i, block_id);
-            inserted = true;
-            break;
-        }
-    }
-    if (!inserted) {
-        // must go at the end
-        this->boundaries.push_back(new KeyValue(*boundary));
-        this->pointers.push_back(block_id);
-    }
+    uint i = child_position(boundary);
+    this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
+    this->pointers.insert(this->pointers.begin() + i, block_id);
+    // following is just a check for size (the save method will redo this in the right order)
     dbt = marshal_block_id(block_id);
-    try {
-        // following is just a check for size (the save method will redo this in the right order)
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+    bool fits = this->block->try_add(dbt) != 0;
+    delete[] (char *) dbt->get_data();
+    delete dbt;
+    if (fits) {
         dbt = marshal_key(boundary);
-        this->block->add(dbt);
+        fits = this->block->try_add(dbt) != 0;
         delete[] (char *) dbt->get_data();
         delete dbt;
-
+    }
+    if (fits) {
         // that worked, so no need to split
         save();
         return BTreeNode::insertion_none();
+    }
 
-    } catch (DbBlockNoRoomError &e) {
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-
-        // too big, so split
-
-        // create the sister
-        BTreeInterior *nnode = new BTreeInterior(this->file, 0, this->key_profile, true);
+    // too big, so split
 
-        // only the pointer of the middle entry goes into the sister (as it's first pointer)
-        // the corresponding boundary is moved up to be inserted into the parent node
-        u_long split = this->boundaries.size() / 2;
-        nnode->first = this->pointers[split];
-        KeyValue *nboundary = this->boundaries[split];
-        Insertion ret(nnode->id, *nboundary);
-        delete nboundary;
+    // create the sister
+    BTreeInterior *nnode = new BTreeInterior(this->file, 0, this->key_profile, true);
 
-        // move half of the entries to the sister
-        for (u_long i = split + 1; i < this->boundaries.size(); i++) {
-            nnode->boundaries.push_back(this->boundaries[i]);
-            nnode->pointers.push_back(this->pointers[i]);
-        }
-        this->boundaries.erase(this->boundaries.begin() + split, this->boundaries.end());
-        this->pointers.erase(this->pointers.begin() + split, this->pointers.end());
+    // only the pointer of the middle entry goes into the sister (as it's first pointer)
+    // the corresponding boundary is moved up to be inserted into the parent node
+    u_long split = this->boundaries.size() / 2;
+    nnode->first = this->pointers[split];
+    KeyValue *nboundary = this->boundaries[split];
+    Insertion ret(nnode->id, *nboundary);
+    delete nboundary;
 
-        // save everything
-        nnode->save();
-        this->save();
-        return ret;
+    // move half of the entries to the sister
+    for (u_long i = split + 1; i < this->boundaries.size(); i++) {
+        nnode->boundaries.push_back(this->boundaries[i]);
+        nnode->pointers.push_back(this->pointers[i]);
     }
+    this->boundaries.erase(this->boundaries.begin() + split, this->boundaries.end());
+    this->pointers.erase(this->pointers.begin() + split, this->pointers.end());
+
+    // save everything
+    nnode->save();
+    this->save();
+    delete nnode;
+    return ret;
 }
 
 
@@ -330,9 +448,17 @@ BTreeLeaf::BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile& key_pro
                 // next leaf block
                 this->next_leaf = get_block_id(i);
             } else if (i%2 == 0) {
-                // record i-1: handle, record i: key
+                // record i-1: handles (or where they overflowed to), record i: key
                 KeyValue *key_value = get_key(i);
-                this->key_map[*key_value] = get_handle(i-1);
+                Posting &posting = this->key_map[*key_value];
+                delete key_value;
+                if (this->block->get_flags(i-1) & SlottedPage::FORWARD) {
+                    posting.overflow = get_block_id(i-1);
+                } else {
+                    Dbt *dbt = this->block->get(i-1);
+                    unmarshal_handles((char *)dbt->get_data(), (uint)dbt->get_size(), posting.handles);
+                    delete dbt;
+                }
             }
             i++;
         }
@@ -343,9 +469,57 @@ BTreeLeaf::BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile& key_pro
 BTreeLeaf::~BTreeLeaf() {
 }
 
-// Find the handle for a given key
-Handle BTreeLeaf::find_eq(const KeyValue* key) const {
-    return this->key_map.at(*key);
+// Add the handles for a given key (none if it isn't here)
+void BTreeLeaf::find_eq(const KeyValue* key, Handles &handles) const {
+    auto entry = this->key_map.find(*key);
+    if (entry != this->key_map.end())
+        get_handles(entry->second, handles);
+}
+
+// The same as find_eq, but straight from the block: key i is record 2i + 2 and its handles
+// (or the first overflow page holding them) record 2i + 1 (save writes them in order).
+void BTreeLeaf::search(HeapFile &file, const SlottedPage *block, const Dbt &key, Handles &handles) {
+    uint count = (block->size() - 1) / 2;
+    uint lo = 0, hi = count;
+    uint16_t size;
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        const char *entry = block->view((RecordID)(2 * mid + 2), size);
+        if (compare_keys(entry, size, (const char *)key.get_data(), key.get_size()) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == count)
+        return;
+    const char *entry = block->view((RecordID)(2 * lo + 2), size);
+    if (compare_keys(entry, size, (const char *)key.get_data(), key.get_size()) != 0)
+        return;
+    const char *posting = block->view((RecordID)(2 * lo + 1), size);
+    if (block->get_flags((RecordID)(2 * lo + 1)) & SlottedPage::FORWARD)
+        read_overflow(file, *(const BlockID *)posting, handles);
+    else
+        unmarshal_handles(posting, size, handles);
+}
+
+// Add the handles of a posting, reading its overflow pages if it has them.
+void BTreeLeaf::get_handles(const Posting &posting, Handles &handles) const {
+    handles.insert(handles.end(), posting.handles.begin(), posting.handles.end());
+    read_overflow(this->file, posting.overflow, handles);
+}
+
+// Add the handles on the chain of overflow pages starting at page_id (none for 0).
+void BTreeLeaf::read_overflow(HeapFile &file, BlockID page_id, Handles &handles) {
+    while (page_id != 0) {
+        SlottedPage *page = file.get(page_id);
+        Dbt *dbt = page->get(1);
+        page_id = *(BlockID *)dbt->get_data();
+        delete dbt;
+        dbt = page->get(2);
+        unmarshal_handles((char *)dbt->get_data(), (uint)dbt->get_size(), handles);
+        delete dbt;
+        file.unpin(page);
+    }
 }
 
 // Save the key_map and next_leaf data in the correct order
@@ -353,9 +527,15 @@ void BTreeLeaf::save() {
     Dbt *dbt;
     this->block->clear();
     for (auto const& item: this->key_map) {
-        // handle
-        dbt = marshal_handle(item.second);
-        this->block->add(dbt);
+        // handles, or the first overflow page holding them
+        if (item.second.overflow != 0) {
+            dbt = marshal_block_id(item.second.overflow);
+            RecordID id = this->block->add(dbt);
+            this->block->set_flags(id, SlottedPage::FORWARD);
+        } else {
+            dbt = marshal_handles(item.second.handles);
+            this->block->add(dbt);
+        }
         delete[] (char *) dbt->get_data();
         delete dbt;
 
@@ -374,62 +554,225 @@ void BTreeLeaf::save() {
     BTreeNode::save();
 }
 
-// Insert key, handle pair into block.
-Insertion BTreeLeaf::insert(const KeyValue* key, Handle handle) {
-    // check unique
-    if (this->key_map.find(*key) != this->key_map.end())
-        throw DbRelationError("Duplicate keys are not allowed in unique index");
+// Add a key and all its handles past all the others (no size check; caller calls save).
+void BTreeLeaf::append(const KeyValue* key, const Handles &handles) {
+    Posting &posting = this->key_map.insert(this->key_map.end(), std::make_pair(*key, Posting()))->second;
+    if (handles.size() > MAX_INLINE)
+        posting.overflow = spill(handles, 0);
+    else
+        posting.handles = handles;
+}
 
-    Dbt *dbt;
-    dbt = marshal_handle(handle);
-    try {
-        // following is just a check for size (the save method will redo this in the right order)
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
+// Take out handle from key's entry, and the entry itself if that was its last.
+void BTreeLeaf::del(const KeyValue* key, Handle handle) {
+    auto entry = this->key_map.find(*key);
+    if (entry == this->key_map.end())
+        throw DbRelationError("row is not in the index");
+    Posting &posting = entry->second;
+    if (posting.overflow != 0) {
+        if (!del_overflow(posting, handle))
+            throw DbRelationError("row is not in the index");
+    } else {
+        auto found = std::find(posting.handles.begin(), posting.handles.end(), handle);
+        if (found == posting.handles.end())
+            throw DbRelationError("row is not in the index");
+        posting.handles.erase(found);
+    }
+    if (posting.overflow == 0 && posting.handles.empty())
+        this->key_map.erase(entry);
+}
+
+// Bytes a posting of count handles takes in the leaf.
+uint BTreeLeaf::posting_size(uint count) {
+    if (count > MAX_INLINE)
+        return sizeof(BlockID);
+    return count * (sizeof(BlockID) + sizeof(RecordID));
+}
+
+// Bytes an entry takes: its handles (or overflow page), its key, and their two slots.
+uint BTreeLeaf::entry_size(const LeafEntries::value_type &entry) const {
+    uint handles = entry.second.overflow != 0 ? sizeof(BlockID) : posting_size((uint)entry.second.handles.size());
+    return handles + key_size(this->key_profile, &entry.first) + 2 * 4;
+}
+
+// Bytes of the block the node takes: an entry per key, then next_leaf.
+uint BTreeLeaf::used() const {
+    uint used = sizeof(BlockID) + 4;
+    for (auto const &entry : this->key_map)
+        used += entry_size(entry);
+    return used;
+}
+
+// Merge right into this node if there is room (see the header).
+bool BTreeLeaf::absorb(BTreeLeaf *right) {
+    if (used() + right->used() - (sizeof(BlockID) + 4) > CAPACITY)
+        return false;
+    this->key_map.insert(right->key_map.begin(), right->key_map.end());
+    this->next_leaf = right->next_leaf;
+    return true;
+}
+
+// Even out this node and right until neither is underfull (or one is down to an entry).
+KeyValue BTreeLeaf::balance(BTreeLeaf *right) {
+    while (right->underfull() && this->key_map.size() > 1) {
+        auto last = std::prev(this->key_map.end());
+        right->key_map.insert(*last);
+        this->key_map.erase(last);
+    }
+    while (underfull() && right->key_map.size() > 1) {
+        auto first = right->key_map.begin();
+        this->key_map.insert(this->key_map.end(), *first);
+        right->key_map.erase(first);
+    }
+    return right->key_map.begin()->first;
+}
+
+// Add handle to a posting, moving it to overflow pages once it has more than MAX_INLINE.
+void BTreeLeaf::add_handle(Posting &posting, Handle handle) {
+    if (posting.overflow == 0) {
+        posting.handles.push_back(handle);
+        if (posting.handles.size() > MAX_INLINE) {
+            posting.overflow = spill(posting.handles, 0);
+            posting.handles.clear();
+        }
+        return;
+    }
+
+    // room on the first page?
+    SlottedPage *page = this->file.get(posting.overflow);
+    Dbt *dbt = page->get(2);
+    uint count = (uint)dbt->get_size() / (sizeof(BlockID) + sizeof(RecordID));
+    if (count < OVERFLOW_HANDLES) {
+        Handles handles;
+        unmarshal_handles((char *)dbt->get_data(), (uint)dbt->get_size(), handles);
         delete dbt;
-        dbt = marshal_key(key);
-        this->block->add(dbt);
+        handles.push_back(handle);
+        dbt = marshal_handles(handles);
+        page->put(2, *dbt);
         delete[] (char *) dbt->get_data();
         delete dbt;
+        this->file.put(page);
+        this->file.unpin(page);
+        return;
+    }
+    delete dbt;
+    this->file.unpin(page);
 
-        // that worked, so no need to split
-        this->key_map[*key] = handle;
-        save();
-        return BTreeNode::insertion_none();
+    // no, so a new first page
+    posting.overflow = spill(Handles(1, handle), posting.overflow);
+}
 
-    } catch (DbBlockNoRoomError &e) {
+// Write handles onto new overflow pages chained ahead of next, returning the first of them.
+BlockID BTreeLeaf::spill(const Handles &handles, BlockID next) {
+    for (size_t end = handles.size(); end > 0; ) {
+        size_t start = end > OVERFLOW_HANDLES ? end - OVERFLOW_HANDLES : 0;
+        SlottedPage *page = this->file.get_new();
+        Dbt *dbt = marshal_block_id(next);
+        page->add(dbt);
+        delete[] (char *) dbt->get_data();
+        delete dbt;
+        dbt = marshal_handles(Handles(handles.begin() + start, handles.begin() + end));
+        page->add(dbt);
         delete[] (char *) dbt->get_data();
         delete dbt;
+        next = page->get_block_id();
+        this->file.put(page);
+        this->file.unpin(page);
+        end = start;
+    }
+    return next;
+}
 
-        // too big, so split
-
-        // create the sister and put her to the right
-        BTreeLeaf *nleaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
-        nleaf->next_leaf = this->next_leaf;
-        this->next_leaf = nleaf->id;
-
-        // move half of the entries to the sister
-        auto key_list = this->key_map;       // make a copy of my key_map
-        key_list[*key] = handle;             // add key/handle to it
-        u_long split = key_list.size() / 2;  // figure out how many to keep (the rest move to nleaf)
-        this->key_map.clear();               // empty my list
-        u_long i = 0;
-        KeyValue boundary;
-        for (auto const& item: key_list) {
-            if (i < split) {
-                this->key_map[item.first] = item.second;
-            } else if (i == split) {
-                boundary = item.first;
-                nleaf->key_map[boundary] = item.second;
-            } else {
-                nleaf->key_map[item.first] = item.second;
-            }
-            i++;
+// Take handle off the posting's overflow pages, unlinking a page it leaves empty (which is
+// then unused). False if it isn't there.
+bool BTreeLeaf::del_overflow(Posting &posting, Handle handle) {
+    SlottedPage *prev = nullptr;
+    for (BlockID page_id = posting.overflow; page_id != 0; ) {
+        SlottedPage *page = this->file.get(page_id);
+        Dbt *dbt = page->get(1);
+        BlockID next = *(BlockID *)dbt->get_data();
+        delete dbt;
+        Handles handles;
+        dbt = page->get(2);
+        unmarshal_handles((char *)dbt->get_data(), (uint)dbt->get_size(), handles);
+        delete dbt;
+
+        auto found = std::find(handles.begin(), handles.end(), handle);
+        if (found == handles.end()) {
+            if (prev != nullptr)
+                this->file.unpin(prev);
+            prev = page;
+            page_id = next;
+            continue;
         }
 
-        nleaf->save();
-        this->save();
-        return Insertion(nleaf->id, boundary);
+        handles.erase(found);
+        if (!handles.empty()) {
+            dbt = marshal_handles(handles);
+            page->put(2, *dbt);
+            this->file.put(page);
+        } else if (prev == nullptr) {
+            posting.overflow = next;
+            dbt = nullptr;
+        } else {
+            dbt = marshal_block_id(next);
+            prev->put(1, *dbt);
+            this->file.put(prev);
+        }
+        if (dbt != nullptr) {
+            delete[] (char *) dbt->get_data();
+            delete dbt;
+        }
+        if (prev != nullptr)
+            this->file.unpin(prev);
+        this->file.unpin(page);
+        return true;
     }
+    if (prev != nullptr)
+        this->file.unpin(prev);
+    return false;
+}
+
+// Insert key, handle pair into block.
+Insertion BTreeLeaf::insert(const KeyValue* key, Handle handle, bool unique) {
+    auto entry = this->key_map.find(*key);
+    if (entry != this->key_map.end()) {
+        if (unique)
+            throw DbRelationError("Duplicate keys are not allowed in unique index");
+        add_handle(entry->second, handle);
+    } else {
+        this->key_map[*key].handles.push_back(handle);
+    }
+
+    if (used() <= CAPACITY) {
+        // no need to split
+        save();
+        return BTreeNode::insertion_none();
+    }
+
+    // too big, so split
+
+    // create the sister and put her to the right
+    BTreeLeaf *nleaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
+    nleaf->next_leaf = this->next_leaf;
+    this->next_leaf = nleaf->id;
+
+    // keep about half the bytes (and at least one entry), and move the rest to the sister
+    uint half = used() / 2;
+    uint kept = sizeof(BlockID) + 4;
+    auto split = this->key_map.begin();
+    do {
+        kept += entry_size(*split);
+        split++;
+    } while (std::next(split) != this->key_map.end() && kept + entry_size(*split) <= half);
+    KeyValue boundary = split->first;
+    nleaf->key_map.insert(split, this->key_map.end());
+    this->key_map.erase(split, this->key_map.end());
+
+    nleaf->save();
+    this->save();
+    BlockID nleaf_id = nleaf->id;
+    delete nleaf;
+    return Insertion(nleaf_id, boundary);
 }
 
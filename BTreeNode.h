@@ -9,6 +9,15 @@ typedef std::vector<KeyValue*> KeyValues;
 typedef std::vector<BlockID> BlockPointers;
 typedef std::pair<BlockID,KeyValue> Insertion;
 
+// the rows with one key in a leaf: their handles, or, once there are more than
+// BTreeLeaf::MAX_INLINE of them, the first of the overflow pages holding them
+struct Posting {
+    Handles handles;  // empty if they are on overflow pages
+    BlockID overflow;  // 0 if they aren't
+    Posting() : handles(), overflow(0) {}
+};
+typedef std::map<KeyValue,Posting> LeafEntries;
+
 class BTreeNode {
 public:
     BTreeNode(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
@@ -21,6 +30,18 @@ public:
 
     BlockID get_id() const { return this->id; }
 
+    // bytes of a block available to records and their 4-byte slot headers
+    static const uint CAPACITY = DbBlock::BLOCK_SZ - 5;
+    // a node using fewer bytes than this after a delete is merged with or refilled from a sibling
+    static const uint MIN_USED = CAPACITY / 4;
+
+    // bytes a key takes when marshaled into a node
+    static uint key_size(const KeyProfile& key_profile, const KeyValue* key);
+
+    // marshaled keys sort with memcmp the way their KeyValues do (freed by caller)
+    static Dbt *marshal_key(const KeyProfile& key_profile, const KeyValue *key);
+    static int compare_keys(const char *a, uint a_size, const char *b, uint b_size);
+
 protected:
     SlottedPage *block;
     HeapFile &file;
@@ -29,6 +50,8 @@ protected:
 
     static Dbt *marshal_block_id(BlockID block_id);
     static Dbt *marshal_handle(Handle handle);
+    static Dbt *marshal_handles(const Handles &handles);
+    static void unmarshal_handles(const char *bytes, uint size, Handles &handles);
     virtual Dbt *marshal_key(const KeyValue *key);
 
     virtual BlockID get_block_id(RecordID record_id) const;
@@ -40,6 +63,11 @@ class BTreeStat : public BTreeNode {
 public:
     static const RecordID ROOT = 1;  // where we store the root id in the stat block
     static const RecordID HEIGHT = ROOT + 1;  // where we store the height in the stat block
+    static const RecordID FORMAT = HEIGHT + 1;  // where we store the node format in the stat block
+
+    // layout of keys in the nodes, bumped whenever an older index can no longer be searched;
+    // 1 (no FORMAT record) was a length byte per field, 2 is memcmp-comparable key bytes
+    static const uint KEY_FORMAT = 2;
 
     BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile);
     BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile);
@@ -51,10 +79,12 @@ public:
     void set_root_id(BlockID root_id) { this->root_id = root_id; }
     uint get_height() const { return this->height; }
     void set_height(uint height) { this->height = height; }
+    uint get_format() const { return this->format; }
 
 protected:
     BlockID root_id;
     uint height;
+    uint format;
 
 };
 
@@ -63,11 +93,30 @@ public:
     BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
     virtual ~BTreeInterior();
 
-    BTreeNode *find(const KeyValue* key, uint depth) const;
+    BTreeNode *find(const KeyValue* key, uint depth) const;  // nullptr key for the leftmost child
     Insertion insert(const KeyValue* boundary, BlockID block_id);
+
+    // child a marshaled key must be under, by binary search over the block's key records
+    static BlockID search(const SlottedPage *block, const Dbt &key);
     virtual void save();
 
     void set_first(BlockID first) { this->first = first; }
+    void append(const KeyValue* boundary, BlockID block_id);  // bulk load: boundary must sort last
+
+    // children are numbered from 0 (first) to boundary_count(); boundary i separates i and i + 1
+    uint child_position(const KeyValue* key) const;  // nullptr key for the leftmost child
+    BlockID child_id(uint position) const { return position == 0 ? this->first : this->pointers[position - 1]; }
+    uint boundary_count() const { return (uint)this->boundaries.size(); }
+    const KeyValue* get_boundary(uint i) const { return this->boundaries[i]; }
+    bool set_boundary(uint i, const KeyValue* boundary);  // false if it doesn't fit
+    void remove(uint i);  // boundary i and the child to its right
+
+    // deletes, as for BTreeLeaf, except that the parent's boundary between this node and right
+    // comes down into the merged node (absorb) or rotates through the parent (balance)
+    uint used() const;
+    bool underfull() const { return used() < MIN_USED; }
+    bool absorb(const KeyValue* separator, BTreeInterior *right);
+    KeyValue balance(const KeyValue* separator, BTreeInterior *right);
 
 protected:
     BlockID first;
@@ -75,17 +124,68 @@ protected:
     KeyValues boundaries;
 };
 
+/**
+ * @class BTreeLeaf - a leaf's entries are a key and the handles of its rows (one, for a
+ * unique index), in a record before the key's record. Past MAX_INLINE handles, they are
+ * moved to a chain of overflow pages in the index's file, each holding the next page's id
+ * and then a record of handles, and the leaf's record becomes the id of the first page
+ * (flagged SlottedPage::FORWARD).
+ */
 class BTreeLeaf : public BTreeNode {
 public:
+    static const uint MAX_INLINE = 64;  // handles kept in the leaf for a key
+    static const uint OVERFLOW_HANDLES = (CAPACITY - 2 * 4 - sizeof(BlockID)) / (sizeof(BlockID) + sizeof(RecordID));
+
     BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
     virtual ~BTreeLeaf();
 
-    Handle find_eq(const KeyValue* key) const;  // throws if not found
-    Insertion insert(const KeyValue* key, Handle handle);
+    void find_eq(const KeyValue* key, Handles &handles) const;  // adds key's handles, if any
+
+    // adds the handles of a marshaled key, by binary search over the block's key records
+    static void search(HeapFile &file, const SlottedPage *block, const Dbt &key, Handles &handles);
+    void get_handles(const Posting &posting, Handles &handles) const;  // adds them
+    Insertion insert(const KeyValue* key, Handle handle, bool unique);  // unique: throws on a duplicate
     virtual void save();
 
+    void append(const KeyValue* key, const Handles &handles);  // bulk load: key must sort last
+    void del(const KeyValue* key, Handle handle);  // throws if not there
+
+    // bytes the handles take in the leaf (not counting the record's slot header)
+    static uint posting_size(uint count);
+
+    /**
+     * Bytes the node takes in its block, and whether that is few enough (after a delete)
+     * for its parent to merge it with or refill it from a sibling.
+     */
+    uint used() const;
+    bool underfull() const { return used() < MIN_USED; }
+
+    /**
+     * Merge the sibling to the right into this node, if all its entries fit (neither is
+     * saved; the caller takes right out of the parent and leaves its block unused).
+     * @returns  false, changing nothing, if they don't fit
+     */
+    bool absorb(BTreeLeaf *right);
+
+    /**
+     * Move entries from the fuller of this node and its sibling to the right to the other
+     * until that one is no longer underfull.
+     * @returns  the new boundary between them in their parent (right's lowest key)
+     */
+    KeyValue balance(BTreeLeaf *right);
+
+    const LeafEntries& get_entries() const { return this->key_map; }
+    BlockID get_next_leaf() const { return this->next_leaf; }
+    void set_next_leaf(BlockID next_leaf) { this->next_leaf = next_leaf; }
+
 protected:
     BlockID next_leaf;
-    std::map<KeyValue,Handle> key_map;
+    LeafEntries key_map;
+
+    static void read_overflow(HeapFile &file, BlockID page_id, Handles &handles);
+    uint entry_size(const LeafEntries::value_type &entry) const;
+    void add_handle(Posting &posting, Handle handle);
+    BlockID spill(const Handles &handles, BlockID next);
+    bool del_overflow(Posting &posting, Handle handle);
 };
 
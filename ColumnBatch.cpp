@@ -0,0 +1,174 @@
+/**
+ * @file ColumnBatch.cpp - implementation of ColumnBatch
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+
+#include <cstring>
+#include "ColumnBatch.h"
+#include "column_filters.h"
+
+ColumnBatch::ColumnBatch(const ColumnNames &column_names, const ColumnAttributes &column_attributes)
+        : column_names(column_names), columns(column_names.size()), handles(), selection() {
+    for (uint col_num = 0; col_num < this->columns.size(); col_num++) {
+        Column &column = this->columns[col_num];
+        column.data_type = column_attributes[col_num].get_data_type();
+        if (column.data_type == ColumnAttribute::DataType::INT) {
+            column.ints.reserve(CAPACITY);
+        } else if (column.data_type == ColumnAttribute::DataType::TEXT) {
+            column.offsets.reserve(CAPACITY);
+            column.sizes.reserve(CAPACITY);
+        } else {
+            column.bits.reserve(CAPACITY / 64);
+        }
+    }
+    this->handles.reserve(CAPACITY);
+    this->selection.reserve(CAPACITY);
+    this->matches.reserve(CAPACITY / 64);
+}
+
+void ColumnBatch::clear() {
+    for (auto &column : this->columns) {
+        column.ints.clear();
+        column.bits.clear();
+        column.chars.clear();
+        column.offsets.clear();
+        column.sizes.clear();
+    }
+    this->handles.clear();
+    this->selection.clear();
+}
+
+// Start a new row; push each of its column values next.
+void ColumnBatch::add_row(Handle handle) {
+    this->handles.push_back(handle);
+}
+
+void ColumnBatch::push_int(uint col_num, int32_t n) {
+    this->columns[col_num].ints.push_back(n);
+}
+
+void ColumnBatch::push_text(uint col_num, const char *text, uint16_t size) {
+    Column &column = this->columns[col_num];
+    column.offsets.push_back((uint32_t)column.chars.size());
+    column.sizes.push_back(size);
+    column.chars.append(text, size);
+}
+
+void ColumnBatch::push_boolean(uint col_num, bool b) {
+    Column &column = this->columns[col_num];
+    uint row = (uint)this->handles.size() - 1;
+    if (row % 64 == 0)
+        column.bits.push_back(0);
+    if (b)
+        column.bits.back() |= (uint64_t)1 << (row % 64);
+}
+
+void ColumnBatch::push_value(uint col_num, const Value &value) {
+    ColumnAttribute::DataType data_type = this->columns[col_num].data_type;
+    if (data_type == ColumnAttribute::DataType::INT)
+        push_int(col_num, value.n);
+    else if (data_type == ColumnAttribute::DataType::TEXT)
+        push_text(col_num, value.s.data(), (uint16_t)value.s.length());
+    else
+        push_boolean(col_num, value.n != 0);
+}
+
+// Position of the given column in this batch.
+uint ColumnBatch::column_index(const Identifier &column_name) const {
+    for (uint col_num = 0; col_num < this->column_names.size(); col_num++)
+        if (this->column_names[col_num] == column_name)
+            return col_num;
+    throw DbRelationError("batch does not have column named '" + column_name + "'");
+}
+
+// Pointer to a row's text (not NUL-terminated) and, by reference, its length.
+const char *ColumnBatch::get_text(uint col_num, uint row, uint16_t &size) const {
+    const Column &column = this->columns[col_num];
+    size = column.sizes[row];
+    return column.chars.data() + column.offsets[row];
+}
+
+bool ColumnBatch::get_boolean(uint col_num, uint row) const {
+    return (this->columns[col_num].bits[row / 64] >> (row % 64)) & 1;
+}
+
+// Copy one field out into a Value.
+Value ColumnBatch::get_value(uint col_num, uint row) const {
+    Value value;
+    value.data_type = this->columns[col_num].data_type;
+    if (value.data_type == ColumnAttribute::DataType::TEXT) {
+        uint16_t size;
+        const char *text = get_text(col_num, row, size);
+        value.s.assign(text, size);
+    } else if (value.data_type == ColumnAttribute::DataType::BOOLEAN) {
+        value.n = get_boolean(col_num, row);
+    } else {
+        value.n = get_int(col_num, row);
+    }
+    return value;
+}
+
+// Select every row in the batch.
+void ColumnBatch::select_all() {
+    uint n = size();
+    this->selection.resize(n);
+    for (uint row = 0; row < n; row++)
+        this->selection[row] = (uint16_t)row;
+}
+
+// Keep only the selected rows whose column equals value. INT and BOOLEAN columns are
+// compared whole into a bitmap by a kernel; TEXT rows are compared one selected row
+// at a time, writing each candidate and advancing only on a match (no branch on it).
+void ColumnBatch::filter_eq(uint col_num, const Value &value) {
+    const Column &column = this->columns[col_num];
+    if (value.data_type != column.data_type) {
+        this->selection.clear();
+        return;
+    }
+    if (column.data_type == ColumnAttribute::DataType::INT) {
+        this->matches.resize((size() + 63) / 64);
+        int_eq_bitmap(column.ints.data(), size(), value.n, this->matches.data());
+        select_matches();
+    } else if (column.data_type == ColumnAttribute::DataType::BOOLEAN) {
+        this->matches.resize((size() + 63) / 64);
+        bool_eq_bitmap(column.bits.data(), size(), value.n != 0, this->matches.data());
+        select_matches();
+    } else {
+        uint16_t *selected = this->selection.data();
+        uint n = (uint)this->selection.size();
+        uint kept = 0;
+        const char *chars = column.chars.data();
+        const char *target = value.s.data();
+        uint16_t target_size = (uint16_t)value.s.length();
+        for (uint i = 0; i < n; i++) {
+            uint16_t row = selected[i];
+            selected[kept] = row;
+            kept += column.sizes[row] == target_size
+                    && memcmp(chars + column.offsets[row], target, target_size) == 0;
+        }
+        this->selection.resize(kept);
+    }
+}
+
+// Narrow the selection to the rows set in the matches bitmap. While every row is still
+// selected, the selection is read straight off the set bits instead.
+void ColumnBatch::select_matches() {
+    uint16_t *selected = this->selection.data();
+    uint n = (uint)this->selection.size();
+    uint kept = 0;
+    if (n == size()) {
+        for (uint word = 0; word < this->matches.size(); word++) {
+            for (uint64_t bits = this->matches[word]; bits != 0; bits &= bits - 1)
+                selected[kept++] = (uint16_t)(word * 64 + __builtin_ctzll(bits));
+        }
+    } else {
+        for (uint i = 0; i < n; i++) {
+            uint16_t row = selected[i];
+            selected[kept] = row;
+            kept += (this->matches[row / 64] >> (row % 64)) & 1;
+        }
+    }
+    this->selection.resize(kept);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file ColumnBatch.h - a batch of rows stored column by column, for vectorized evaluation
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+
+#pragma once
+
+#include "storage_engine.h"
+
+// positions of the rows in a batch that are still selected, in row order
+typedef std::vector<uint16_t> Selection;
+
+/**
+ * @class ColumnBatch - up to CAPACITY rows of some of a relation's columns
+ *
+ * Each column is kept in its own array: INT as int32 values, TEXT as one character
+ * buffer with an offset and length per row, BOOLEAN as a bitmap. Producers append rows
+ * with add_row() followed by one push per column, in column order. Select-style
+ * filters then narrow the selection vector rather than moving any data; INT and
+ * BOOLEAN filters compare the whole column at once with the column_filters kernels.
+ */
+class ColumnBatch {
+public:
+    static const uint CAPACITY = 1024;
+
+    ColumnBatch(const ColumnNames &column_names, const ColumnAttributes &column_attributes);
+    virtual ~ColumnBatch() {}
+
+    // empty the batch (keeping its allocations) for the next set of rows
+    void clear();
+
+    // producing rows
+    void add_row(Handle handle);
+    void push_int(uint col_num, int32_t n);
+    void push_text(uint col_num, const char *text, uint16_t size);
+    void push_boolean(uint col_num, bool b);
+    void push_value(uint col_num, const Value &value);
+    bool full() const { return this->handles.size() >= CAPACITY; }
+
+    // reading rows
+    uint size() const { return (uint)this->handles.size(); }
+    uint column_count() const { return (uint)this->columns.size(); }
+    uint column_index(const Identifier &column_name) const;  // throws if not in batch
+    ColumnAttribute::DataType get_data_type(uint col_num) const { return this->columns[col_num].data_type; }
+    const ColumnNames &get_column_names() const { return this->column_names; }
+    Handle get_handle(uint row) const { return this->handles[row]; }
+    int32_t get_int(uint col_num, uint row) const { return this->columns[col_num].ints[row]; }
+    const char *get_text(uint col_num, uint row, uint16_t &size) const;
+    bool get_boolean(uint col_num, uint row) const;
+    Value get_value(uint col_num, uint row) const;
+
+    // the selection vector: every row after a producer fills the batch
+    const Selection &get_selection() const { return this->selection; }
+    void select_all();
+    void filter_eq(uint col_num, const Value &value);
+
+protected:
+    struct Column {
+        ColumnAttribute::DataType data_type;
+        std::vector<int32_t> ints;
+        std::vector<uint64_t> bits;
+        std::string chars;
+        std::vector<uint32_t> offsets;
+        std::vector<uint16_t> sizes;
+    };
+    ColumnNames column_names;
+    std::vector<Column> columns;
+    Handles handles;
+    Selection selection;
+    std::vector<uint64_t> matches;  // scratch bitmap from the column_filters kernels
+
+    void select_matches();
+};
+
+/**
+ * @class DbBatchCursor - pull-based iteration over a relation a batch of rows at a time
+ * (handed out by DbRelation::batch_cursor; freed by caller)
+ */
+class DbBatchCursor {
+public:
+    virtual ~DbBatchCursor() {}
+
+    /**
+     * Refill batch with the next rows (all selected).
+     * @param batch  cleared and filled with up to ColumnBatch::CAPACITY rows
+     * @returns      false if there were no more rows
+     */
+    virtual bool next(ColumnBatch &batch) = 0;
+};
@@ -3,10 +3,12 @@
  * @Professor: Kevin Lundeen
  * @Students: Wonseok Seo, Amanda Iverson
  * @see "Seattle University, CPSC5300, Summer 2018"
- * Note: no implementation changes from original version
+ * Note: extended with cursors, columnar batches, and index access paths chosen by optimize
  */
 
+#include <algorithm>
 #include "EvalPlan.h"
+#include "schema_tables.h"
 
 // Dummy class for milestone 5
 class Dummy : public DbRelation {
@@ -29,23 +31,37 @@ public:
 };
 
 EvalPlan::EvalPlan(PlanType type, EvalPlan *relation)
-        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), table(Dummy::one()),
+          index(nullptr), index_key(nullptr), accesses(nullptr) {
 }
 
 EvalPlan::EvalPlan(ColumnNames *projection, EvalPlan *relation)
-        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), table(Dummy::one()),
+          index(nullptr), index_key(nullptr), accesses(nullptr) {
 }
 
 EvalPlan::EvalPlan(ValueDict* conjunction, EvalPlan *relation)
-        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), table(Dummy::one()) {
+        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), table(Dummy::one()),
+          index(nullptr), index_key(nullptr), accesses(nullptr) {
 }
 
 EvalPlan::EvalPlan(DbRelation &table)
-        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table) {
+        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table),
+          index(nullptr), index_key(nullptr), accesses(nullptr) {
+}
+
+EvalPlan::EvalPlan(PlanType type, DbRelation &table, DbIndex &index, ValueDict *key)
+        : type(type), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table),
+          index(&index), index_key(key), accesses(nullptr) {
+}
+
+EvalPlan::EvalPlan(PlanType type, DbRelation &table, std::vector<EvalPlan*> *accesses)
+        : type(type), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table),
+          index(nullptr), index_key(nullptr), accesses(accesses) {
 }
 
 EvalPlan::EvalPlan(const EvalPlan *other)
-        : type(other->type), table(other->table) {
+        : type(other->type), table(other->table), index(other->index) {
     if (other->relation != nullptr)
         relation = new EvalPlan(other->relation);
     else
@@ -58,52 +74,432 @@ EvalPlan::EvalPlan(const EvalPlan *other)
         select_conjunction = new ValueDict(*other->select_conjunction);
     else
         select_conjunction = nullptr;
+    if (other->index_key != nullptr)
+        index_key = new ValueDict(*other->index_key);
+    else
+        index_key = nullptr;
+    if (other->accesses != nullptr) {
+        accesses = new std::vector<EvalPlan*>();
+        for (auto access : *other->accesses)
+            accesses->push_back(new EvalPlan(access));
+    } else {
+        accesses = nullptr;
+    }
 }
 
 EvalPlan::~EvalPlan() {
     delete relation;
     delete projection;
     delete select_conjunction;
+    delete index_key;
+    if (accesses != nullptr) {
+        for (auto access : *accesses)
+            delete access;
+        delete accesses;
+    }
 }
 
 
-EvalPlan *EvalPlan::optimize() {
-    // For now, we don't know how to do anything better
-    return new EvalPlan(this);
+// A Select over a TableScan becomes an index access when its conjunction covers a leading
+// prefix of one of the table's index keys, or an IndexAnd of several such accesses when more
+// than one index helps; without a catalog the plan is just copied.
+EvalPlan *EvalPlan::optimize(Indices *indices) {
+    if (indices != nullptr && this->type == Select && this->relation->type == TableScan) {
+        EvalPlan *plan = this->index_scan(*indices);
+        if (plan != nullptr)
+            return plan;
+    }
+    EvalPlan *plan = new EvalPlan(this);
+    if (this->relation != nullptr) {
+        delete plan->relation;
+        plan->relation = this->relation->optimize(indices);
+    }
+    return plan;
+}
+
+// Pick the index covering the most of conjunction, preferring a unique index whose whole key
+// is covered (at most one row), then any whole key (IndexLookup) over a prefix (IndexRange),
+// and a hash index over a BTree for the same columns. A hash index only helps if its whole
+// key is covered. Returns false if no index helps.
+static bool best_index(Indices &indices, Identifier table_name, const ValueDict &conjunction,
+                       Identifier &best_name, ColumnNames &best_columns, uint &best_prefix, bool &best_whole,
+                       bool &best_unique) {
+    best_prefix = 0;
+    best_whole = false;
+    best_unique = false;
+    bool best_hash = false;
+    for (auto const &index_name : indices.get_index_names(table_name)) {
+        ColumnNames key_columns;
+        bool is_hash, is_unique;
+        indices.get_columns(table_name, index_name, key_columns, is_hash, is_unique);
+        uint prefix = 0;
+        while (prefix < key_columns.size() && conjunction.find(key_columns[prefix]) != conjunction.end())
+            prefix++;
+        bool whole = prefix == key_columns.size();
+        bool unique = whole && is_unique;
+        if (prefix == 0 || (is_hash && !whole) || (best_whole && !whole) || (best_unique && !unique))
+            continue;
+        if (best_unique == unique && best_whole == whole
+            && (prefix < best_prefix || (prefix == best_prefix && (best_hash || !is_hash))))
+            continue;
+        best_name = index_name;
+        best_columns = key_columns;
+        best_prefix = prefix;
+        best_whole = whole;
+        best_unique = unique;
+        best_hash = is_hash;
+    }
+    return best_prefix > 0;
 }
 
-ValueDicts *EvalPlan::evaluate() {
-    ValueDicts *ret = nullptr;
+// Take the best index for this Select's conjunction, then the best for the equalities it
+// leaves, and so on. Several accesses are ANDed as bitmaps, which also reads the table in
+// physical order. There are no index statistics to cost them by, so: a unique whole-key
+// lookup finds at most one row and is used alone, and past the first access only another
+// whole-key lookup is worth reading its index for (a prefix range may match most of the
+// table). Equalities no index covers stay in a Select over the access. Returns nullptr if
+// no index helps.
+EvalPlan *EvalPlan::index_scan(Indices &indices) const {
+    DbRelation &scanned = this->relation->table;
+    Identifier table_name = scanned.get_table_name();
+    ValueDict *residual = new ValueDict(*this->select_conjunction);
+    std::vector<EvalPlan*> *accesses = new std::vector<EvalPlan*>();
+    Identifier index_name;
+    ColumnNames key_columns;
+    uint prefix;
+    bool whole, unique;
+    while (!residual->empty()
+           && best_index(indices, table_name, *residual, index_name, key_columns, prefix, whole, unique)) {
+        if (!accesses->empty() && !whole)
+            break;
+        ValueDict *key = new ValueDict();
+        for (uint i = 0; i < prefix; i++) {
+            (*key)[key_columns[i]] = residual->at(key_columns[i]);
+            residual->erase(key_columns[i]);
+        }
+        DbIndex &index = indices.get_index(table_name, index_name);
+        accesses->push_back(new EvalPlan(whole ? IndexLookup : IndexRange, scanned, index, key));
+        if (unique)
+            break;
+    }
+    if (accesses->empty()) {
+        delete accesses;
+        delete residual;
+        return nullptr;
+    }
+
+    EvalPlan *plan;
+    if (accesses->size() == 1) {
+        plan = accesses->front();
+        delete accesses;
+    } else {
+        plan = new EvalPlan(IndexAnd, scanned, accesses);
+    }
+    if (residual->empty()) {
+        delete residual;
+        return plan;
+    }
+    return new EvalPlan(residual, plan);
+}
+
+Tuples *EvalPlan::evaluate() {
+    Tuples *ret = new Tuples();
+    EvalCursor *rows = cursor();
+    Tuple *row;
+    while ((row = rows->next()) != nullptr)
+        ret->push_back(row);
+    delete rows;
+    return ret;
+}
+
+// Rows are produced as the caller pulls them; the plan must outlive the returned cursor.
+EvalCursor *EvalPlan::cursor() {
     if (this->type != ProjectAll && this->type != Project)
         throw DbRelationError("Invalid evaluation plan--not ending with a projection");
 
+    // Selects straight over a TableScan run a batch at a time
+    std::vector<const ValueDict*> conjunctions;
+    EvalPlan *scan = this->relation;
+    while (scan->type == Select) {
+        conjunctions.push_back(scan->select_conjunction);
+        scan = scan->relation;
+    }
+    if (scan->type == TableScan) {
+        if (this->type == ProjectAll)
+            return new EvalBatchCursor(scan->table, scan->table.get_column_names(), conjunctions);
+        return new EvalBatchCursor(scan->table, *this->projection, conjunctions);
+    }
+
     EvalPipeline pipeline = this->relation->pipeline();
-    DbRelation *temp_table = pipeline.first;
-    Handles *handles = pipeline.second;
     if (this->type == ProjectAll)
-        ret = temp_table->project(handles);
-    else if (this->type == Project)
-        ret = temp_table->project(handles, this->projection);
-    delete handles;
-    return ret;
+        return new EvalHandleCursor(pipeline, nullptr);
+    return new EvalHandleCursor(pipeline, this->projection);
 }
 
 EvalPipeline EvalPlan::pipeline() {
     // base cases
     if (this->type == TableScan)
-        return EvalPipeline(&this->table, this->table.select());
+        return EvalPipeline(&this->table, this->table.select_cursor());
     if (this->type == Select && this->relation->type == TableScan)
-        return EvalPipeline(&this->relation->table, this->relation->table.select(this->select_conjunction));
+        return EvalPipeline(&this->relation->table, this->relation->table.select_cursor(this->select_conjunction));
+    if (this->type == IndexLookup) {
+        this->index->open();
+        return EvalPipeline(&this->table, this->index->lookup_cursor(this->index_key));
+    }
+    if (this->type == IndexRange) {
+        this->index->open();
+        return EvalPipeline(&this->table, this->index->range_cursor(this->index_key, this->index_key));
+    }
+    if (this->type == IndexAnd || this->type == IndexOr) {
+        HandleBitmap *handles = bitmap();
+        Handles *ordered = handles->handles();
+        delete handles;
+        return EvalPipeline(&this->table, new HandlesCursor(ordered));
+    }
 
     // recursive case
     if (this->type == Select) {
         EvalPipeline pipeline = this->relation->pipeline();
         DbRelation *temp_table = pipeline.first;
-        Handles *handles = pipeline.second;
-        EvalPipeline ret(temp_table, temp_table->select(handles, this->select_conjunction));
+        return EvalPipeline(temp_table, temp_table->select_cursor(pipeline.second, this->select_conjunction));
+    }
+
+    throw DbRelationError("Not implemented: pipeline other than Select, TableScan, or index access");
+}
+
+// The handles of an index access, or of IndexAnd's or IndexOr's accesses combined (freed by
+// caller). An IndexAnd stops reading its accesses once nothing is left.
+HandleBitmap *EvalPlan::bitmap() {
+    HandleBitmap *ret = new HandleBitmap();
+    if (this->type != IndexAnd && this->type != IndexOr) {
+        DbCursor *handles = pipeline().second;
+        ret->add(*handles);
         delete handles;
         return ret;
     }
+    for (size_t i = 0; i < this->accesses->size(); i++) {
+        HandleBitmap *access = (*this->accesses)[i]->bitmap();
+        if (i == 0 || this->type == IndexOr)
+            ret->unite(*access);
+        else
+            ret->intersect(*access);
+        delete access;
+        if (this->type == IndexAnd && ret->empty())
+            break;
+    }
+    return ret;
+}
+
+EvalHandleCursor::EvalHandleCursor(EvalPipeline pipeline, const ColumnNames *projection)
+        : table(pipeline.first), handles(pipeline.second), projection(projection), rows(nullptr),
+          position(0) {
+}
+
+EvalHandleCursor::~EvalHandleCursor() {
+    if (this->rows != nullptr) {
+        for (size_t i = this->position; i < this->rows->size(); i++)
+            delete (*this->rows)[i];
+        delete this->rows;
+    }
+    delete handles;
+}
+
+Tuple *EvalHandleCursor::next() {
+    if (this->rows == nullptr || this->position == this->rows->size()) {
+        delete this->rows;
+        this->rows = nullptr;
+        Handles batch;
+        Handle handle;
+        while (batch.size() < BATCH_SIZE && this->handles->next(handle))
+            batch.push_back(handle);
+        if (batch.empty())
+            return nullptr;
+        if (this->projection == nullptr)
+            this->rows = this->table->project_tuples(&batch, &this->table->get_column_names());
+        else
+            this->rows = this->table->project_tuples(&batch, this->projection);
+        this->position = 0;
+    }
+    return (*this->rows)[this->position++];
+}
+
+// The batch holds the projected columns first, then any other columns the Selects test.
+EvalBatchCursor::EvalBatchCursor(DbRelation &table, const ColumnNames &projection,
+                                 const std::vector<const ValueDict*> &conjunctions)
+        : column_names(projection), column_attributes(nullptr), parts(), batch(nullptr), predicates(),
+          projected((uint)projection.size()), current(nullptr), position(0), queues(),
+          queue_latch(), queue_changed(), stopping(false), queue_part(0), handed_out(nullptr) {
+    for (auto const conjunction : conjunctions) {
+        for (auto const &column : *conjunction) {
+            auto found = std::find(this->column_names.begin(), this->column_names.end(), column.first);
+            if (found == this->column_names.end()) {
+                this->column_names.push_back(column.first);
+                found = this->column_names.end() - 1;
+            }
+            this->predicates.push_back(std::make_pair((uint)(found - this->column_names.begin()), column.second));
+        }
+    }
+    this->column_attributes = table.get_column_attributes(this->column_names);
+    this->batch = new ColumnBatch(this->column_names, *this->column_attributes);
+    this->parts = table.batch_cursors(&this->column_names);
+}
+
+// Parts no worker has started are taken back; we wait for the started ones to notice
+// stopping and finish before freeing what they read.
+EvalBatchCursor::~EvalBatchCursor() {
+    {
+        std::unique_lock<std::mutex> lock(this->queue_latch);
+        this->stopping = true;
+        WorkerPool &pool = BufferPool::shared().get_workers();
+        for (auto &queue : this->queues)
+            if (!queue.started && !queue.claimed && pool.cancel(queue.task))
+                queue.claimed = true;
+        this->queue_changed.notify_all();
+        this->queue_changed.wait(lock, [this] {
+            for (auto const &queue : this->queues)
+                if (!queue.claimed && !queue.done)
+                    return false;
+            return true;
+        });
+    }
+    for (auto part : this->parts)
+        delete part;
+    for (auto const &queue : this->queues)
+        for (auto queued : queue.batches)
+            delete queued;
+    delete handed_out;
+    delete batch;
+    delete column_attributes;
+}
 
-    throw DbRelationError("Not implemented: pipeline other than Select or TableScan");
+// Apply the Selects to a freshly filled batch.
+void EvalBatchCursor::filter(ColumnBatch &batch) const {
+    for (auto const &predicate : this->predicates)
+        batch.filter_eq(predicate.first, predicate.second);
+}
+
+// Read and filter a part on this thread, up to its next batch with rows left in it.
+const ColumnBatch *EvalBatchCursor::read_part(uint part) {
+    while (this->parts[part]->next(*this->batch)) {
+        filter(*this->batch);
+        if (!this->batch->get_selection().empty())
+            return this->batch;
+    }
+    return nullptr;
+}
+
+// Hand every part to the worker threads, each to fill its own queue.
+void EvalBatchCursor::start_parts() {
+    this->queues.resize(this->parts.size(),
+                        PartQueue{std::deque<ColumnBatch*>(), 0, false, false, false, nullptr});
+    WorkerPool &pool = BufferPool::shared().get_workers();
+    std::lock_guard<std::mutex> guard(this->queue_latch);
+    for (uint part = 0; part < this->parts.size(); part++) {
+        try {
+            this->queues[part].task = pool.submit([this, part] { fill_part(part); });
+        } catch (...) {
+            this->queues[part].claimed = true;  // read by next_batch instead
+        }
+    }
+}
+
+// Read and filter one part, handing its non-empty batches over through its queue.
+void EvalBatchCursor::fill_part(uint part) {
+    PartQueue &queue = this->queues[part];
+    ColumnBatch *filling = nullptr;
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> guard(this->queue_latch);
+        queue.started = true;
+    }
+    try {
+        filling = new ColumnBatch(this->column_names, *this->column_attributes);
+        while (this->parts[part]->next(*filling)) {
+            filter(*filling);
+            if (filling->get_selection().empty())
+                continue;
+            std::unique_lock<std::mutex> lock(this->queue_latch);
+            this->queue_changed.wait(lock, [this, &queue] {
+                return this->stopping || queue.batches.size() < QUEUE_BATCHES;
+            });
+            if (this->stopping)
+                break;
+            queue.batches.push_back(filling);
+            filling = nullptr;
+            lock.unlock();
+            this->queue_changed.notify_all();
+            filling = new ColumnBatch(this->column_names, *this->column_attributes);
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    delete filling;
+    // notify before letting go, since the destructor may free us as soon as it sees done
+    std::lock_guard<std::mutex> guard(this->queue_latch);
+    queue.done = true;
+    queue.error = error;
+    this->queue_changed.notify_all();
+}
+
+const ColumnBatch *EvalBatchCursor::next_batch() {
+    if (this->parts.size() == 1)
+        return read_part(0);
+    if (this->queues.empty())
+        start_parts();
+    delete this->handed_out;
+    this->handed_out = nullptr;
+    std::unique_lock<std::mutex> lock(this->queue_latch);
+    while (this->queue_part < this->queues.size()) {
+        PartQueue &queue = this->queues[this->queue_part];
+        if (!queue.started && !queue.claimed && BufferPool::shared().get_workers().cancel(queue.task))
+            queue.claimed = true;
+        if (queue.claimed) {
+            lock.unlock();
+            const ColumnBatch *read = read_part(this->queue_part);
+            if (read != nullptr)
+                return read;
+            lock.lock();
+            this->queue_part++;
+            continue;
+        }
+        this->queue_changed.wait(lock, [&queue] { return !queue.batches.empty() || queue.done; });
+        if (!queue.batches.empty()) {
+            this->handed_out = queue.batches.front();
+            queue.batches.pop_front();
+            lock.unlock();
+            this->queue_changed.notify_all();
+            return this->handed_out;
+        }
+        this->queue_part++;
+        if (queue.error) {
+            this->queue_part = (uint)this->queues.size();  // the rest of the scan is abandoned
+            std::rethrow_exception(queue.error);
+        }
+    }
+    return nullptr;
+}
+
+Tuple *EvalBatchCursor::next() {
+    while (this->current == nullptr || this->position >= this->current->get_selection().size()) {
+        this->current = next_batch();
+        this->position = 0;
+        if (this->current == nullptr)
+            return nullptr;
+    }
+    uint row = this->current->get_selection()[this->position++];
+    Tuple *result = new Tuple();
+    result->reserve(this->projected);
+    for (uint col_num = 0; col_num < this->projected; col_num++) {
+        ColumnAttribute::DataType data_type = this->current->get_data_type(col_num);
+        if (data_type == ColumnAttribute::INT) {
+            result->push_int(this->current->get_int(col_num, row));
+        } else if (data_type == ColumnAttribute::TEXT) {
+            uint16_t size;
+            const char *text = this->current->get_text(col_num, row, size);
+            result->push_text(text, size);
+        } else {
+            result->push_boolean(this->current->get_boolean(col_num, row));
+        }
+    }
+    return result;
 }
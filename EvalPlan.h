@@ -3,15 +3,114 @@
  * @Professor: Kevin Lundeen
  * @Students: Wonseok Seo, Amanda Iverson
  * @see "Seattle University, CPSC5300, Summer 2018"
- * Note: no implementation changes from original version
+ * Note: extended with cursors, columnar batches, and index access paths chosen by optimize
  */
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include "storage_engine.h"
+#include "ColumnBatch.h"
 
-// type definition for evaluation pipeline
-typedef std::pair<DbRelation*,Handles*> EvalPipeline;
+class Indices;
+
+// type definition for evaluation pipeline (the cursor is freed by the caller)
+typedef std::pair<DbRelation*,DbCursor*> EvalPipeline;
+
+/**
+ * @class EvalCursor - pulls the projected rows out of an evaluation plan one at a time, as
+ * tuples whose fields follow the projection's columns
+ */
+class EvalCursor {
+public:
+    EvalCursor() {}
+    virtual ~EvalCursor() {}
+    EvalCursor(const EvalCursor &other) = delete;
+    EvalCursor &operator=(const EvalCursor &other) = delete;
+
+    // next row of the result, or nullptr once there are no more (row freed by caller)
+    virtual Tuple *next() = 0;
+};
+
+/**
+ * @class EvalHandleCursor - EvalCursor projecting the handles that come out of a pipeline,
+ * up to BATCH_SIZE of them at a time (so rows in the same block are read together)
+ */
+class EvalHandleCursor : public EvalCursor {
+public:
+    static const uint BATCH_SIZE = 256;
+
+    // takes ownership of pipeline's cursor; projection of nullptr means all columns
+    EvalHandleCursor(EvalPipeline pipeline, const ColumnNames *projection);
+    virtual ~EvalHandleCursor();
+
+    virtual Tuple *next();
+
+protected:
+    DbRelation *table;
+    DbCursor *handles;
+    const ColumnNames *projection;
+    Tuples *rows;  // projected but not yet handed out from position on
+    size_t position;
+};
+
+/**
+ * @class EvalBatchCursor - EvalCursor for Selects over a TableScan, run a ColumnBatch at a
+ * time: each Select narrows the batch's selection vector, then the projection reads the
+ * surviving rows out of the column arrays. If the table splits its batches into several
+ * parts (DbRelation::batch_cursors), each part is handed to the buffer pool's worker threads
+ * from the first batch asked for, to be read and filtered into a queue of at most
+ * QUEUE_BATCHES batches that the thread waits on once it is full; the queues are emptied in
+ * part order. A part no worker has started by the time its turn comes is read right here.
+ */
+class EvalBatchCursor : public EvalCursor {
+public:
+    // projection: columns of each result row; conjunctions: where clauses of the Selects
+    EvalBatchCursor(DbRelation &table, const ColumnNames &projection,
+                    const std::vector<const ValueDict*> &conjunctions);
+    virtual ~EvalBatchCursor();
+
+    virtual Tuple *next();
+
+    // next batch with the Selects applied (its first columns are the projection),
+    // or nullptr once there are no more; owned by the cursor and reused
+    virtual const ColumnBatch *next_batch();
+
+    static const uint QUEUE_BATCHES = 4;  // filtered batches a part's thread may get ahead
+
+protected:
+    // one part's filtered batches on their way from its thread to next_batch
+    struct PartQueue {
+        std::deque<ColumnBatch*> batches;
+        WorkerPool::TaskID task;
+        bool started;  // a worker has begun filling it
+        bool claimed;  // taken back from the workers, so next_batch reads it itself
+        bool done;
+        std::exception_ptr error;
+    };
+
+    ColumnNames column_names;
+    ColumnAttributes *column_attributes;
+    std::vector<DbBatchCursor*> parts;
+    ColumnBatch *batch;  // the batch being refilled when there is just one part
+    std::vector<std::pair<uint, Value>> predicates;  // (batch column, value) equalities
+    uint projected;  // number of leading batch columns in the result
+    const ColumnBatch *current;
+    uint position;
+    std::vector<PartQueue> queues;
+    std::mutex queue_latch;
+    std::condition_variable queue_changed;
+    bool stopping;
+    uint queue_part;  // part whose queue next_batch is emptying
+    ColumnBatch *handed_out;  // last batch next_batch took off a queue
+
+    void filter(ColumnBatch &batch) const;
+    const ColumnBatch *read_part(uint part);
+    void start_parts();
+    void fill_part(uint part);
+};
 
 class EvalPlan {
 public:
@@ -19,7 +118,11 @@ public:
         ProjectAll,
         Project,
         Select,
-        TableScan
+        TableScan,
+        IndexLookup,
+        IndexRange,
+        IndexAnd,
+        IndexOr
     };
     // use for ProjectAll, e.g., EvalPlan(EvalPlan::ProjectAll, table);
     EvalPlan(PlanType type, EvalPlan *relation);
@@ -29,13 +132,22 @@ public:
     EvalPlan(ValueDict* conjunction, EvalPlan *relation);
     // use for TableScan
     EvalPlan(DbRelation &table);
+    // use for IndexLookup (whole key) or IndexRange (all keys starting with a prefix)
+    EvalPlan(PlanType type, DbRelation &table, DbIndex &index, ValueDict *key);
+    // use for IndexAnd (handles every index access yields) or IndexOr (handles any yields),
+    // each access's handles gathered into a HandleBitmap first so the table is read in
+    // physical order
+    EvalPlan(PlanType type, DbRelation &table, std::vector<EvalPlan*> *accesses);
     // use for copying
     EvalPlan(const EvalPlan *other);
     virtual ~EvalPlan();
-    // Attempt to get the best equivalent evaluation plan
-    EvalPlan *optimize();
-    // Evaluate the plan: evaluate gets values, pipeline gets handles
-    ValueDicts *evaluate();
+    // Attempt to get the best equivalent evaluation plan (using the given catalog's indices)
+    EvalPlan *optimize(Indices *indices = nullptr);
+    // Evaluate the plan: evaluate gets values (as tuples in the projection's column order),
+    // cursor streams them (a batch at a time when the plan is just Selects over a TableScan),
+    // pipeline gets handles
+    Tuples *evaluate();
+    EvalCursor *cursor();
     EvalPipeline pipeline();
 
 protected:
@@ -46,6 +158,14 @@ protected:
     ColumnNames *projection;
     // for Select
     ValueDict *select_conjunction;
-    // for TableScan
+    // for TableScan, IndexLookup, IndexRange, IndexAnd, and IndexOr
     DbRelation &table;
+    // for IndexLookup and IndexRange
+    DbIndex *index;
+    ValueDict *index_key;
+    // for IndexAnd and IndexOr
+    std::vector<EvalPlan*> *accesses;
+
+    EvalPlan *index_scan(Indices &indices) const;
+    HandleBitmap *bitmap();
 };
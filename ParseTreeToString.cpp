@@ -204,8 +204,6 @@ string ParseTreeToString::select(const SelectStatement *stmt) {
 string ParseTreeToString::insert(const InsertStatement *stmt) {
     string ret("INSERT INTO ");
     ret += stmt->tableName;
-    if (stmt->type == InsertStatement::kInsertSelect)
-        return ret + "SELECT ...";
     bool doComma = false;
     if (stmt->columns != NULL) {
         ret += " (";
@@ -217,6 +215,8 @@ string ParseTreeToString::insert(const InsertStatement *stmt) {
         }
         ret += ")";
     }
+    if (stmt->type == InsertStatement::kInsertSelect)
+        return ret + " " + select(stmt->select);
     ret += " VALUES (";
     doComma = false;
     for (Expr *expr : *stmt->values) {
@@ -307,12 +307,38 @@ string ParseTreeToString::del(const DeleteStatement *stmt) {
     return ret;
 }
 
+string ParseTreeToString::update(const UpdateStatement *stmt) {
+    string ret("UPDATE ");
+    ret += table_ref(stmt->table) + " SET ";
+    bool doComma = false;
+    for (auto const clause : *stmt->updates) {
+        if (doComma)
+            ret += ", ";
+        ret += string(clause->column) + " = " + expression(clause->value);
+        doComma = true;
+    }
+    if (stmt->where != NULL) {
+        ret += " WHERE ";
+        ret += expression(stmt->where);
+    }
+    return ret;
+}
+
+string ParseTreeToString::import(const ImportStatement *stmt) {
+    string ret("IMPORT FROM ");
+    ret += stmt->type == kImportTbl ? "TBL" : "CSV";
+    ret += string(" FILE '") + stmt->filePath + "' INTO " + stmt->tableName;
+    return ret;
+}
+
 string ParseTreeToString::statement(const SQLStatement *stmt) {
     switch (stmt->type()) {
     case kStmtSelect:
         return select((const SelectStatement *) stmt);
     case kStmtInsert:
         return insert((const InsertStatement *) stmt);
+    case kStmtUpdate:
+        return update((const UpdateStatement *) stmt);
     case kStmtDelete:
         return del((const DeleteStatement *) stmt);
     case kStmtCreate:
@@ -321,9 +347,9 @@ string ParseTreeToString::statement(const SQLStatement *stmt) {
         return drop((const DropStatement *) stmt);
     case kStmtShow:
         return show((const ShowStatement *) stmt);
-    case kStmtError:
     case kStmtImport:
-    case kStmtUpdate:
+        return import((const ImportStatement *) stmt);
+    case kStmtError:
     case kStmtPrepare:
     case kStmtExecute:
     case kStmtExport:
@@ -5,6 +5,10 @@
  * @see "Seattle University, CPSC5300, Summer 2018"
  */
 #include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include "SQLExec.h"
 #include "EvalPlan.h"
 using namespace std;
@@ -14,6 +18,46 @@ using namespace hsql;
 Tables *SQLExec::tables = nullptr;
 Indices *SQLExec::indices = nullptr;
 
+// add a row's field to the output in the way results print it
+static void append_value(string &buffer, const Tuple &row, uint col_num) {
+	switch (row.get_data_type(col_num)) {
+	case ColumnAttribute::INT:
+		buffer += to_string(row.get_int(col_num));
+		break;
+	case ColumnAttribute::TEXT: {
+		uint16_t size;
+		const char *text = row.get_text(col_num, size);
+		buffer += '"';
+		buffer.append(text, size);
+		buffer += '"';
+		break;
+	}
+	default:
+		buffer += row.get_boolean(col_num) ? "true" : "false";
+	}
+	buffer += ' ';
+}
+
+// same, straight out of a batch's column arrays
+static void append_value(string &buffer, const ColumnBatch &batch, uint col_num, uint row) {
+	switch (batch.get_data_type(col_num)) {
+	case ColumnAttribute::INT:
+		buffer += to_string(batch.get_int(col_num, row));
+		break;
+	case ColumnAttribute::TEXT: {
+		uint16_t size;
+		const char *text = batch.get_text(col_num, row, size);
+		buffer += '"';
+		buffer.append(text, size);
+		buffer += '"';
+		break;
+	}
+	default:
+		buffer += batch.get_boolean(col_num, row) ? "true" : "false";
+	}
+	buffer += ' ';
+}
+
 // make query result be printable
 ostream &operator<<(ostream &out, const QueryResult &qres) {
 	if (qres.column_names != nullptr) {
@@ -23,32 +67,84 @@ ostream &operator<<(ostream &out, const QueryResult &qres) {
 		for (unsigned int i = 0; i < qres.column_names->size(); i++)
 			out << "----------+";
 		out << endl;
-		for (auto const &row : *qres.rows) {
-			for (auto const &column_name : *qres.column_names) {
-				Value value = row->at(column_name);
-				switch (value.data_type) {
-				case ColumnAttribute::INT:
-					out << value.n;
-					break;
-				case ColumnAttribute::TEXT:
-					out << "\"" << value.s << "\"";
-					break;
-				case ColumnAttribute::BOOLEAN:
-					out << (value.n == 0 ? "false" : "true");
-					break;
-				default:
-					out << "???";
-				}
-				out << " ";
-			}
-			out << endl;
+		try {
+			qres.print_rows(out);
+		}
+		catch (DbRelationError &e) {
+			qres.done(0);
+			qres.message = string("Error: DbRelationError: ") + e.what();
 		}
 	}
 	out << qres.message;
 	return out;
 }
 
-// Clean column_names, column_attributes, row and rows if they exist
+// Write out the rows, a buffer full at a time. The rows of a streaming result are written
+// as the cursor produces them; batches are written straight from their column arrays.
+void QueryResult::print_rows(ostream &out) const {
+	string buffer;
+	buffer.reserve(OUTPUT_BUFFER_SZ + DbBlock::BLOCK_SZ);
+	u_long row_count = 0;
+	EvalBatchCursor *batches = dynamic_cast<EvalBatchCursor*>(this->cursor);
+	const ColumnBatch *batch;
+	Tuple *row = nullptr;
+	while (true) {
+		if (this->rows != nullptr) {
+			if (row_count == this->rows->size())
+				break;
+			row = (*this->rows)[row_count];
+			for (uint col_num = 0; col_num < row->size(); col_num++)
+				append_value(buffer, *row, col_num);
+			buffer += '\n';
+			row_count++;
+		} else if (batches != nullptr) {
+			if ((batch = batches->next_batch()) == nullptr)
+				break;
+			// the batch's leading columns are the result's columns, in order
+			for (auto const row_num : batch->get_selection()) {
+				for (uint col_num = 0; col_num < this->column_names->size(); col_num++)
+					append_value(buffer, *batch, col_num, row_num);
+				buffer += '\n';
+				row_count++;
+			}
+		} else {
+			if (this->cursor == nullptr || (row = this->cursor->next()) == nullptr)
+				break;
+			for (uint col_num = 0; col_num < row->size(); col_num++)
+				append_value(buffer, *row, col_num);
+			delete row;
+			buffer += '\n';
+			row_count++;
+		}
+		if (buffer.size() >= OUTPUT_BUFFER_SZ) {
+			out.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	out.write(buffer.data(), buffer.size());
+	if (this->cursor != nullptr)
+		done(row_count);
+}
+
+// Read in all the rows of a streaming result.
+Tuples *QueryResult::get_rows() const {
+	if (this->cursor != nullptr) {
+		this->rows = new Tuples();
+		Tuple *row;
+		while ((row = this->cursor->next()) != nullptr)
+			this->rows->push_back(row);
+		done(this->rows->size());
+	}
+	return this->rows;
+}
+
+// A streaming result has been read.
+void QueryResult::done(u_long row_count) const {
+	delete this->cursor;
+	this->cursor = nullptr;
+	this->message = "successfully returned " + to_string(row_count) + " rows";
+}
+
 QueryResult::~QueryResult()
 {
 	if (column_names != nullptr)
@@ -60,6 +156,8 @@ QueryResult::~QueryResult()
 			delete row;
 		delete rows;
 	}
+	delete cursor;
+	delete plan;
 }
 
 /**
@@ -78,22 +176,38 @@ QueryResult *SQLExec::execute(const SQLStatement *statement) throw(SQLExecError)
 	}
 
 	try {
+		QueryResult *result;
 		switch (statement->type()) {
 		case kStmtCreate:
-			return create((const CreateStatement *)statement);
+			result = create((const CreateStatement *)statement);
+			break;
 		case kStmtDrop:
-			return drop((const DropStatement *)statement);
+			result = drop((const DropStatement *)statement);
+			break;
 		case kStmtShow:
-			return show((const ShowStatement *)statement);
+			result = show((const ShowStatement *)statement);
+			break;
 		case kStmtInsert:
-			return insert((const InsertStatement *)statement);
+			result = insert((const InsertStatement *)statement);
+			break;
+		case kStmtImport:
+			result = import((const ImportStatement *)statement);
+			break;
+		case kStmtUpdate:
+			result = update((const UpdateStatement *)statement);
+			break;
 		case kStmtDelete:
-			return del((const DeleteStatement *)statement);
+			result = del((const DeleteStatement *)statement);
+			break;
 		case kStmtSelect:
-			return select((const SelectStatement *)statement);
+			result = select((const SelectStatement *)statement);
+			break;
 		default:
 			return new QueryResult("not implemented");
 		}
+		// write out the blocks this statement changed
+		BufferPool::shared().flush();
+		return result;
 	}
 	catch (DbRelationError &e) {
 		throw SQLExecError(string("DbRelationError: ") + e.what());
@@ -273,9 +387,14 @@ QueryResult *SQLExec::create_index(const CreateStatement *statement) {
 	}
 
 
+	// USING BTREE_MULTI is a BTREE whose key may repeat (the parser has no CREATE UNIQUE INDEX)
 	if (index_type == "BTREE") {
 		is_unique = true;
 	}
+	else if (index_type == "BTREE_MULTI") {
+		index_type = "BTREE";
+		is_unique = false;
+	}
 	else {
 		is_unique = false;
 	}
@@ -341,6 +460,15 @@ QueryResult *SQLExec::drop_table(const DropStatement *statement) {
 	ValueDict where;
 	where["table_name"] = Value(table_name);
 
+	// make sure it's in _tables before building anything for it
+	Handles *table_handles = SQLExec::tables->select(&where);
+	if (table_handles->empty()) {
+		delete table_handles;
+		throw SQLExecError("unknown table " + table_name);
+	}
+	Handle table_handle = table_handles->at(0);
+	delete table_handles;
+
 	// get the table
 	DbRelation &table = SQLExec::tables->get_table(table_name);
 
@@ -367,7 +495,7 @@ QueryResult *SQLExec::drop_table(const DropStatement *statement) {
 
 	// remove table
 	table.drop();
-	SQLExec::tables->del(*SQLExec::tables->select(&where)->begin());
+	SQLExec::tables->del(table_handle);
 
 	return new QueryResult(string("dropped ") + table_name);
 }
@@ -435,17 +563,22 @@ QueryResult *SQLExec::show_tables() {
 	// -3 to discount schema table, schema columns, and schema indices
 	u_long rowNum = handles->size() - 3;
 
-	ValueDicts *rows = new ValueDicts;
+	Tuples *rows = new Tuples;
 
 	//Use project method to get all entries of table names
-	for (unsigned int i = 0; i < handles->size(); i++) {
-		ValueDict* row = SQLExec::tables->project(handles->at(i), colNames);
-		Identifier tbName = row->at("table_name").s;
+	Tuples *names = SQLExec::tables->project_tuples(handles, colNames);
+	for (auto row : *names) {
+		uint16_t size;
+		const char *text = row->get_text(0, size);
+		Identifier tbName(text, size);
 
 		//if table is not the schema table or column schema table, include in results
 		if (tbName != Tables::TABLE_NAME && tbName != Columns::TABLE_NAME && tbName != Indices::TABLE_NAME)
 			rows->push_back(row);
+		else
+			delete row;
 	}
+	delete names;
 
 	//Handle memory because select method returns the "new" pointer
 	//declared in heap
@@ -474,17 +607,10 @@ QueryResult *SQLExec::show_columns(const ShowStatement *statement) {
 	Handles* handles = cols.select(&where);
 	u_long rowNum = handles->size();
 
-	ValueDicts* rows = new ValueDicts;
-
 	//Use project method to get all entries of column names of the table
-	// iterate through the handles of the specific table targeted
-	for (unsigned int i = 0; i < handles->size(); i++) {
-		// get each column name and teh data type from the table.
-		// an example would be to return "x (int)" "y(int)" "z(int)" on goober.  
-		ValueDict* row = cols.project(handles->at(i), colNames);
-		// add each row to the rows vector
-		rows->push_back(row);
-	}
+	// get each column name and teh data type from the table.
+	// an example would be to return "x (int)" "y(int)" "z(int)" on goober.
+	Tuples* rows = cols.project_tuples(handles, colNames);
 
 	//Handle memory because select method returns the "new" pointer
 	//declared in heap
@@ -536,12 +662,8 @@ QueryResult *SQLExec::show_index(const ShowStatement *statement) {
 	// the row numbers need to be equal to the number of handles we have
 	u_long rowNum = handles->size();
 
-	ValueDicts* rows = new ValueDicts;
 	//Use project method to get all entries of column names of the table
-	for (unsigned int i = 0; i < handles->size(); i++) {
-		ValueDict* row = SQLExec::indices->project(handles->at(i), column_names);
-		rows->push_back(row);
-	}
+	Tuples* rows = SQLExec::indices->project_tuples(handles, column_names);
 
 	//Handle memory because select method returns the "new" pointer
 	//declared in heap
@@ -555,6 +677,8 @@ QueryResult *SQLExec::show_index(const ShowStatement *statement) {
 }
 
 // exectue INSERT SQL statement
+// INSERT ... SELECT inserts all the selected rows at once with insert_many, and each
+// index is then brought up to date over all of the new rows in a single pass.
 QueryResult *SQLExec::insert(const InsertStatement *statement) {
 	// get table name
 	Identifier table_name = statement->tableName;
@@ -572,88 +696,270 @@ QueryResult *SQLExec::insert(const InsertStatement *statement) {
 		input_column_names = table.get_column_names();
 	}
 
-	// get values from statement
-	vector<Value> records;
-	for (auto const record : *statement->values) {
-		switch (record->type) {
-		case kExprLiteralString:
-			records.push_back(Value(record->name));
-			break;
-		case kExprLiteralInt:
-			records.push_back(Value(record->ival));
-			break;
-		default:
-			throw DbRelationError("Unsupported Data type!");
+	// get the rows to insert, keyed by the input column names
+	ValueDicts rows;
+	if (statement->type == InsertStatement::kInsertSelect) {
+		ColumnNames select_names;
+		EvalPlan *plan = select_plan(statement->select, select_names);
+		Tuples *selected = plan->evaluate();
+		delete plan;
+		if (select_names.size() != input_column_names.size()) {
+			for (auto row : *selected)
+				delete row;
+			delete selected;
+			throw DbRelationError("SELECT has " + to_string(select_names.size()) + " columns but INSERT needs "
+				+ to_string(input_column_names.size()));
 		}
+		for (auto row : *selected) {
+			ValueDict *input_row = new ValueDict();
+			for (uint i = 0; i < input_column_names.size(); i++)
+				(*input_row)[input_column_names[i]] = row->get_value(i);
+			rows.push_back(input_row);
+			delete row;
+		}
+		delete selected;
+	}
+	else {
+		// get values from statement
+		vector<Value> records;
+		for (auto const record : *statement->values) {
+			switch (record->type) {
+			case kExprLiteralString:
+				records.push_back(Value(record->name));
+				break;
+			case kExprLiteralInt:
+				records.push_back(Value(record->ival));
+				break;
+			default:
+				throw DbRelationError("Unsupported Data type!");
+			}
+		}
+		ValueDict *row = new ValueDict();
+		for (u_int16_t i = 0; i < input_column_names.size() && i < records.size(); i++)
+			(*row)[input_column_names.at(i)] = records.at(i);
+		rows.push_back(row);
 	}
 
-	// to hold the number indices
-	uint size;
-	// to hold handle for column
-	Handle column_handle;
+	// insert rows to table
+	Handles *handles;
 	try {
-		// to hold row
-		ValueDict row;
-		Identifier column_name;
-		for (u_int16_t i = 0; i < input_column_names.size(); i++) {
-			column_name = input_column_names.at(i);
-			row[column_name] = records.at(i);
-		}
-		// insert row to table
-		column_handle = table.insert(&row);
+		handles = table.insert_many(&rows);
+	}
+	catch (exception& e) {
+		for (auto row : rows)
+			delete row;
+		throw;
+	}
+	for (auto row : rows)
+		delete row;
 
-		// update index
-		IndexNames index_names = SQLExec::indices->get_index_names(table_name);
-		size = index_names.size();
-		try {
-			for (u_int16_t i = 0; i < index_names.size(); i++) {
-				DbIndex &index = SQLExec::indices->get_index(table_name, index_names[i]);
-				index.insert(column_handle);
+	// update indices
+	size_t index_count;
+	try {
+		index_count = insert_indices(table, handles);
+	}
+	catch (exception& e) {
+		delete handles;
+		throw;
+	}
+
+	u_long inserted = handles->size();
+	delete handles;
+	string suffix = "";
+	if (index_count != 0) {
+		suffix = " and " + to_string(index_count) + " indices";
+	}
+	return new QueryResult("successfully inserted " + to_string(inserted) + (inserted == 1 ? " row" : " rows")
+		+ " into " + table_name + suffix);
+}
+
+// add new rows to the indices, one index at a time over all the rows
+size_t SQLExec::insert_indices(DbRelation &table, const Handles *handles) {
+	Identifier table_name = table.get_table_name();
+	IndexNames index_names = SQLExec::indices->get_index_names(table_name);
+	uint done = 0;
+	try {
+		for (; done < index_names.size(); done++) {
+			DbIndex &index = SQLExec::indices->get_index(table_name, index_names[done]);
+			index.insert_many(handles);
+		}
+	}
+	catch (exception& e) {
+		// take the new rows back out of the table and of the indices updated so far,
+		// including the one that failed partway (rows it never got are skipped)
+		for (uint i = 0; i <= done && i < index_names.size(); i++) {
+			DbIndex &index = SQLExec::indices->get_index(table_name, index_names[i]);
+			for (auto const &handle : *handles) {
+				try {
+					index.del(handle);
+				}
+				catch (...) {}
 			}
 		}
-		catch (exception& e) {
-			for (u_int16_t i = 0; i < index_names.size(); i++) {
-				DbIndex &index = SQLExec::indices->get_index(table_name, index_names[i]);
-				index.del(column_handle);
+		for (auto const &handle : *handles)
+			table.del(handle);
+		throw;
+	}
+	return index_names.size();
+}
+
+// exectue IMPORT SQL statement: IMPORT FROM CSV|TBL FILE '<path>' INTO <table>
+// Each line of the file is one row, its fields in the table's column order, separated by
+// commas (CSV, where a field may be double-quoted) or by '|' (TBL, which also ends each
+// line with one). Rows go into the table a chunk at a time through insert_many without
+// touching the indices, which are brought up to date over all the rows at the end. If
+// any line is bad, none of the file is loaded.
+QueryResult *SQLExec::import(const ImportStatement *statement) {
+	// rows handed to insert_many at a time
+	const uint CHUNK_ROWS = 1000;
+
+	// get table name
+	Identifier table_name = statement->tableName;
+	// get table
+	DbRelation &table = SQLExec::tables->get_table(table_name);
+	const ColumnNames &column_names = table.get_column_names();
+	const ColumnAttributes &column_attributes = table.get_column_attributes();
+	char delimiter = statement->type == kImportTbl ? '|' : ',';
+
+	ifstream in(statement->filePath);
+	if (!in)
+		throw DbRelationError(string("cannot open ") + statement->filePath);
+
+	Handles *handles = new Handles();
+	ValueDicts rows;
+	u_long line_number = 0;
+	// write out the rows read so far
+	auto insert_rows = [&table, &rows, handles]() {
+		Handles *chunk = table.insert_many(&rows);
+		handles->insert(handles->end(), chunk->begin(), chunk->end());
+		delete chunk;
+		for (auto row : rows)
+			delete row;
+		rows.clear();
+	};
+	try {
+		string line;
+		while (getline(in, line)) {
+			line_number++;
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			if (delimiter == '|' && line.back() == '|')
+				line.pop_back();
+
+			// split the line into fields
+			vector<string> fields(1);
+			bool quoted = false;
+			for (size_t i = 0; i < line.length(); i++) {
+				char c = line[i];
+				if (delimiter == ',' && c == '"') {
+					if (quoted && i + 1 < line.length() && line[i + 1] == '"')
+						fields.back() += line[++i];  // "" inside quotes is a quote
+					else
+						quoted = !quoted;
+				}
+				else if (c == delimiter && !quoted) {
+					fields.push_back("");
+				}
+				else {
+					fields.back() += c;
+				}
 			}
+			if (fields.size() != column_names.size())
+				throw DbRelationError("has " + to_string(fields.size()) + " fields, table has "
+					+ to_string(column_names.size()) + " columns");
+
+			ValueDict *row = new ValueDict();
+			rows.push_back(row);
+			for (uint i = 0; i < column_names.size(); i++)
+				(*row)[column_names[i]] = import_value(fields[i], column_attributes[i]);
+			if (rows.size() >= CHUNK_ROWS)
+				insert_rows();
 		}
+		if (!rows.empty())
+			insert_rows();
 	}
 	catch (exception& e) {
-		try {
-			table.del(column_handle);
+		// take out the rows of the chunks already written, whatever went wrong
+		for (auto row : rows)
+			delete row;
+		for (auto const &handle : *handles) {
+			try {
+				table.del(handle);
+			}
+			catch (...) {}
 		}
-		catch (...) {}
+		delete handles;
+		if (dynamic_cast<DbRelationError*>(&e) != nullptr)
+			throw DbRelationError(string(statement->filePath) + " line " + to_string(line_number) + ": " + e.what());
+		throw;
+	}
+
+	// build indices
+	size_t index_count;
+	try {
+		index_count = insert_indices(table, handles);
+	}
+	catch (exception& e) {
+		delete handles;
 		throw;
 	}
+
+	u_long imported = handles->size();
+	delete handles;
 	string suffix = "";
-	if (size != 0) {
-		suffix = " and " + to_string(size) + " indices";
+	if (index_count != 0) {
+		suffix = " and " + to_string(index_count) + " indices";
 	}
-	return new QueryResult("successfully inserted 1 row into " + table_name + suffix);
+	return new QueryResult("successfully imported " + to_string(imported) + " rows into " + table_name + suffix);
 }
 
-// exectue SELECT SQL statement
-QueryResult *SQLExec::select(const SelectStatement *statement) {
+// helper function for import
+Value SQLExec::import_value(const string &field, const ColumnAttribute &column_attribute) {
+	switch (column_attribute.get_data_type()) {
+	case ColumnAttribute::INT: {
+		char *end;
+		errno = 0;
+		long n = strtol(field.c_str(), &end, 10);
+		if (field.empty() || *end != '\0' || errno != 0 || n < INT32_MIN || n > INT32_MAX)
+			throw DbRelationError("'" + field + "' is not an INT");
+		return Value((int32_t)n);
+	}
+	case ColumnAttribute::BOOLEAN: {
+		Value value;
+		value.data_type = ColumnAttribute::BOOLEAN;
+		if (field == "1" || field == "true" || field == "TRUE")
+			value.n = 1;
+		else if (field == "0" || field == "false" || field == "FALSE")
+			value.n = 0;
+		else
+			throw DbRelationError("'" + field + "' is not a BOOLEAN");
+		return value;
+	}
+	default:
+		return Value(field);
+	}
+}
+
+// build the plan for a SELECT and name its result columns
+EvalPlan *SQLExec::select_plan(const SelectStatement *statement, ColumnNames &query_names) {
 	// get table name
 	Identifier table_name = statement->fromTable->name;
 	// get table
 	DbRelation &table = SQLExec::tables->get_table(table_name);
 
 	// to hold column names
-	ColumnNames *query_names = new ColumnNames();
 	vector<Expr*>* select_list = statement->selectList;
 	if (select_list->at(0)->type == kExprStar) {
 		select_list = nullptr;
-		*query_names = table.get_column_names();
+		query_names = table.get_column_names();
 	}
 	else {
 		for (uint i = 0; i < select_list->size(); i++) {
-			try {
-				query_names->push_back(select_list->at(i)->name);
-			}
-			catch (exception& e) {
+			if (select_list->at(i)->name == nullptr)
 				throw DbRelationError("Unsupported column type!");
-			}
+			query_names.push_back(select_list->at(i)->name);
 		}
 	}
 
@@ -665,17 +971,150 @@ QueryResult *SQLExec::select(const SelectStatement *statement) {
 	}
 	// in case of specified column/s selection
 	if (select_list != nullptr) {
-		plan = new EvalPlan(query_names, plan);
+		plan = new EvalPlan(new ColumnNames(query_names), plan);
 		// in case of '*' selection
 	}
 	else {
 		plan = new EvalPlan(EvalPlan::ProjectAll, plan);
 	}
-	plan = plan->optimize();
-	ValueDicts *rows = plan->evaluate();
+	EvalPlan *optimized = plan->optimize(SQLExec::indices);
+	delete plan;
+	return optimized;
+}
 
-	return new QueryResult(query_names, table.get_column_attributes(*query_names),
-		rows, "successfully returned " + to_string(rows->size()) + " rows");
+// exectue SELECT SQL statement
+QueryResult *SQLExec::select(const SelectStatement *statement) {
+	// get table
+	DbRelation &table = SQLExec::tables->get_table(statement->fromTable->name);
+	// to hold column names
+	ColumnNames *query_names = new ColumnNames();
+	EvalPlan *plan = nullptr;
+	EvalCursor *cursor;
+	try {
+		plan = select_plan(statement, *query_names);
+		cursor = plan->cursor();
+	}
+	catch (DbRelationError &e) {
+		delete plan;
+		delete query_names;
+		throw;
+	}
+
+	// rows are read as the result is printed
+	return new QueryResult(query_names, table.get_column_attributes(*query_names), plan, cursor);
+}
+
+// execute UPDATE SQL statement: UPDATE <table> SET <column> = <value>, ... [WHERE ...]
+// The table keeps each row's handle through an update (see HeapTable::update), so only the
+// indices keyed on a column being set have their entries taken out and put back. If any
+// row can't be updated or reindexed, the rows are all put back the way they were.
+QueryResult *SQLExec::update(const UpdateStatement *statement) {
+	// get table name
+	Identifier table_name = statement->table->name;
+	// get table
+	DbRelation &table = SQLExec::tables->get_table(table_name);
+
+	// get the new values
+	ValueDict new_values;
+	ColumnNames set_columns;
+	for (auto const clause : *statement->updates) {
+		switch (clause->value->type) {
+		case kExprLiteralString:
+			new_values[clause->column] = Value(clause->value->name);
+			break;
+		case kExprLiteralInt:
+			new_values[clause->column] = Value(clause->value->ival);
+			break;
+		default:
+			throw DbRelationError("Unsupported Data type!");
+		}
+		set_columns.push_back(clause->column);
+	}
+
+	// create evaluation plan
+	EvalPlan *plan = new EvalPlan(table);
+	// in case of using where clause
+	if (statement->where != nullptr) {
+		plan = new EvalPlan(get_where_conjunction(statement->where), plan);
+	}
+	EvalPlan *optimized = plan->optimize(SQLExec::indices);
+	delete plan;
+
+	// to hold handles from pipeline (collected up front since we modify the table as we go)
+	EvalPipeline pipeline = optimized->pipeline();
+	Handles handles;
+	Handle handle;
+	while (pipeline.second->next(handle))
+		handles.push_back(handle);
+	delete pipeline.second;
+	delete optimized;
+
+	// the indices on any of the columns being set
+	vector<DbIndex *> changed;
+	for (auto const &index_name : SQLExec::indices->get_index_names(table_name)) {
+		DbIndex &index = SQLExec::indices->get_index(table_name, index_name);
+		for (auto const &key_column : index.get_key_columns()) {
+			if (new_values.find(key_column) != new_values.end()) {
+				changed.push_back(&index);
+				break;
+			}
+		}
+	}
+
+	// take the rows out of those indices, update them, and put them back in
+	vector<ValueDict *> old_rows;  // the columns being set, as they were
+	uint done = 0;
+	size_t removed = 0;
+	try {
+		for (; done < changed.size(); done++)
+			for (removed = 0; removed < handles.size(); removed++)
+				changed[done]->del(handles[removed]);
+	}
+	catch (exception &e) {
+		for (uint i = 0; i <= done && i < changed.size(); i++)
+			for (size_t j = 0; j < (i < done ? handles.size() : removed); j++)
+				changed[i]->insert(handles[j]);
+		throw;
+	}
+	bool reindexing = false;
+	try {
+		for (auto const &handle : handles) {
+			old_rows.push_back(table.project(handle, &set_columns));
+			table.update(handle, &new_values);
+		}
+		reindexing = true;
+		for (done = 0; done < changed.size(); done++)
+			changed[done]->insert_many(&handles);
+	}
+	catch (exception &e) {
+		// the indices updated so far lose the new entries and the table gets the old values
+		if (reindexing) {
+			for (uint i = 0; i <= done && i < changed.size(); i++) {
+				for (auto const &handle : handles) {
+					try {
+						changed[i]->del(handle);
+					}
+					catch (...) {}
+				}
+			}
+		}
+		for (size_t i = 0; i < old_rows.size(); i++)
+			table.update(handles[i], old_rows[i]);
+		for (auto index : changed)
+			index->insert_many(&handles);
+		for (auto old_row : old_rows)
+			delete old_row;
+		throw;
+	}
+	for (auto old_row : old_rows)
+		delete old_row;
+
+	string suffix = "";
+	if (changed.size() != 0) {
+		suffix = " and " + to_string(changed.size()) + " indices";
+	}
+	return new QueryResult("successfully updated " + to_string(handles.size())
+		+ (handles.size() == 1 ? " row" : " rows") + " in " + table_name + suffix);
 }
 
 // exectue DELETE SQL statement
@@ -690,18 +1129,19 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
 	// in case of using where clause
 	if (statement->expr != nullptr) {
 		plan = new EvalPlan(get_where_conjunction(statement->expr), plan);
-		// in case of no where clause
-	}
-	else {
-		plan = plan->optimize();
 	}
+	plan = plan->optimize(SQLExec::indices);
 
 	// to hold evaluation pipeline
 	EvalPipeline pipeline = plan->pipeline();
 	// to hold index names
 	IndexNames index_names = SQLExec::indices->get_index_names(table_name);
-	// to hold hanles from piepleline
-	Handles *handles = pipeline.second;
+	// to hold hanles from piepleline (collected up front since we modify the table as we go)
+	Handles *handles = new Handles();
+	Handle handle;
+	while (pipeline.second->next(handle))
+		handles->push_back(handle);
+	delete pipeline.second;
 	// iterate to delete index from index table
 	for (auto const &index_name : index_names) {
 		DbIndex& index = SQLExec::indices->get_index(table_name, index_name);
@@ -722,5 +1162,52 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
 		pipeline.first->del(handle);
 	}
 
-	return new QueryResult("successfully deleted " + to_string(handles->size()) + " rows from " + table_name + suffix);
+	u_long deleted = handles->size();
+	delete handles;
+
+	return new QueryResult("successfully deleted " + to_string(deleted) + " rows from " + table_name + suffix);
+}
+
+// Run one statement for test_sql_exec. The statement must fail if fails is set; a SELECT
+// must return rows rows unless rows is negative.
+static bool test_statement(const string &sql, bool fails = false, int rows = -1) {
+	SQLParserResult *parse = SQLParser::parseSQLString(sql);
+	bool ok = parse->isValid() && parse->size() == 1;
+	if (ok) {
+		try {
+			QueryResult *result = SQLExec::execute(parse->getStatement(0));
+			if (rows >= 0)
+				ok = result->get_rows()->size() == (size_t)rows;
+			delete result;
+			ok = ok && !fails;
+		}
+		catch (SQLExecError &e) {
+			ok = fails;
+		}
+	}
+	delete parse;
+	return ok;
+}
+
+// Runs against the live database, so its tables have names of its own, and it only drops
+// the tables it managed to create.
+bool test_sql_exec() {
+	bool made_src = test_statement("create table sql5300_test_dup_src (a int)");
+	bool made = made_src && test_statement("create table sql5300_test_dup (a int)");
+	bool ok = made
+		&& test_statement("insert into sql5300_test_dup_src values (1)")
+		&& test_statement("insert into sql5300_test_dup_src values (7)")
+		&& test_statement("create index sql5300_test_dup_a on sql5300_test_dup (a)")
+		&& test_statement("insert into sql5300_test_dup values (7)")
+		// 1 goes into the index before 7 turns out to be a duplicate; both rows come back out
+		&& test_statement("insert into sql5300_test_dup select * from sql5300_test_dup_src", true)
+		&& test_statement("select * from sql5300_test_dup where a = 1", false, 0)
+		&& test_statement("insert into sql5300_test_dup values (1)")
+		&& test_statement("select * from sql5300_test_dup where a = 1", false, 1);
+	if (made)
+		ok = test_statement("drop table sql5300_test_dup") && ok
+			&& test_statement("drop table sql5300_test_dup", true);  // unknown now, so an error rather than a crash
+	if (made_src)
+		ok = test_statement("drop table sql5300_test_dup_src") && ok;
+	return ok;
 }
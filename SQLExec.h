@@ -11,6 +11,9 @@
 #include "SQLParser.h"
 #include "schema_tables.h"
 
+class EvalPlan;
+class EvalCursor;
+
 /**
  * @class SQLExecError - exception for SQLExec methods
  */
@@ -22,30 +25,51 @@ public:
 
 /**
  * @class QueryResult - data structure to hold all the returned data for a query execution
+ *
+ * A streaming result holds the plan and cursor of a SELECT instead of its rows: printing it
+ * writes each row (or batch of rows) as the cursor produces it, so the rows are never all in
+ * memory at once. Its message, with the row count, is known once the rows have been read.
+ * A streaming result can only be read once, either by printing it or by get_rows().
  */
 class QueryResult {
 public:
-    QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message("") {}
+    QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message(""),
+                    plan(nullptr), cursor(nullptr) {}
 
     QueryResult(std::string message) : column_names(nullptr), column_attributes(nullptr), rows(nullptr),
-                                       message(message) {}
+                                       message(message), plan(nullptr), cursor(nullptr) {}
+
+    // rows' fields follow column_names
+    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, Tuples *rows, std::string message)
+                : column_names(column_names), column_attributes(column_attributes), rows(rows), message(message),
+                  plan(nullptr), cursor(nullptr) {}
 
-    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, ValueDicts *rows, std::string message)
-                : column_names(column_names), column_attributes(column_attributes), rows(rows), message(message) {}
+    // streaming result; takes ownership of plan and of cursor (which must be plan's)
+    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, EvalPlan *plan, EvalCursor *cursor)
+                : column_names(column_names), column_attributes(column_attributes), rows(nullptr), message(""),
+                  plan(plan), cursor(cursor) {}
 
     virtual ~QueryResult();
 
     ColumnNames *get_column_names() const { return column_names; }
     ColumnAttributes *get_column_attributes() const { return column_attributes; }
-    ValueDicts *get_rows() const { return rows; }
+    Tuples *get_rows() const;  // reads in all the rows of a streaming result
     const std::string &get_message() const { return message; }
     friend std::ostream &operator<<(std::ostream &stream, const QueryResult &qres);
 
 protected:
+    static const size_t OUTPUT_BUFFER_SZ = 64 * 1024;
+
     ColumnNames *column_names;
     ColumnAttributes *column_attributes;
-    ValueDicts *rows;
-    std::string message;
+    // a streaming result fills in rows and message as it is read
+    mutable Tuples *rows;
+    mutable std::string message;
+    EvalPlan *plan;
+    mutable EvalCursor *cursor;
+
+    void print_rows(std::ostream &out) const;
+    void done(u_long row_count) const;
 };
 
 
@@ -78,6 +102,8 @@ protected:
     static QueryResult *show_columns(const hsql::ShowStatement *statement);
     static QueryResult *show_index(const hsql::ShowStatement *statement);
     static QueryResult *insert(const hsql::InsertStatement *statement);
+    static QueryResult *import(const hsql::ImportStatement *statement);
+    static QueryResult *update(const hsql::UpdateStatement *statement);
     static QueryResult *del(const hsql::DeleteStatement *statement);
     static QueryResult *select(const hsql::SelectStatement *statement);
 
@@ -89,4 +115,31 @@ protected:
      */
     static void column_definition(const hsql::ColumnDefinition *col, Identifier &column_name, ColumnAttribute &column_attribute);
     static ValueDict* get_where_conjunction(const hsql::Expr *where_clause);
+
+    /**
+     * Build the optimized evaluation plan for a SELECT.
+     * @param statement    the SELECT
+     * @param query_names  gets the names of the result columns, in select-list order
+     * @returns            the plan (freed by caller)
+     */
+    static EvalPlan* select_plan(const hsql::SelectStatement *statement, ColumnNames &query_names);
+
+    /**
+     * Add newly inserted rows to each of the table's indices. If that fails, the rows are
+     * taken back out of the table (and of the indices done so far) and the error rethrown.
+     * @param table    the table the rows were inserted into
+     * @param handles  the new rows
+     * @returns        the number of indices
+     */
+    static size_t insert_indices(DbRelation &table, const Handles *handles);
+
+    /**
+     * Convert one field of an imported file to a column's type.
+     * @param field             the text of the field
+     * @param column_attribute  the column it is for
+     * @returns                 the value
+     */
+    static Value import_value(const std::string &field, const ColumnAttribute &column_attribute);
 };
+
+bool test_sql_exec();
@@ -7,6 +7,7 @@
  */
 #include "btree.h"
 #include <typeinfo>
+#include <algorithm>
 
 /**
  * constructor for the BTreeIndex
@@ -18,13 +19,12 @@
 BTreeIndex::BTreeIndex(DbRelation& relation, Identifier name,
                        ColumnNames key_columns, bool unique)
         : DbIndex(relation, name, key_columns, unique),
+          fill_factor(DEFAULT_FILL_FACTOR),
           closed(true),
           stat(nullptr),
           root(nullptr),
           file(relation.get_table_name() + "-" + name),
           key_profile() {
-    if (!unique)
-        throw DbRelationError("BTree index must have unique key");
 	  this->build_key_profile();
 }
 
@@ -37,19 +37,142 @@ BTreeIndex::~BTreeIndex() {
 }
 
 /**
- * Create the btree index
+ * Create the btree index. Rather than inserting one row at a time, all the keys
+ * are read and sorted once and the tree is bulk loaded bottom-up.
  */
 void BTreeIndex::create() {
+    // sort first so that a duplicate key fails before there is a file to clean up
+    KeyHandles entries;
+    add_entries(this->relation.select_cursor(), entries);
+    sort_entries(entries);
+
 	  this->file.create();
     this->stat = new BTreeStat(this->file, this->STAT, this->STAT + 1, this->key_profile);
-    this->root = new BTreeLeaf(this->file, this->stat->get_root_id(), this->key_profile, true);
     this->closed = false;
-    Handles *handles = this->relation.select();
-    for (auto const &handle: *handles) {
-        this->insert(handle);
+    this->bulk_load(entries);
+    this->load_root();
+}
+
+// helper function for create and insert_many: the (key, handle) pair of each row of
+// the cursor, which is deleted when it runs out
+void BTreeIndex::add_entries(DbCursor *rows, KeyHandles &entries) const {
+    Handle handle;
+    while (rows->next(handle)) {
+        ValueDict *row = this->relation.project(handle, &this->key_columns);
+        KeyValue *key = this->tkey(row);
+        entries.push_back(KeyHandle(*key, handle));
+        delete key;
+        delete row;
+    }
+    delete rows;
+}
+
+// helper function for create and insert_many: put entries in key order and, for a unique
+// index, make sure no two have the same key
+void BTreeIndex::sort_entries(KeyHandles &entries) const {
+    std::sort(entries.begin(), entries.end());
+    if (!this->unique)
+        return;
+    for (uint i = 1; i < entries.size(); i++) {
+        if (entries[i - 1].first == entries[i].first)
+            throw DbRelationError("Duplicate keys are not allowed in unique index");
+    }
+}
+
+// read in the root node the stat block points to
+void BTreeIndex::load_root() {
+    if (this->stat->get_height() == 1) {
+        this->root = new BTreeLeaf(this->file, this->stat->get_root_id(), this->key_profile, false);
+    } else {
+        this->root = new BTreeInterior(this->file, this->stat->get_root_id(), this->key_profile, false);
     }
 }
 
+/**
+ * Set how full create() packs each node
+ * @param percent     1 to 100; lower leaves more room for inserts before nodes split
+ */
+void BTreeIndex::set_fill_factor(uint percent) {
+    if (percent == 0 || percent > 100)
+        throw DbRelationError("fill factor must be from 1 to 100 percent");
+    this->fill_factor = percent;
+}
+
+// helper function for create: write the sorted entries into leaves packed to the
+// fill factor, chaining them with next_leaf, then build each interior level over
+// the one below until a single root is left, and record it in the stat block.
+// The first leaf goes into first_leaf, an empty leaf already in the file, if one is given.
+void BTreeIndex::bulk_load(const KeyHandles &entries, BlockID first_leaf) {
+    const uint slot = 4;  // each record also costs a slot header in its SlottedPage
+    const uint capacity = BTreeNode::CAPACITY * this->fill_factor / 100;
+
+    // leaves: (handles, key) pairs, one per run of equal keys, followed by the next_leaf pointer
+    const uint leaf_base = sizeof(BlockID) + slot;
+    KeyPointers level;  // lowest key under each node of the level and its block
+    BTreeLeaf *leaf = new BTreeLeaf(this->file, first_leaf, this->key_profile, first_leaf == 0);
+    leaf->set_next_leaf(0);
+    level.push_back(KeyPointer(KeyValue(), leaf->get_id()));
+    uint used = leaf_base;
+    for (size_t start = 0, end; start < entries.size(); start = end) {
+        const KeyValue &key = entries[start].first;
+        Handles handles;
+        for (end = start; end < entries.size() && entries[end].first == key; end++)
+            handles.push_back(entries[end].second);
+        uint size = BTreeLeaf::posting_size((uint)handles.size()) + this->key_size(&key) + 2 * slot;
+        if (used > leaf_base && used + size > capacity) {
+            BTreeLeaf *next = new BTreeLeaf(this->file, 0, this->key_profile, true);
+            leaf->set_next_leaf(next->get_id());
+            leaf->save();
+            delete leaf;
+            leaf = next;
+            level.push_back(KeyPointer(key, leaf->get_id()));
+            used = leaf_base;
+        }
+        leaf->append(&key, handles);
+        used += size;
+    }
+    leaf->save();
+    delete leaf;
+
+    // interior nodes: first pointer followed by (key, pointer) pairs, at least one pair
+    // each (however low the fill factor) so every level is smaller than the one below
+    const uint interior_base = sizeof(BlockID) + slot;
+    uint height = 1;
+    while (level.size() > 1) {
+        KeyPointers parents;
+        BTreeInterior *node = nullptr;
+        for (auto const &child: level) {
+            uint size = this->key_size(&child.first) + sizeof(BlockID) + 2 * slot;
+            if (node == nullptr || (used > interior_base && used + size > capacity)) {
+                if (node != nullptr) {
+                    node->save();
+                    delete node;
+                }
+                node = new BTreeInterior(this->file, 0, this->key_profile, true);
+                node->set_first(child.second);
+                parents.push_back(KeyPointer(child.first, node->get_id()));
+                used = interior_base;
+            } else {
+                node->append(&child.first, child.second);
+                used += size;
+            }
+        }
+        node->save();
+        delete node;
+        level = parents;
+        height++;
+    }
+
+    this->stat->set_root_id(level[0].second);
+    this->stat->set_height(height);
+    this->stat->save();
+}
+
+// helper function to get the number of bytes a key takes when marshaled into a node
+uint BTreeIndex::key_size(const KeyValue* key) const {
+    return BTreeNode::key_size(this->key_profile, key);
+}
+
 /**
  * Drop the btree index
  */
@@ -59,16 +182,21 @@ void BTreeIndex::drop() {
 
 /**
  * Open existing btree index. Enables: lookup, range, insert, delete, update
+ * An index whose nodes were written in an older key format is dropped and built again
+ * from the relation, since its keys can't be compared with the ones we marshal now.
  */
 void BTreeIndex::open() {
 	  if (this->closed == true) {
         this->file.open();
         this->stat = new BTreeStat(this->file, this->STAT, this->key_profile);
-        if (this->stat->get_height() == 1) {
-            this->root = new BTreeLeaf(this->file, this->stat->get_root_id(), this->key_profile, false);
-        } else {
-            this->root = new BTreeInterior(this->file, this->stat->get_root_id(), this->key_profile, false) ;
+        if (this->stat->get_format() != BTreeStat::KEY_FORMAT) {
+            delete this->stat;
+            this->stat = nullptr;
+            this->file.drop();
+            this->create();
+            return;
         }
+        this->load_root();
         this->closed = false;
     }
 }
@@ -77,6 +205,8 @@ void BTreeIndex::open() {
  * Closes the btree index. Disables: lookup, range, insert, delete, update
  */
 void BTreeIndex::close() {
+    delete this->stat;
+    delete this->root;
 	  this->file.close();
     this->stat = nullptr;
     this->root = nullptr;
@@ -85,29 +215,35 @@ void BTreeIndex::close() {
 
 /**
  * Find all the rows whose columns are equal to key. Assumes key is a dictionary
- * whose keys are the column names in the index. Returns a list of row handles
+ * whose keys are the column names in the index. Returns a list of row handles.
+ * Nodes are searched in their blocks without being read into BTreeNodes.
  * @param key_dict     ValueDict type key to find the target, which is map of
                        pairs of Identifier (column name) and Value (int or text)
  * @return Handles*    Set of handles holding blockId and recordId as pair
  */
 Handles* BTreeIndex::lookup(ValueDict* key_dict) const {
-	  return this->_lookup(this->root, this->stat->get_height(), this->tkey(key_dict));
+    KeyValue *key = this->tkey(key_dict);
+    Dbt *bytes = BTreeNode::marshal_key(this->key_profile, key);
+    delete key;
+    Handles *handles = new Handles();
+    SlottedPage *leaf = this->file.get(this->find_leaf_id(*bytes));
+    BTreeLeaf::search(this->file, leaf, *bytes, *handles);
+    this->file.unpin(leaf);
+    delete[] (char *) bytes->get_data();
+    delete bytes;
+    return handles;
 }
 
-// helper function of looup funnction
-Handles* BTreeIndex::_lookup(BTreeNode *node, uint height, const KeyValue* key) const {
-    Handles *handles = new Handles();
-    if (dynamic_cast<BTreeLeaf*>(node) != NULL) {
-        BTreeLeaf *leaf = (BTreeLeaf*)node;
-        try {
-            Handle handle = leaf->find_eq(key);
-            handles->push_back(handle);
-        } catch (std::out_of_range) {}
-        return handles;
-    } else {
-        BTreeInterior *interior = (BTreeInterior*)node;
-        return _lookup(interior->find(key, height), height - 1, key);
+// helper function to descend from the root to the block of the leaf where the marshaled
+// key belongs (the leftmost leaf for no bytes)
+BlockID BTreeIndex::find_leaf_id(const Dbt &key) const {
+    BlockID block_id = this->stat->get_root_id();
+    for (uint height = this->stat->get_height(); height > 1; height--) {
+        SlottedPage *node = this->file.get(block_id);
+        block_id = BTreeInterior::search(node, key);
+        this->file.unpin(node);
     }
+    return block_id;
 }
 
 /**
@@ -117,7 +253,46 @@ Handles* BTreeIndex::_lookup(BTreeNode *node, uint height, const KeyValue* key)
  * @param handle     pair of blockId and recordId to be used for insertion
  */
 void BTreeIndex::insert(Handle handle) {
-    KeyValue *tkey = this->tkey(this->relation.project(handle, &this->key_columns));
+    ValueDict *row = this->relation.project(handle, &this->key_columns);
+    KeyValue *tkey = this->tkey(row);
+    delete row;
+    try {
+        this->insert(tkey, handle);
+    } catch (DbRelationError &e) {
+        delete tkey;
+        throw;
+    }
+    delete tkey;
+}
+
+// Insert the entries of many records in key order, so that runs of them go into the same
+// leaf. If the tree is still empty, it is bulk loaded with them instead (see create),
+// starting in its empty root leaf's block so that no block is left behind.
+void BTreeIndex::insert_many(const Handles *handles) {
+    KeyHandles entries;
+    add_entries(new HandlesCursor(new Handles(*handles)), entries);
+    sort_entries(entries);
+    BTreeLeaf *leaf = dynamic_cast<BTreeLeaf*>(this->root);
+    if (leaf != nullptr && leaf->get_entries().empty()) {
+        BlockID root_id = leaf->get_id();
+        delete this->root;
+        this->root = nullptr;
+        try {
+            this->bulk_load(entries, root_id);
+        } catch (...) {
+            this->load_root();
+            throw;
+        }
+        this->load_root();
+        return;
+    }
+    for (auto const &entry : entries)
+        this->insert(&entry.first, entry.second);
+}
+
+// helper function for insert and insert_many: add the entry for key, growing a new root
+// if the old one splits
+void BTreeIndex::insert(const KeyValue *tkey, Handle handle) {
     Insertion split_root = this->_insert(this->root, this->stat->get_height(), tkey, handle);
 
     if (!root->insertion_is_none(split_root)) {
@@ -141,12 +316,20 @@ Insertion BTreeIndex::_insert(BTreeNode *node, uint height, const KeyValue* key,
     Insertion insertion;
     if (dynamic_cast<BTreeLeaf*>(node) != NULL) {
         BTreeLeaf *leaf = (BTreeLeaf*)node;
-        insertion = leaf->insert(key, handle);
+        insertion = leaf->insert(key, handle, this->unique);
         leaf->save();
         return insertion;
     } else {
         BTreeInterior *interior = (BTreeInterior*)node;
-        Insertion new_kid = this->_insert(interior->find(key, height), height - 1, key, handle);
+        BTreeNode *child = interior->find(key, height);
+        Insertion new_kid;
+        try {
+            new_kid = this->_insert(child, height - 1, key, handle);
+        } catch (DbRelationError &e) {
+            delete child;
+            throw;
+        }
+        delete child;
         if (!interior->insertion_is_none(new_kid)) {
             insertion = interior->insert(&new_kid.second, new_kid.first);
             interior->save();
@@ -169,6 +352,34 @@ KeyValue *BTreeIndex::tkey(const ValueDict *key) const {
 	  return rows;
 }
 
+// helper function to get the values of the leading key columns present in key,
+// in order (a range bound may leave off trailing columns)
+KeyValue *BTreeIndex::tkey_prefix(const ValueDict *key) const {
+    KeyValue *prefix = new KeyValue;
+    for (auto const &column_name : this->key_columns) {
+        auto found = key->find(column_name);
+        if (found == key->end())
+            break;
+        prefix->push_back(found->second);
+    }
+    if (prefix->size() != key->size()) {
+        delete prefix;
+        throw DbRelationError("range bound must be a leading prefix of the index key");
+    }
+    return prefix;
+}
+
+// helper function to read in the leaf where key belongs (the leftmost leaf for a nullptr
+// key); the leaf is freed by caller
+BTreeLeaf *BTreeIndex::find_leaf(const KeyValue* key) const {
+    KeyValue none;
+    Dbt *bytes = BTreeNode::marshal_key(this->key_profile, key == nullptr ? &none : key);
+    BlockID leaf_id = this->find_leaf_id(*bytes);
+    delete[] (char *) bytes->get_data();
+    delete bytes;
+    return new BTreeLeaf(this->file, leaf_id, this->key_profile, false);
+}
+
 // helper function to build key profiles which is a vector of column attributes
 // of the b-tree index key
 void BTreeIndex::build_key_profile() {
@@ -177,14 +388,210 @@ void BTreeIndex::build_key_profile() {
     }
 }
 
-// Not part of sprint3
-Handles* BTreeIndex::range(ValueDict* min_key, ValueDict* max_key) const {
-    throw DbRelationError("Don't know how to do a range query on Btree index yet");
+/**
+ * Find all the rows whose keys fall between min_key and max_key, in key order.
+ * Either bound may name just a leading prefix of the key columns.
+ * @param min_key        lower bound (nullptr for unbounded)
+ * @param max_key        upper bound (nullptr for unbounded)
+ * @param min_inclusive  true if keys equal to min_key qualify
+ * @param max_inclusive  true if keys equal to max_key qualify
+ * @return Handles*      handles of the qualifying rows
+ */
+Handles* BTreeIndex::range(ValueDict* min_key, ValueDict* max_key,
+                           bool min_inclusive, bool max_inclusive) const {
+    Handles *handles = new Handles();
+    DbCursor *cursor = this->range_cursor(min_key, max_key, min_inclusive, max_inclusive);
+    Handle handle;
+    while (cursor->next(handle))
+        handles->push_back(handle);
+    delete cursor;
+    return handles;
+}
+
+/**
+ * Same as range, but streams the handles: descends once to the leaf where min_key
+ * would be and then follows the next_leaf chain.
+ * @return DbCursor*     cursor over the qualifying handles (freed by caller)
+ */
+DbCursor* BTreeIndex::range_cursor(ValueDict* min_key, ValueDict* max_key,
+                                   bool min_inclusive, bool max_inclusive) const {
+    KeyValue *min = min_key == nullptr ? nullptr : this->tkey_prefix(min_key);
+    KeyValue *max = max_key == nullptr ? nullptr : this->tkey_prefix(max_key);
+    return new BTreeRangeCursor(this->file, this->key_profile, this->find_leaf(min),
+                                min, max, min_inclusive, max_inclusive);
 }
 
-// Not part of sprint3
+/**
+ * BTreeRangeCursor
+ */
+
+// compare key against a bound that may cover only its leading columns:
+// negative, zero, or positive as key sorts before, within, or after the bound
+static int compare_prefix(const KeyValue &key, const KeyValue &bound) {
+    for (uint i = 0; i < bound.size(); i++) {
+        if (key[i] < bound[i])
+            return -1;
+        if (bound[i] < key[i])
+            return 1;
+    }
+    return 0;
+}
+
+BTreeRangeCursor::BTreeRangeCursor(HeapFile &file, const KeyProfile &key_profile, BTreeLeaf *leaf,
+                                   KeyValue *min_key, KeyValue *max_key,
+                                   bool min_inclusive, bool max_inclusive)
+        : file(file), key_profile(key_profile), leaf(leaf), position(), posting(), posting_position(0),
+          min_key(min_key), max_key(max_key), min_inclusive(min_inclusive), max_inclusive(max_inclusive) {
+    if (min_key == nullptr)
+        this->position = leaf->get_entries().begin();
+    else
+        this->position = leaf->get_entries().lower_bound(*min_key);
+}
+
+BTreeRangeCursor::~BTreeRangeCursor() {
+    delete this->leaf;
+    delete this->min_key;
+    delete this->max_key;
+}
+
+// Yield the next handle in key order (all of a key's, in turn), moving along to the next
+// leaf as each runs out.
+bool BTreeRangeCursor::next(Handle &handle) {
+    while (this->leaf != nullptr) {
+        if (this->posting_position < this->posting.size()) {
+            handle = this->posting[this->posting_position++];
+            return true;
+        }
+        if (this->position == this->leaf->get_entries().end()) {
+            BlockID next_leaf = this->leaf->get_next_leaf();
+            delete this->leaf;
+            this->leaf = nullptr;
+            if (next_leaf != 0) {
+                this->leaf = new BTreeLeaf(this->file, next_leaf, this->key_profile, false);
+                this->position = this->leaf->get_entries().begin();
+            }
+            continue;
+        }
+        const KeyValue &key = this->position->first;
+        if (this->min_key != nullptr) {
+            // skip keys equal to an exclusive bound; after that, every key is past it
+            int cmp = compare_prefix(key, *this->min_key);
+            if (cmp < 0 || (cmp == 0 && !this->min_inclusive)) {
+                this->position++;
+                continue;
+            }
+            delete this->min_key;
+            this->min_key = nullptr;
+        }
+        if (this->max_key != nullptr) {
+            int cmp = compare_prefix(key, *this->max_key);
+            if (cmp > 0 || (cmp == 0 && !this->max_inclusive)) {
+                delete this->leaf;
+                this->leaf = nullptr;
+                break;
+            }
+        }
+        this->posting.clear();
+        this->posting_position = 0;
+        this->leaf->get_handles(this->position->second, this->posting);
+        this->position++;
+    }
+    return false;
+}
+
+/**
+ * Delete the entry for the row with the given handle. Row must still be in the relation.
+ * A node left underfull is merged with a sibling or refilled from one (see _del), and a
+ * root left with a single child is replaced by that child, making the tree shorter. Blocks
+ * of merged-away nodes are left unused.
+ * @param handle     pair of blockId and recordId of the row
+ */
 void BTreeIndex::del(Handle handle) {
-    throw DbRelationError("Don't know how to delete from a BTree index yet");
+    ValueDict *row = this->relation.project(handle, &this->key_columns);
+    KeyValue *tkey = this->tkey(row);
+    delete row;
+    try {
+        this->_del(this->root, this->stat->get_height(), tkey, handle);
+    } catch (DbRelationError &e) {
+        delete tkey;
+        throw;
+    }
+    delete tkey;
+
+    while (this->stat->get_height() > 1 && ((BTreeInterior*)this->root)->boundary_count() == 0) {
+        this->stat->set_root_id(((BTreeInterior*)this->root)->child_id(0));
+        this->stat->set_height(this->stat->get_height() - 1);
+        this->stat->save();
+        delete this->root;
+        this->load_root();
+    }
+}
+
+// helper function for del: take the entry out of the subtree under node, fixing any child
+// it leaves underfull on the way back up. Returns true if node is now underfull itself.
+bool BTreeIndex::_del(BTreeNode *node, uint height, const KeyValue* key, Handle handle) {
+    if (height == 1) {
+        BTreeLeaf *leaf = (BTreeLeaf*)node;
+        leaf->del(key, handle);
+        leaf->save();
+        return leaf->underfull();
+    }
+    BTreeInterior *interior = (BTreeInterior*)node;
+    uint position = interior->child_position(key);
+    BTreeNode *child = interior->find(key, height);
+    bool underfull;
+    try {
+        underfull = this->_del(child, height - 1, key, handle);
+    } catch (DbRelationError &e) {
+        delete child;
+        throw;
+    }
+    if (underfull && interior->boundary_count() > 0)
+        this->rebalance(interior, child, position, height - 1);
+    delete child;
+    return interior->underfull();
+}
+
+// helper function for _del: merge the underfull child at position of parent with the sibling
+// to its left (or, for the first child, to its right), or if they don't fit in one node, move
+// entries across from the sibling, and save the lot. If the new boundary between them is too
+// long for the parent, the pair are left as they were (nothing is saved until it fits).
+void BTreeIndex::rebalance(BTreeInterior *parent, BTreeNode *child, uint position, uint height) {
+    uint separator = position > 0 ? position - 1 : position;  // boundary between the pair
+    BlockID sibling_id = parent->child_id(position > 0 ? position - 1 : position + 1);
+    BTreeNode *sibling;
+    BTreeNode *left, *right;
+    bool merged, balanced = false;
+    if (height == 1) {
+        sibling = new BTreeLeaf(this->file, sibling_id, this->key_profile, false);
+        left = position > 0 ? sibling : child;
+        right = position > 0 ? child : sibling;
+        merged = ((BTreeLeaf*)left)->absorb((BTreeLeaf*)right);
+        if (!merged) {
+            KeyValue boundary = ((BTreeLeaf*)left)->balance((BTreeLeaf*)right);
+            balanced = parent->set_boundary(separator, &boundary);
+        }
+    } else {
+        sibling = new BTreeInterior(this->file, sibling_id, this->key_profile, false);
+        left = position > 0 ? sibling : child;
+        right = position > 0 ? child : sibling;
+        merged = ((BTreeInterior*)left)->absorb(parent->get_boundary(separator), (BTreeInterior*)right);
+        if (!merged) {
+            KeyValue boundary = ((BTreeInterior*)left)->balance(parent->get_boundary(separator),
+                                                                (BTreeInterior*)right);
+            balanced = parent->set_boundary(separator, &boundary);
+        }
+    }
+    if (merged) {
+        left->save();
+        parent->remove(separator);
+        parent->save();
+    } else if (balanced) {
+        left->save();
+        right->save();
+        parent->save();
+    }
+    delete sibling;
 }
 
 /**
@@ -297,5 +704,240 @@ bool test_btree() {
             delete handles4;
         }
     }
+
+    // inserts after the bulk load split the packed nodes, expecting all found
+    for (int i = 0; i < 1000; i++) {
+        ValueDict row;
+        btree_test_set_row(row, 5000 - i, i);
+        index.insert(table1.insert(&row));
+    }
+    for (int i = 0; i < 1000; i++) {
+        ValueDict target;
+        target["a"] = Value(5000 - i);
+        Handles *handles5 = index.lookup(&target);
+        if (handles5->size() != 1)
+            return false;
+        ValueDict *result = table1.project(handles5->at(0));
+        bool same = (*result)["b"] == Value(i);
+        delete result;
+        if (!same)
+            return false;
+        delete handles5;
+    }
+
+    // range scans with closed, open, and unbounded ends, expecting keys in order
+    ValueDict low, high;
+    low["a"] = Value(200);
+    high["a"] = Value(300);
+    Handles *handles7 = index.range(&low, &high);
+    Handles *handles8 = index.range(&low, &high, false, false);
+    Handles *handles9 = index.range(nullptr, &low, true, false);
+    low["a"] = Value(4990);
+    Handles *handles10 = index.range(&low, nullptr);
+    if (handles7->size() != 101 || handles8->size() != 99 || handles9->size() != 102
+        || handles10->size() != 11)
+        return false;
+    for (uint i = 0; i < handles7->size(); i++) {
+        ValueDict *result = table1.project(handles7->at(i));
+        bool same = (*result)["a"] == Value(200 + (int)i);
+        delete result;
+        if (!same)
+            return false;
+    }
+    delete handles7;
+    delete handles8;
+    delete handles9;
+    delete handles10;
+
+    // sparsely packed index has more levels, expecting the same lookups to work
+    BTreeIndex sparse(table1, "test_sparse_index", index_col_names, true);
+    sparse.set_fill_factor(10);
+    sparse.create();
+    for (int j = 0; j < 1000; j++) {
+        ValueDict target;
+        target["a"] = Value(j + 100);
+        Handles *handles6 = sparse.lookup(&target);
+        if (handles6->size() != 1)
+            return false;
+        ValueDict *result = table1.project(handles6->at(0));
+        bool same = (*result)["b"] == Value(-j);
+        delete result;
+        if (!same)
+            return false;
+        delete handles6;
+    }
+    Handles *handles11 = sparse.range(nullptr, nullptr);
+    if (handles11->size() != 2002)
+        return false;
+    delete handles11;
+
+    // deleting most of the keys merges the sparse nodes, expecting the rest still found
+    for (int j = 0; j < 1000; j++) {
+        if (j % 50 == 0)
+            continue;
+        ValueDict target;
+        target["a"] = Value(j + 100);
+        Handles *handles12 = sparse.lookup(&target);
+        sparse.del(handles12->at(0));
+        delete handles12;
+    }
+    for (int j = 0; j < 1000; j++) {
+        ValueDict target;
+        target["a"] = Value(j + 100);
+        Handles *handles13 = sparse.lookup(&target);
+        if (handles13->size() != (j % 50 == 0 ? 1U : 0U))
+            return false;
+        delete handles13;
+    }
+    Handles *handles14 = sparse.range(nullptr, nullptr);
+    if (handles14->size() != 2002 - 980)
+        return false;
+    delete handles14;
+
+    // non-unique index on b, expecting every row of a key (a long run spills to overflow pages)
+    ColumnNames multi_col_names;
+    multi_col_names.push_back(column_names.at(1));
+    BTreeIndex multi(table1, "test_multi_index", multi_col_names, false);
+    multi.create();
+    Handles sevens;
+    for (int i = 0; i < 1000; i++) {
+        ValueDict row;
+        btree_test_set_row(row, 6000 + i, 7);
+        sevens.push_back(table1.insert(&row));
+        if (i < 500)
+            multi.insert(sevens.back());
+    }
+    Handles rest(sevens.begin() + 500, sevens.end());
+    multi.insert_many(&rest);
+    ValueDict seven, zero;
+    seven["b"] = Value(7);
+    zero["b"] = Value(0);
+    Handles *handles15 = multi.lookup(&seven);
+    Handles *handles16 = multi.lookup(&zero);
+    if (handles15->size() != 1001 || handles16->size() != 2)
+        return false;
+    for (auto const &handle : *handles15) {
+        ValueDict *result = table1.project(handle);
+        bool same = (*result)["b"] == Value(7);
+        delete result;
+        if (!same)
+            return false;
+    }
+    delete handles15;
+    delete handles16;
+    for (int i = 0; i < 1000; i++) {
+        if (i % 10 != 0)
+            multi.del(sevens[i]);
+    }
+    Handles *handles17 = multi.lookup(&seven);
+    Handles *handles18 = multi.range(nullptr, nullptr);
+    if (handles17->size() != 101 || handles18->size() != 2002 + 1000 - 900)
+        return false;
+    // negative keys sort before positive ones in the marshaled keys too
+    for (uint i = 1; i < handles18->size(); i++) {
+        ValueDict *result = table1.project(handles18->at(i));
+        ValueDict *previous = table1.project(handles18->at(i - 1));
+        bool ordered = !((*result)["b"] < (*previous)["b"]);
+        delete result;
+        delete previous;
+        if (!ordered)
+            return false;
+    }
+    delete handles17;
+    delete handles18;
+
+    // emptying an index and filling it again reuses its root leaf rather than growing the file
+    HeapTable refill_table("btree_refill_table", column_names, column_attributes);
+    refill_table.create();
+    BTreeIndex refill(refill_table, "test_refill_index", index_col_names, true);
+    refill.create();
+    for (int round = 0; round < 3; round++) {
+        Handles filled;
+        for (int i = 0; i < 50; i++) {
+            ValueDict row;
+            btree_test_set_row(row, i, round);
+            filled.push_back(refill_table.insert(&row));
+        }
+        refill.insert_many(&filled);
+        for (auto const &handle : filled) {
+            refill.del(handle);
+            refill_table.del(handle);
+        }
+    }
+    refill.close();
+    HeapFile refill_file("btree_refill_table-test_refill_index");
+    refill_file.open();
+    BlockID refill_blocks = refill_file.get_last_block_id();
+    refill_file.close();
+    if (refill_blocks != 2)  // the stat block and the root leaf
+        return false;
+
+    // TEXT keys too wide for a 1% fill factor still get two children per interior node
+    ColumnNames wide_col_names;
+    wide_col_names.push_back("s");
+    ColumnAttributes wide_col_attributes;
+    wide_col_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable wide_table("btree_wide_table", wide_col_names, wide_col_attributes);
+    wide_table.create();
+    for (int i = 0; i < 300; i++) {
+        ValueDict row;
+        row["s"] = Value(std::string(200, (char)('a' + i % 26)) + std::to_string(i));
+        wide_table.insert(&row);
+    }
+    BTreeIndex wide(wide_table, "test_wide_index", wide_col_names, true);
+    wide.set_fill_factor(1);
+    wide.create();
+    for (int i = 0; i < 300; i++) {
+        ValueDict target;
+        target["s"] = Value(std::string(200, (char)('a' + i % 26)) + std::to_string(i));
+        Handles *handles19 = wide.lookup(&target);
+        if (handles19->size() != 1)
+            return false;
+        delete handles19;
+    }
+    Handles *handles20 = wide.range(nullptr, nullptr);
+    if (handles20->size() != 300)
+        return false;
+    delete handles20;
+
+    // an index left in the old key format (no FORMAT record) is rebuilt when it is opened
+    index.close();
+    HeapFile raw("btree_test_table-test_index");
+    raw.open();
+    SlottedPage *raw_stat = raw.get(1);
+    raw_stat->del(BTreeStat::FORMAT);
+    raw.put(raw_stat);
+    raw.unpin(raw_stat);
+    raw.close();
+    BTreeIndex reopened(table1, "test_index", index_col_names, true);
+    reopened.open();
+    Handles *handles21 = reopened.lookup(&target1);
+    if (handles21->size() != 1)
+        return false;
+    ValueDict *result21 = table1.project(handles21->at(0));
+    bool same21 = (*result21)["b"] == Value(99);
+    delete result21;
+    if (!same21)
+        return false;
+    delete handles21;
+    reopened.close();
+    HeapFile rebuilt_file("btree_test_table-test_index");
+    rebuilt_file.open();
+    raw_stat = rebuilt_file.get(1);
+    Dbt *format = raw_stat->get(BTreeStat::FORMAT);
+    bool rebuilt = format != nullptr && *(BlockID *)format->get_data() == BTreeStat::KEY_FORMAT;
+    delete format;
+    rebuilt_file.unpin(raw_stat);
+    rebuilt_file.close();
+    if (!rebuilt)
+        return false;
+    wide.drop();
+    wide_table.drop();
+    multi.drop();
+    refill.drop();
+    refill_table.drop();
+    sparse.drop();
+    reopened.drop();
+    table1.drop();
     return true;
 }
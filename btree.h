@@ -2,6 +2,11 @@
 
 #include "BTreeNode.h"
 
+typedef std::pair<KeyValue,Handle> KeyHandle;
+typedef std::vector<KeyHandle> KeyHandles;
+typedef std::pair<KeyValue,BlockID> KeyPointer;
+typedef std::vector<KeyPointer> KeyPointers;
+
 class BTreeIndex : public DbIndex {
 public:
     BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns,
@@ -15,26 +20,72 @@ public:
     virtual void close();
 
     virtual Handles* lookup(ValueDict* key) const;
-    virtual Handles* range(ValueDict* min_key, ValueDict* max_key) const;
+    virtual Handles* range(ValueDict* min_key, ValueDict* max_key,
+                           bool min_inclusive = true, bool max_inclusive = true) const;
+    virtual DbCursor* range_cursor(ValueDict* min_key, ValueDict* max_key,
+                                   bool min_inclusive = true, bool max_inclusive = true) const;
 
     virtual void insert(Handle handle);
+    virtual void insert_many(const Handles* handles);
     virtual void del(Handle handle);
 
     // pull out the key values from the ValueDict in order
     virtual KeyValue *tkey(const ValueDict *key) const;
 
+    // percent of each node that create() packs with entries; the rest is left for later inserts
+    static const uint DEFAULT_FILL_FACTOR = 90;
+    void set_fill_factor(uint percent);
+    uint get_fill_factor() const { return this->fill_factor; }
+
 protected:
     static const BlockID STAT = 1;
+    uint fill_factor;
     bool closed;
     BTreeStat *stat;
     BTreeNode *root;
-    HeapFile file;
+    mutable HeapFile file;  // reading nodes pins blocks, even for const queries
     KeyProfile key_profile;
 
     void build_key_profile();
-    Handles* _lookup(BTreeNode *node, uint height, const KeyValue* key) const;
+    KeyValue *tkey_prefix(const ValueDict *key) const;
+    BTreeLeaf *find_leaf(const KeyValue* key) const;
+    BlockID find_leaf_id(const Dbt &key) const;
+    uint key_size(const KeyValue* key) const;
+    void bulk_load(const KeyHandles &entries, BlockID first_leaf = 0);
+    void add_entries(DbCursor *rows, KeyHandles &entries) const;
+    void sort_entries(KeyHandles &entries) const;
+    void load_root();
+    void insert(const KeyValue* key, Handle handle);
     Insertion _insert(BTreeNode *node, uint height, const KeyValue* key,
                       Handle handle);
+    bool _del(BTreeNode *node, uint height, const KeyValue* key, Handle handle);
+    void rebalance(BTreeInterior *parent, BTreeNode *child, uint position, uint height);
+};
+
+/**
+ * @class BTreeRangeCursor - walks the leaf chain of a BTreeIndex from the leaf holding
+ * the lower bound, yielding handles in key order until a key passes the upper bound
+ */
+class BTreeRangeCursor : public DbCursor {
+public:
+    // takes ownership of leaf, min_key, and max_key (either key may be nullptr for unbounded)
+    BTreeRangeCursor(HeapFile &file, const KeyProfile &key_profile, BTreeLeaf *leaf,
+                     KeyValue *min_key, KeyValue *max_key, bool min_inclusive, bool max_inclusive);
+    virtual ~BTreeRangeCursor();
+
+    virtual bool next(Handle &handle);
+
+protected:
+    HeapFile &file;
+    const KeyProfile &key_profile;
+    BTreeLeaf *leaf;
+    LeafEntries::const_iterator position;
+    Handles posting;  // handles of the key just passed, still to be yielded
+    size_t posting_position;
+    KeyValue *min_key;
+    KeyValue *max_key;
+    bool min_inclusive;
+    bool max_inclusive;
 };
 
 bool test_btree();
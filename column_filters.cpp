@@ -0,0 +1,144 @@
+/**
+ * @file column_filters.cpp - implementation of the column comparison kernels
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <climits>
+#include <string>
+#include <vector>
+#include "column_filters.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLUMN_FILTERS_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*IntEqKernel)(const int32_t *values, uint n, int32_t target, uint64_t *bitmap);
+
+static void clear_bitmap(uint n, uint64_t *bitmap) {
+    for (uint word = 0; word < (n + 63) / 64; word++)
+        bitmap[word] = 0;
+}
+
+// Rows from start on, one at a time (also finishes off the vector kernels).
+static void int_eq_rest(const int32_t *values, uint start, uint n, int32_t target, uint64_t *bitmap) {
+    for (uint i = start; i < n; i++)
+        bitmap[i / 64] |= (uint64_t)(values[i] == target) << (i % 64);
+}
+
+static void int_eq_scalar(const int32_t *values, uint n, int32_t target, uint64_t *bitmap) {
+    clear_bitmap(n, bitmap);
+    int_eq_rest(values, 0, n, target, bitmap);
+}
+
+#ifdef COLUMN_FILTERS_X86
+// Eight rows per compare; the sign bits of the lanes become eight bits of the bitmap.
+__attribute__((target("avx2")))
+static void int_eq_avx2(const int32_t *values, uint n, int32_t target, uint64_t *bitmap) {
+    clear_bitmap(n, bitmap);
+    __m256i key = _mm256_set1_epi32(target);
+    uint i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i lanes = _mm256_loadu_si256((const __m256i *)(values + i));
+        __m256i equal = _mm256_cmpeq_epi32(lanes, key);
+        uint64_t mask = (uint)_mm256_movemask_ps(_mm256_castsi256_ps(equal));
+        bitmap[i / 64] |= mask << (i % 64);
+    }
+    int_eq_rest(values, i, n, target, bitmap);
+}
+
+// Four rows per compare.
+__attribute__((target("sse4.2")))
+static void int_eq_sse42(const int32_t *values, uint n, int32_t target, uint64_t *bitmap) {
+    clear_bitmap(n, bitmap);
+    __m128i key = _mm_set1_epi32(target);
+    uint i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i lanes = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i equal = _mm_cmpeq_epi32(lanes, key);
+        uint64_t mask = (uint)_mm_movemask_ps(_mm_castsi128_ps(equal));
+        bitmap[i / 64] |= mask << (i % 64);
+    }
+    int_eq_rest(values, i, n, target, bitmap);
+}
+#endif
+
+// Pick the widest kernel this CPU supports.
+static IntEqKernel choose_int_eq(const char *&name) {
+#ifdef COLUMN_FILTERS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return int_eq_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        name = "sse4.2";
+        return int_eq_sse42;
+    }
+#endif
+    name = "scalar";
+    return int_eq_scalar;
+}
+
+static const char *int_eq_name = nullptr;
+
+void int_eq_bitmap(const int32_t *values, uint n, int32_t target, uint64_t *bitmap) {
+    static const IntEqKernel kernel = choose_int_eq(int_eq_name);
+    kernel(values, n, target, bitmap);
+}
+
+const char *int_eq_kernel_name() {
+    if (int_eq_name == nullptr) {
+        uint64_t bitmap;
+        int_eq_bitmap(nullptr, 0, 0, &bitmap);
+    }
+    return int_eq_name;
+}
+
+// Booleans are already a bitmap, so this is a copy or a complement, 64 rows a word.
+void bool_eq_bitmap(const uint64_t *bits, uint n, bool target, uint64_t *bitmap) {
+    uint64_t flip = target ? 0 : ~(uint64_t)0;
+    uint words = (n + 63) / 64;
+    for (uint word = 0; word < words; word++)
+        bitmap[word] = bits[word] ^ flip;
+    if (n % 64 != 0)
+        bitmap[words - 1] &= ((uint64_t)1 << (n % 64)) - 1;
+}
+
+// Lengths around the vector widths and the 64-row words, so the tail loops and word
+// boundaries get exercised along with the vector bodies.
+bool test_column_filters() {
+    const uint lengths[] = {0, 1, 3, 4, 5, 7, 8, 9, 31, 63, 64, 65, 127, 200, 1000};
+    const int32_t targets[] = {0, 3, -1, INT_MIN, INT_MAX};
+    for (uint n : lengths) {
+        std::vector<int32_t> values(n);
+        for (uint i = 0; i < n; i++)
+            values[i] = i % 5 == 0 ? 3 : (i % 7 == 0 ? INT_MIN : (int32_t)(i * 2654435761u));
+        if (n > 0)
+            values[n - 1] = INT_MAX;
+        uint words = (n + 63) / 64;
+        for (int32_t target : targets) {
+            // garbage in the bitmaps: the kernels must clear them
+            std::vector<uint64_t> expected(words + 1, ~(uint64_t)0), got(words + 1, ~(uint64_t)0);
+            int_eq_scalar(values.data(), n, target, expected.data());
+            int_eq_bitmap(values.data(), n, target, got.data());
+            for (uint word = 0; word < words; word++)
+                if (got[word] != expected[word])
+                    return false;
+            if (got[words] != ~(uint64_t)0)
+                return false;  // wrote past the end of the bitmap
+        }
+        std::vector<uint64_t> bits(words), flipped(words);
+        for (uint word = 0; word < words; word++)
+            bits[word] = word * 0x9e3779b97f4a7c15ull;
+        bool_eq_bitmap(bits.data(), n, false, flipped.data());
+        for (uint i = 0; i < n; i++)
+            if (((flipped[i / 64] >> (i % 64)) & 1) == ((bits[i / 64] >> (i % 64)) & 1))
+                return false;
+        if (n % 64 != 0 && (flipped[words - 1] >> (n % 64)) != 0)
+            return false;  // rows past n must not match
+    }
+    std::string name = int_eq_kernel_name();
+    return name == "avx2" || name == "sse4.2" || name == "scalar";
+}
@@ -0,0 +1,26 @@
+/**
+ * @file column_filters.h - comparison kernels over whole column arrays, producing
+ *                          selection bitmaps (bit i set if row i matches)
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ *
+ * The int32 kernel uses AVX2 or SSE4.2 when the CPU running us has them (checked once,
+ * at the first call) and a plain loop otherwise. Bitmaps are (n + 63) / 64 words.
+ */
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+// bitmap gets the rows of values[0..n) equal to target
+void int_eq_bitmap(const int32_t *values, uint n, int32_t target, uint64_t *bitmap);
+
+// bitmap gets the rows of the n-row boolean bitmap bits equal to target
+void bool_eq_bitmap(const uint64_t *bits, uint n, bool target, uint64_t *bitmap);
+
+// which int32 kernel int_eq_bitmap uses here: "avx2", "sse4.2", or "scalar"
+const char *int_eq_kernel_name();
+
+// check the kernels chosen here against plain loops
+bool test_column_filters();
@@ -0,0 +1,515 @@
+/**
+ * @file hash_index.cpp - implementation of HashIndex class inheritance of DbIndex class
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include "hash_index.h"
+#include <algorithm>
+
+/************
+ * HashStat *
+ ************/
+
+HashStat::HashStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile, bool create)
+        : BTreeNode(file, stat_id, key_profile, false), level(0), split(0), used(0) {
+    if (create) {
+        save();
+    } else {
+        this->level = get_block_id(LEVEL);  // none of these are really block IDs but they fit
+        this->split = get_block_id(SPLIT);
+        this->used = get_block_id(USED);
+    }
+}
+
+void HashStat::save() {
+    bool is_new = (this->block->size() == 0);
+    BlockID values[] = {this->level, this->split, this->used};
+    for (RecordID id = LEVEL; id <= USED; id++) {
+        Dbt *dbt = marshal_block_id(values[id - LEVEL]);
+        if (is_new)
+            this->block->add(dbt);
+        else
+            this->block->put(id, *dbt);
+        delete[] (char*)dbt->get_data();
+        delete dbt;
+    }
+    BTreeNode::save();
+}
+
+
+/**************
+ * HashBucket *
+ **************/
+
+HashBucket::HashBucket(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
+        : BTreeNode(file, block_id, key_profile, create), entries(), next(0) {
+    if (!create) {
+        RecordIDs *record_id_list = this->block->ids();
+        RecordID i = 1;
+        for (auto j = record_id_list->size(); j > 0; j--) {
+            if (i == record_id_list->size()) {
+                // overflow page
+                this->next = get_block_id(i);
+            } else if (i%2 == 0) {
+                // record i-1: handle, record i: key
+                KeyValue *key_value = get_key(i);
+                this->entries.push_back(std::make_pair(*key_value, get_handle(i-1)));
+                delete key_value;
+            }
+            i++;
+        }
+        delete record_id_list;
+    }
+}
+
+// Save the entries and then the overflow page id
+void HashBucket::save() {
+    Dbt *dbt;
+    this->block->clear();
+    for (auto const& entry: this->entries) {
+        dbt = marshal_handle(entry.second);
+        this->block->add(dbt);
+        delete[] (char *) dbt->get_data();
+        delete dbt;
+
+        dbt = marshal_key(&entry.first);
+        this->block->add(dbt);
+        delete[] (char *) dbt->get_data();
+        delete dbt;
+    }
+    dbt = marshal_block_id(this->next);
+    this->block->add(dbt);
+    delete[] (char *) dbt->get_data();
+    delete dbt;
+
+    BTreeNode::save();
+}
+
+// Add the handles of this page's entries for key
+void HashBucket::find_eq(const KeyValue* key, Handles &handles) const {
+    for (auto const& entry: this->entries) {
+        if (entry.first == *key)
+            handles.push_back(entry.second);
+    }
+}
+
+void HashBucket::add(const KeyValue* key, Handle handle) {
+    this->entries.push_back(std::make_pair(*key, handle));
+}
+
+bool HashBucket::del(const KeyValue* key, Handle handle) {
+    auto found = std::find(this->entries.begin(), this->entries.end(), std::make_pair(*key, handle));
+    if (found == this->entries.end())
+        return false;
+    this->entries.erase(found);
+    return true;
+}
+
+bool HashBucket::has_room(const KeyValue* key) const {
+    return used() + entry_size(this->key_profile, key) <= CAPACITY;
+}
+
+uint HashBucket::entry_size(const KeyProfile& key_profile, const KeyValue* key) {
+    return sizeof(BlockID) + sizeof(RecordID) + key_size(key_profile, key) + 2 * 4;
+}
+
+// Bytes of the block the page takes: its entries, then the overflow page id.
+uint HashBucket::used() const {
+    uint used = sizeof(BlockID) + 4;
+    for (auto const& entry: this->entries)
+        used += entry_size(this->key_profile, &entry.first);
+    return used;
+}
+
+
+/*************
+ * HashIndex *
+ *************/
+
+/**
+ * constructor for the HashIndex
+ * @param relation         the relation holding target column to be used for index
+ * @param name             name of the index
+ * @param key_columns      key columns to be used for hash index
+ * @param unique           boolean value representing uniqueness
+ */
+HashIndex::HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique)
+        : DbIndex(relation, name, key_columns, unique),
+          closed(true),
+          stat(nullptr),
+          file(relation.get_table_name() + "-" + name),
+          overflow(relation.get_table_name() + "-" + name + "-overflow"),
+          key_profile() {
+    this->build_key_profile();
+}
+
+HashIndex::~HashIndex() {
+    delete this->stat;
+    this->stat = nullptr;
+}
+
+/**
+ * Create the hash index with its first buckets and add an entry for each row of the relation.
+ */
+void HashIndex::create() {
+    this->file.create();
+    this->overflow.create();  // its first block is never used, so no overflow page is block 0
+    this->stat = new HashStat(this->file, STAT, this->key_profile, true);
+    for (uint i = 0; i < INITIAL_BUCKETS; i++) {
+        HashBucket bucket(this->file, 0, this->key_profile, true);
+        bucket.save();
+    }
+    this->closed = false;
+
+    DbCursor *rows = this->relation.select_cursor();
+    Handle handle;
+    try {
+        while (rows->next(handle))
+            this->insert(handle);
+    } catch (DbRelationError &e) {
+        delete rows;
+        this->drop();
+        throw;
+    }
+    delete rows;
+}
+
+/**
+ * Drop the hash index
+ */
+void HashIndex::drop() {
+    delete this->stat;
+    this->stat = nullptr;
+    this->closed = true;
+    this->file.drop();
+    this->overflow.drop();
+}
+
+/**
+ * Open existing hash index. Enables: lookup, insert, delete
+ */
+void HashIndex::open() {
+    if (this->closed) {
+        this->file.open();
+        this->overflow.open();
+        this->stat = new HashStat(this->file, STAT, this->key_profile, false);
+        this->closed = false;
+    }
+}
+
+/**
+ * Closes the hash index. Disables: lookup, insert, delete
+ */
+void HashIndex::close() {
+    delete this->stat;
+    this->stat = nullptr;
+    this->file.close();
+    this->overflow.close();
+    this->closed = true;
+}
+
+/**
+ * Find all the rows whose columns are equal to key, reading just key's bucket.
+ * @param key_dict     values of all the key columns
+ * @return Handles*    handles of the matching rows (freed by caller)
+ */
+Handles* HashIndex::lookup(ValueDict* key_dict) const {
+    KeyValue *key = this->tkey(key_dict);
+    Handles *handles = new Handles();
+    HeapFile *pages = &this->file;
+    for (BlockID page_id = bucket_id(key); page_id != 0; pages = &this->overflow) {
+        HashBucket page(*pages, page_id, this->key_profile, false);
+        page.find_eq(key, *handles);
+        page_id = page.get_next();
+    }
+    delete key;
+    return handles;
+}
+
+/**
+ * Insert a row with the given handle. Row must exist in relation already.
+ * @param handle     pair of blockId and recordId to be used for insertion
+ */
+void HashIndex::insert(Handle handle) {
+    ValueDict *row = this->relation.project(handle, &this->key_columns);
+    KeyValue *tkey = this->tkey(row);
+    delete row;
+    try {
+        this->insert(tkey, handle);
+    } catch (DbRelationError &e) {
+        delete tkey;
+        throw;
+    }
+    delete tkey;
+}
+
+// helper function for insert: add the entry for key, then split a bucket if the buckets
+// are now too full
+void HashIndex::insert(const KeyValue* key, Handle handle) {
+    if (this->unique) {
+        ValueDict key_dict;
+        for (uint i = 0; i < this->key_columns.size(); i++)
+            key_dict[this->key_columns[i]] = (*key)[i];
+        Handles *found = lookup(&key_dict);
+        bool duplicate = !found->empty();
+        delete found;
+        if (duplicate)
+            throw DbRelationError("Duplicate keys are not allowed in unique index");
+    }
+    place(key, handle);
+    this->stat->set_used(this->stat->get_used() + HashBucket::entry_size(this->key_profile, key));
+    if (this->stat->get_used() * 100ULL > (unsigned long long)LOAD_PERCENT * BTreeNode::CAPACITY * bucket_count())
+        split();
+    this->stat->save();
+}
+
+// helper function for insert and split: put the entry on the first page of key's bucket
+// with room for it, adding an overflow page if none has
+void HashIndex::place(const KeyValue* key, Handle handle) {
+    HeapFile *pages = &this->file;
+    HashBucket *page = new HashBucket(*pages, bucket_id(key), this->key_profile, false);
+    while (!page->has_room(key) && page->get_next() != 0) {
+        BlockID next = page->get_next();
+        delete page;
+        pages = &this->overflow;
+        page = new HashBucket(*pages, next, this->key_profile, false);
+    }
+    if (!page->has_room(key)) {
+        HashBucket *more = new HashBucket(this->overflow, 0, this->key_profile, true);
+        page->set_next(more->get_id());
+        page->save();
+        delete page;
+        page = more;
+    }
+    page->add(key, handle);
+    page->save();
+    delete page;
+}
+
+// helper function for insert: split the next bucket in turn, moving the entries that now
+// hash past the old bucket count to a new bucket at the end of the file (caller saves stat)
+void HashIndex::split() {
+    BlockID old_id = FIRST_BUCKET + this->stat->get_split();
+    BucketEntries moving;
+    HashBucket *page = new HashBucket(this->file, old_id, this->key_profile, false);
+    for (BlockID next = page->get_next(); next != 0; ) {
+        HashBucket more(this->overflow, next, this->key_profile, false);
+        moving.insert(moving.end(), more.get_entries().begin(), more.get_entries().end());
+        next = more.get_next();
+    }
+    moving.insert(moving.end(), page->get_entries().begin(), page->get_entries().end());
+    page->clear();
+    page->save();
+    delete page;
+
+    HashBucket *fresh = new HashBucket(this->file, 0, this->key_profile, true);
+    BlockID fresh_id = fresh->get_id();
+    fresh->save();
+    delete fresh;
+    if (fresh_id != FIRST_BUCKET + bucket_count())
+        throw DbRelationError("hash index buckets are out of order");
+
+    if (this->stat->get_split() + 1 == INITIAL_BUCKETS << this->stat->get_level()) {
+        this->stat->set_level(this->stat->get_level() + 1);
+        this->stat->set_split(0);
+    } else {
+        this->stat->set_split(this->stat->get_split() + 1);
+    }
+    for (auto const &entry : moving)
+        place(&entry.first, entry.second);
+}
+
+/**
+ * Delete the entry for the row with the given handle. Row must still be in the relation.
+ * An overflow page it leaves empty is taken out of its bucket.
+ * @param handle     pair of blockId and recordId of the row
+ */
+void HashIndex::del(Handle handle) {
+    ValueDict *row = this->relation.project(handle, &this->key_columns);
+    KeyValue *key = this->tkey(row);
+    delete row;
+
+    HashBucket *prev = nullptr;
+    HeapFile *pages = &this->file;
+    for (BlockID page_id = bucket_id(key); page_id != 0; pages = &this->overflow) {
+        HashBucket *page = new HashBucket(*pages, page_id, this->key_profile, false);
+        if (page->del(key, handle)) {
+            if (prev != nullptr && page->get_entries().empty()) {
+                prev->set_next(page->get_next());
+                prev->save();
+            } else {
+                page->save();
+            }
+            delete page;
+            delete prev;
+            this->stat->set_used(this->stat->get_used() - HashBucket::entry_size(this->key_profile, key));
+            this->stat->save();
+            delete key;
+            return;
+        }
+        page_id = page->get_next();
+        delete prev;
+        prev = page;
+    }
+    delete prev;
+    delete key;
+    throw DbRelationError("row is not in the index");
+}
+
+// helper function to get key values which is column_names in ValueDict in order
+KeyValue *HashIndex::tkey(const ValueDict *key) const {
+    KeyValue *values = new KeyValue;
+    for (auto const &column_name : this->key_columns)
+        values->push_back(key->at(column_name));
+    return values;
+}
+
+// helper function to build key profiles which is a vector of column attributes
+// of the hash index key
+void HashIndex::build_key_profile() {
+    ColumnAttributes *column_attributes = this->relation.get_column_attributes(this->key_columns);
+    for (auto const &column_attribute : *column_attributes)
+        this->key_profile.push_back(column_attribute.get_data_type());
+    delete column_attributes;
+}
+
+// FNV-1a over the key's values, the same across runs (the buckets are on disk)
+uint32_t HashIndex::hash(const KeyValue* key) {
+    uint32_t hash = 2166136261U;
+    for (auto const &value : *key) {
+        const char *bytes;
+        size_t size;
+        int32_t n = value.n;
+        if (value.data_type == ColumnAttribute::DataType::TEXT) {
+            bytes = value.s.c_str();
+            size = value.s.length() + 1;  // with its terminator, so ("a","b") isn't ("ab","")
+        } else {
+            bytes = (const char *)&n;
+            size = sizeof(n);
+        }
+        for (size_t i = 0; i < size; i++) {
+            hash ^= (uint8_t)bytes[i];
+            hash *= 16777619U;
+        }
+    }
+    return hash;
+}
+
+// Buckets so far: doubled level times, plus the ones split off in this round
+uint HashIndex::bucket_count() const {
+    return (INITIAL_BUCKETS << this->stat->get_level()) + this->stat->get_split();
+}
+
+// Block holding the first page of key's bucket: buckets before the split pointer have been
+// split this round, so they are addressed with the next round's (doubled) modulus.
+BlockID HashIndex::bucket_id(const KeyValue* key) const {
+    uint32_t h = hash(key);
+    uint round = INITIAL_BUCKETS << this->stat->get_level();
+    uint bucket = h % round;
+    if (bucket < this->stat->get_split())
+        bucket = h % (2 * round);
+    return FIRST_BUCKET + bucket;
+}
+
+
+/**
+ * hash index test
+ */
+
+// These are the tests to confirm that HashIndex finds every row of a key through splits
+// and deletes. return true if pass, false if fail.
+bool test_hash_index() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    column_names.push_back("b");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("hash_test_table", column_names, column_attributes);
+    table.create();
+    Handles handles;
+    for (int i = 0; i < 1000; i++) {
+        ValueDict row;
+        row["a"] = Value(i);
+        row["b"] = Value("token" + std::to_string(i % 100));
+        handles.push_back(table.insert(&row));
+    }
+
+    // the index is built over the rows there, then grows (and splits) with the rest
+    ColumnNames index_col_names;
+    index_col_names.push_back("b");
+    HashIndex index(table, "test_hash_index", index_col_names, false);
+    index.create();
+    for (int i = 1000; i < 3000; i++) {
+        ValueDict row;
+        row["a"] = Value(i);
+        row["b"] = Value("token" + std::to_string(i % 100));
+        handles.push_back(table.insert(&row));
+        index.insert(handles.back());
+    }
+    for (int k = 0; k < 100; k++) {
+        ValueDict target;
+        target["b"] = Value("token" + std::to_string(k));
+        Handles *found = index.lookup(&target);
+        if (found->size() != 30)
+            return false;
+        for (auto const &handle : *found) {
+            ValueDict *result = table.project(handle);
+            bool same = (*result)["a"].n % 100 == k;
+            delete result;
+            if (!same)
+                return false;
+        }
+        delete found;
+    }
+    ValueDict missing;
+    missing["b"] = Value("token100");
+    Handles *none = index.lookup(&missing);
+    if (!none->empty())
+        return false;
+    delete none;
+
+    // deletes, then lookups through another HashIndex over the same files, expecting
+    // just the rows left
+    for (int i = 0; i < 3000; i++) {
+        if (i % 3 != 0)
+            index.del(handles[i]);
+    }
+    index.close();
+    HashIndex reopened(table, "test_hash_index", index_col_names, false);
+    reopened.open();
+    for (int k = 0; k < 100; k++) {
+        ValueDict target;
+        target["b"] = Value("token" + std::to_string(k));
+        Handles *found = reopened.lookup(&target);
+        if (found->size() != 10)
+            return false;
+        delete found;
+    }
+
+    // a unique index turns away a second row with the same key
+    ColumnNames unique_col_names;
+    unique_col_names.push_back("a");
+    HashIndex unique(table, "test_hash_unique", unique_col_names, true);
+    unique.create();
+    ValueDict target;
+    target["a"] = Value(1234);
+    Handles *found = unique.lookup(&target);
+    if (found->size() != 1 || found->at(0) != handles[1234])
+        return false;
+    delete found;
+    ValueDict row;
+    row["a"] = Value(1234);
+    row["b"] = Value("again");
+    Handle again = table.insert(&row);
+    try {
+        unique.insert(again);
+        return false;
+    } catch (DbRelationError &e) {}
+
+    unique.drop();
+    reopened.drop();
+    table.drop();
+    return true;
+}
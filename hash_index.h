@@ -0,0 +1,118 @@
+/**
+ * @file hash_index.h - on-disk linear hash index, HashIndex, and its blocks
+ * @Professor: Kevin Lundeen
+ * @Students: Wonseok Seo, Amanda Iverson
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include "BTreeNode.h"
+
+typedef std::vector<std::pair<KeyValue,Handle>> BucketEntries;
+
+/**
+ * @class HashStat - first block of a hash index: how many times the bucket count has doubled,
+ * the next bucket to split, and the bytes the entries take in the buckets.
+ * Hash blocks are BTreeNodes only to share their record marshaling.
+ */
+class HashStat : public BTreeNode {
+public:
+    static const RecordID LEVEL = 1;
+    static const RecordID SPLIT = LEVEL + 1;
+    static const RecordID USED = SPLIT + 1;
+
+    HashStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile, bool create);
+    virtual ~HashStat() {}
+
+    virtual void save();
+
+    uint get_level() const { return this->level; }
+    uint get_split() const { return this->split; }
+    uint get_used() const { return this->used; }
+    void set_level(uint level) { this->level = level; }
+    void set_split(uint split) { this->split = split; }
+    void set_used(uint used) { this->used = used; }
+
+protected:
+    uint level;
+    uint split;
+    uint used;
+};
+
+/**
+ * @class HashBucket - one page of a bucket: (handle, key) pairs, then the id of the overflow
+ * page continuing the bucket (0 if none).
+ */
+class HashBucket : public BTreeNode {
+public:
+    HashBucket(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
+    virtual ~HashBucket() {}
+
+    virtual void save();
+
+    void find_eq(const KeyValue* key, Handles &handles) const;  // adds key's handles, if any
+    void add(const KeyValue* key, Handle handle);  // no size check; caller calls save
+    bool del(const KeyValue* key, Handle handle);  // false if not on this page
+    bool has_room(const KeyValue* key) const;
+
+    BlockID get_next() const { return this->next; }
+    void set_next(BlockID next) { this->next = next; }
+    const BucketEntries& get_entries() const { return this->entries; }
+    void clear() { this->entries.clear(); this->next = 0; }
+
+    // bytes an entry for key takes in a page, with its two slots
+    static uint entry_size(const KeyProfile& key_profile, const KeyValue* key);
+
+protected:
+    BucketEntries entries;
+    BlockID next;
+
+    uint used() const;
+};
+
+/**
+ * @class HashIndex - linear hashing. The index file holds the stat block and then each
+ * bucket's first page in bucket order, so a lookup goes straight to its bucket's block;
+ * a second file holds overflow pages. Once the entries fill LOAD_PERCENT of the first
+ * pages, the next bucket in turn is split in two. Only whole keys can be looked up.
+ * Overflow pages a split or delete leaves empty are left unused.
+ */
+class HashIndex : public DbIndex {
+public:
+    HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique);
+    virtual ~HashIndex();
+
+    virtual void create();
+    virtual void drop();
+
+    virtual void open();
+    virtual void close();
+
+    virtual Handles* lookup(ValueDict* key) const;
+
+    virtual void insert(Handle handle);
+    virtual void del(Handle handle);
+
+    static const uint INITIAL_BUCKETS = 4;
+    static const uint LOAD_PERCENT = 75;
+
+protected:
+    static const BlockID STAT = 1;
+    static const BlockID FIRST_BUCKET = STAT + 1;
+    bool closed;
+    HashStat *stat;
+    mutable HeapFile file;  // reading pages pins blocks, even for const queries
+    mutable HeapFile overflow;
+    KeyProfile key_profile;
+
+    void build_key_profile();
+    KeyValue *tkey(const ValueDict *key) const;
+    static uint32_t hash(const KeyValue* key);
+    uint bucket_count() const;
+    BlockID bucket_id(const KeyValue* key) const;
+    void insert(const KeyValue* key, Handle handle);
+    void place(const KeyValue* key, Handle handle);
+    void split();
+};
+
+bool test_hash_index();
@@ -12,31 +12,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <algorithm>
 #include "heap_storage.h"
 using namespace std;
 
 typedef uint16_t u16;
 
 SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new)
-                         : DbBlock(block, block_id, is_new) {
+                         : DbBlock(block, block_id, is_new), holes(0), tombstones(0), first_tombstone(1) {
     if (is_new) {
         this->num_records = 0;
         this->end_free = DbBlock::BLOCK_SZ - 1;
         put_header();
     } else {
         get_header(this->num_records, this->end_free);
+        u16 size, loc;
+        uint used = 0;
+        for (RecordID record_id = 1; record_id <= this->num_records; record_id++) {
+            get_header(size, loc, record_id);
+            if (loc == 0)
+                this->tombstones++;
+            used += size;
+        }
+        this->holes = (u16)(DbBlock::BLOCK_SZ - 1 - this->end_free - used);
     }
 }
 
 // Add a new record to the block. Return its id.
 RecordID SlottedPage::add(const Dbt *data) throw(DbBlockNoRoomError) {
-    if (!has_room((u16)data->get_size()))
+    RecordID id = try_add(data);
+    if (id == 0)
         throw DbBlockNoRoomError("not enough room for new record");
-    u16 id = ++this->num_records;
+    return id;
+}
+
+// Add a new record to the block if it fits. Return its id, or 0 if it doesn't fit.
+RecordID SlottedPage::try_add(const Dbt *data) {
+    if (!has_room((u16)data->get_size()))
+        return 0;
     u16 size = (u16)data->get_size();
-    this->end_free -= size;
-    u16 loc = this->end_free + 1U;
-    put_header();
+    RecordID id = reuse_tombstone();
+    if (id == 0) {
+        if (size + 4U > gap())
+            compact();  // before the new header takes any of the free space
+        id = ++this->num_records;
+    }
+    u16 loc = allocate(size);
     put_header(id, size, loc);
     memcpy(this->address(loc), data->get_data(), size);
     return id;
@@ -51,32 +72,62 @@ Dbt *SlottedPage::get(RecordID record_id) const {
     return new Dbt(this->address(loc), size);
 }
 
+// Get a record's bytes in place (no copy, no Dbt). Return nullptr if it has been deleted.
+const char *SlottedPage::view(RecordID record_id, u16 &size) const {
+    u16 loc;
+    get_header(size, loc, record_id);
+    if (loc == 0)
+        return nullptr;
+    return (const char *)this->address(loc);
+}
+
 // Replace the record with the given data. Raises DbBlockNoRoomError if it won't fit.
 void SlottedPage::put(RecordID record_id, const Dbt &data) throw(DbBlockNoRoomError) {
+    if (!try_put(record_id, data))
+        throw DbBlockNoRoomError("not enough room for enlarged record");
+}
+
+// Replace the record with the given data if it fits. Return false (leaving the old record)
+// if it doesn't. A record that shrinks stays where it is; one that grows moves to new space.
+bool SlottedPage::try_put(RecordID record_id, const Dbt &data) {
     u16 size, loc;
     get_header(size, loc, record_id);
     u16 new_size = (u16)data.get_size();
-    if (new_size > size) {
-        u16 extra = new_size - size;
-        if (!has_room(extra))
-            throw DbBlockNoRoomError("not enough room for enlarged record");
-        slide(loc, loc - extra);
-        memcpy(this->address(loc - extra), data.get_data(), new_size);
-    } else {
+    if (new_size <= size) {
         memcpy(this->address(loc), data.get_data(), new_size);
-        slide(loc + new_size, loc + size);
+        this->holes += size - new_size;
+        put_header(record_id, new_size, loc);
+        return true;
     }
-    get_header(size, loc, record_id);
+    if (new_size > (uint)gap() + this->holes + size)
+        return false;
+    // let go of the old bytes (so compaction can use them) and find room for the new
+    put_header(record_id, 0, 0);
+    this->holes += size;
+    loc = allocate(new_size);
     put_header(record_id, new_size, loc);
+    memcpy(this->address(loc), data.get_data(), new_size);
+    return true;
 }
 
 // Mark the given id as deleted by changing its size to zero and its location to 0.
-// Compact the rest of the data in the block. But keep the record ids the same for everyone.
+// Its bytes become a hole, unless they are at the start of the data, where they can
+// simply go back to the free space. Record ids stay the same for everyone.
 void SlottedPage::del(RecordID record_id) {
     u16 size, loc;
     get_header(size, loc, record_id);
+    if (loc == 0)
+        return;
     put_header(record_id, 0, 0);
-    slide(loc, loc + size);
+    if (loc == this->end_free + 1U) {
+        this->end_free += size;
+        put_header();
+    } else {
+        this->holes += size;
+    }
+    this->tombstones++;
+    if (record_id < this->first_tombstone)
+        this->first_tombstone = record_id;
 }
 
 // Sequence of all non-deleted record IDs.
@@ -95,6 +146,9 @@ RecordIDs *SlottedPage::ids(void) const {
 void SlottedPage::clear() {
     this->num_records = 0;
     this->end_free = DbBlock::BLOCK_SZ - 1;
+    this->holes = 0;
+    this->tombstones = 0;
+    this->first_tombstone = 1;
     put_header();
 }
 
@@ -110,59 +164,108 @@ u16 SlottedPage::size() const {
     return count;
 }
 
-// Get the size and offset for given id. For id of zero, it is the block header.
+// Get the size (without its flags) and offset for given id. For id of zero, it is the
+// block header.
 void SlottedPage::get_header(u16 &size, u16 &loc, RecordID id) const {
     size = get_n((u16)4 * id);
+    if (id != 0)
+        size &= ~FLAGS;
     loc = get_n((u16)(4 * id + 2));
 }
 
-// Store the size and offset for given id. For id of zero, store the block header.
-void SlottedPage::put_header(RecordID id, u16 size, u16 loc) {
+// Store the size, offset, and flags for given id. For id of zero, store the block header.
+void SlottedPage::put_header(RecordID id, u16 size, u16 loc, u16 flags) {
     if (id == 0) {
         size = this->num_records;
         loc = this->end_free;
+        flags = 0;
     }
-    put_n((u16)4 * id, size);
+    put_n((u16)4 * id, size | flags);
     put_n((u16)(4 * id + 2), loc);
 }
 
-// Calculate if we have room to store a record with given size. The size should include the 4 bytes
-// for the header, too, if this is an add.
+// The FORWARD and MOVED flags of the given record.
+u16 SlottedPage::get_flags(RecordID record_id) const {
+    return get_n((u16)4 * record_id) & FLAGS;
+}
+
+// Replace the flags of the given record.
+void SlottedPage::set_flags(RecordID record_id, u16 flags) {
+    u16 size, loc;
+    get_header(size, loc, record_id);
+    put_header(record_id, size, loc, flags & FLAGS);
+}
+
+// Calculate if we have room to add a record with given size (counting any holes that
+// compaction would recover).
 bool SlottedPage::has_room(u16 size) const {
-    u16 available = this->end_free - (u16)(4 * (this->num_records + 2));
-    return size <= available;
-}
-
-// If start < end, then remove data from offset start up to but not including offset end by sliding data
-// that is to the left of start to the right. If start > end, then make room for extra data from end to start
-// by sliding data that is to the left of start to the left.
-// Also fix up any record headers whose data has slid. Assumes there is enough room if it is a left
-// shift (end < start).
-void SlottedPage::slide(u16 start, u16 end) {
-    int shift = end - start;
-    if (shift == 0)
-        return;
+    return size <= free_space();
+}
 
-    // slide data
-    void *to = this->address((u16)(this->end_free + 1 + shift));
-    void *from = this->address((u16)(this->end_free + 1));
-    int bytes = start - (this->end_free + 1U);
-    char temp[bytes];
-    memcpy(temp, from, bytes);
-    memcpy(to, temp, bytes);
-
-    // fix up headers
-    RecordIDs *record_ids = ids();
-    for (auto const &record_id : *record_ids) {
-        u16 size, loc;
+// The most bytes add() will take for a new record (after room for its header, unless
+// it can have a deleted record's header).
+u16 SlottedPage::free_space() const {
+    int available = (int)gap() + this->holes - (this->tombstones > 0 ? 0 : 4);
+    return available > 0 ? (u16)available : 0;
+}
+
+// Bytes between the end of the headers and the start of the records (less one, which
+// the original page layout always left unused).
+u16 SlottedPage::gap() const {
+    // signed, since a nearly full page can have its headers within 4 bytes of end_free
+    int available = (int)this->end_free - 4 * (this->num_records + 1);
+    return available > 0 ? (u16)available : 0;
+}
+
+// Take the lowest-numbered deleted record id, or return 0 if there are none.
+RecordID SlottedPage::reuse_tombstone() {
+    if (this->tombstones == 0)
+        return 0;
+    u16 size, loc;
+    for (RecordID record_id = this->first_tombstone; record_id <= this->num_records; record_id++) {
         get_header(size, loc, record_id);
-        if (loc <= start) {
-            loc += shift;
-            put_header(record_id, size, loc);
+        if (loc == 0) {
+            this->tombstones--;
+            this->first_tombstone = record_id + 1;
+            return record_id;
+        }
+    }
+    this->tombstones = 0;  // shouldn't happen
+    return 0;
+}
+
+// Take size bytes off the front of the free space, compacting first if they aren't
+// all there. Assumes has_room() and that the record's header is already counted.
+u16 SlottedPage::allocate(u16 size) {
+    if (size > gap())
+        compact();
+    this->end_free -= size;
+    put_header();
+    return this->end_free + 1U;
+}
+
+// Squeeze out the holes: move every record, highest offset first, as far toward the end
+// of the block as it will go. One pass over the records, however many holes there are.
+void SlottedPage::compact() {
+    std::vector<std::pair<u16, RecordID>> records;  // (offset, id)
+    u16 size, loc;
+    for (RecordID record_id = 1; record_id <= this->num_records; record_id++) {
+        get_header(size, loc, record_id);
+        if (loc != 0)
+            records.push_back(std::make_pair(loc, record_id));
+    }
+    std::sort(records.begin(), records.end());
+    uint end = DbBlock::BLOCK_SZ;
+    for (auto record = records.rbegin(); record != records.rend(); record++) {
+        get_header(size, loc, record->second);
+        end -= size;
+        if (end != loc) {
+            memmove(this->address((u16)end), this->address(loc), size);
+            put_header(record->second, size, (u16)end, get_flags(record->second));
         }
     }
-    delete record_ids;
-    this->end_free += shift;
+    this->end_free = (u16)(end - 1);
+    this->holes = 0;
     put_header();
 }
 
@@ -181,21 +284,114 @@ void *SlottedPage::address(u16 offset) const {
     return (void *)((char *)this->block.get_data() + offset);
 }
 
+/*
+ * *******************
+ * RowView class
+ * *******************
+ */
+
+RowView::RowView(const ColumnAttributes &column_attributes)
+        : column_attributes(column_attributes), bytes(nullptr),
+          offsets(column_attributes.size() + 1, 0), known(0) {
+}
+
+// Look at another record (with the same columns).
+void RowView::reset(const char *bytes) {
+    this->bytes = bytes;
+    this->known = 0;
+}
+
+ColumnAttribute::DataType RowView::get_data_type(uint col_num) const {
+    return this->column_attributes[col_num].get_data_type();
+}
+
+int32_t RowView::get_int(uint col_num) const {
+    return *(int32_t *)(this->bytes + offset(col_num));
+}
+
+bool RowView::get_boolean(uint col_num) const {
+    return *(uint8_t *)(this->bytes + offset(col_num)) != 0;
+}
+
+// Pointer to the text in the record and, by reference, its length.
+const char *RowView::get_text(uint col_num, u16 &size) const {
+    u16 at = offset(col_num);
+    size = *(u16 *)(this->bytes + at);
+    return this->bytes + at + sizeof(u16);
+}
+
+// Copy one field out into a Value.
+Value RowView::get_value(uint col_num) const {
+    Value value;
+    value.data_type = get_data_type(col_num);
+    if (value.data_type == ColumnAttribute::DataType::TEXT) {
+        u16 size;
+        const char *text = get_text(col_num, size);
+        value.s.assign(text, size); // assume ascii for now
+    } else if (value.data_type == ColumnAttribute::DataType::BOOLEAN) {
+        value.n = *(uint8_t *)(this->bytes + offset(col_num));
+    } else {
+        value.n = get_int(col_num);
+    }
+    return value;
+}
+
+// Compare one field against value without copying it out.
+bool RowView::matches(uint col_num, const Value &value) const {
+    ColumnAttribute::DataType data_type = get_data_type(col_num);
+    if (value.data_type != data_type)
+        return false;
+    if (data_type == ColumnAttribute::DataType::TEXT) {
+        u16 size;
+        const char *text = get_text(col_num, size);
+        return size == value.s.length() && memcmp(text, value.s.data(), size) == 0;
+    }
+    if (data_type == ColumnAttribute::DataType::BOOLEAN)
+        return *(uint8_t *)(this->bytes + offset(col_num)) == (uint8_t)value.n;
+    return get_int(col_num) == value.n;
+}
+
+// Where the given field starts, stepping over any earlier fields not yet measured.
+u16 RowView::offset(uint col_num) const {
+    while (this->known < col_num) {
+        u16 at = this->offsets[this->known];
+        ColumnAttribute::DataType data_type = get_data_type(this->known);
+        if (data_type == ColumnAttribute::DataType::INT)
+            at += sizeof(int32_t);
+        else if (data_type == ColumnAttribute::DataType::TEXT)
+            at += sizeof(u16) + *(u16 *)(this->bytes + at);
+        else if (data_type == ColumnAttribute::DataType::BOOLEAN)
+            at += sizeof(uint8_t);
+        else
+            throw DbRelationError("Only know how to unmarshal INT, BOOLEAN and TEXT");
+        this->offsets[++this->known] = at;
+    }
+    return this->offsets[col_num];
+}
+
 /*
  * *******************
  * HeapFile class
  * *******************
  */
 
-HeapFile::HeapFile(string name) : DbFile(name), dbfilename(""), last(0), closed(true), db(_DB_ENV, 0) {
+HeapFile::HeapFile(string name) : DbFile(name), dbfilename(""), last(0), closed(true), db(nullptr) {
     this->dbfilename = this->name + ".db";
 }
 
+// Make sure none of our blocks outlive us in the buffer pool.
+HeapFile::~HeapFile() {
+    if (!this->closed)
+        BufferPool::shared().flush(this);
+    BufferPool::shared().discard(this);
+    delete this->db;
+}
+
 // Create physical file.
 void HeapFile::create(void) {
     db_open(DB_CREATE | DB_EXCL);
     SlottedPage *page = get_new(); // force one page to exist
-    delete page;
+    unpin(page);
 }
 
 // Delete the physical file.
@@ -210,43 +406,63 @@ void HeapFile::open(void) {
     db_open();
 }
 
-// Close the physical file.
+// Close the physical file (after writing out any of its blocks still in the buffer pool).
 void HeapFile::close(void) {
-    this->db.close(0);
+    if (!this->closed)
+        BufferPool::shared().flush(this);
+    BufferPool::shared().discard(this);
+    if (this->db != nullptr) {
+        this->db->close(0);
+        delete this->db;
+        this->db = nullptr;
+    }
     this->closed = true;
 }
 
 // Allocate a new block for the database file.
 // Returns the new empty DbBlock that is managing the records in this block and its block id.
 SlottedPage *HeapFile::get_new(void) {
-    char block[DbBlock::BLOCK_SZ];
-    memset(block, 0, sizeof(block));
-    Dbt data(block, sizeof(block));
+    return BufferPool::shared().pin(this, ++this->last, true);
+}
 
-    int block_id = ++this->last;
-    Dbt key(&block_id, sizeof(block_id));
+// Get a block from the database file (via the buffer pool).
+SlottedPage *HeapFile::get(BlockID block_id) {
+    return BufferPool::shared().pin(this, block_id);
+}
 
-    // write out an empty block and read it back in so Berkeley DB is managing the memory
-    SlottedPage *page = new SlottedPage(data, this->last, true);
-    this->db.put(nullptr, &key, &data, 0); // write it out with initialization done to it
-    delete page;
-    this->db.get(nullptr, &key, &data, 0);
-    return new SlottedPage(data, this->last);
+// Write a block back to the database file. The buffer pool does the actual write later.
+void HeapFile::put(DbBlock *block) {
+    BufferPool::shared().mark_dirty(this, block);
 }
 
-// Get a block from the database file.
-SlottedPage *HeapFile::get(BlockID block_id) {
+// Done with a block from get or get_new.
+void HeapFile::unpin(DbBlock *block) {
+    if (block != nullptr)
+        BufferPool::shared().unpin(block);
+}
+
+// Write out any of our dirty blocks in the buffer pool.
+void HeapFile::flush() {
+    if (!this->closed)
+        BufferPool::shared().flush(this);
+}
+
+// Copy a block from Berkeley DB into the given memory. Berkeley DB fills in our memory
+// directly, so several threads can read the same file at once.
+void HeapFile::read_block(BlockID block_id, char *data) {
     Dbt key(&block_id, sizeof(block_id));
-    Dbt data;
-    this->db.get(nullptr, &key, &data, 0);
-    return new SlottedPage(data, block_id, false);
+    Dbt block(data, DbBlock::BLOCK_SZ);
+    block.set_ulen(DbBlock::BLOCK_SZ);
+    block.set_flags(DB_DBT_USERMEM);
+    if (this->db->get(nullptr, &key, &block, 0) != 0)
+        throw DbRelationError("block " + to_string(block_id) + " not found in " + this->dbfilename);
 }
 
-// Write a block back to the database file.
-void HeapFile::put(DbBlock *block) {
-    int block_id = block->get_block_id();
+// Write a block from the given memory to Berkeley DB.
+void HeapFile::write_block(BlockID block_id, char *data) {
     Dbt key(&block_id, sizeof(block_id));
-    this->db.put(nullptr, &key, block->get_block(), 0);
+    Dbt block(data, DbBlock::BLOCK_SZ);
+    this->db->put(nullptr, &key, &block, 0);
 }
 
 // Sequence of all block ids.
@@ -259,20 +475,375 @@ BlockIDs *HeapFile::block_ids() const {
 
 uint32_t HeapFile::get_block_count() {
     DB_BTREE_STAT *stat;
-    this->db.stat(nullptr, &stat, DB_FAST_STAT);
+    this->db->stat(nullptr, &stat, DB_FAST_STAT);
     return stat->bt_ndata;
 }
 
 // Wrapper for Berkeley DB open, which does both open and creation.
+// The handle is free-threaded since the buffer pool reads blocks outside its latch.
 void HeapFile::db_open(uint flags) {
     if (!this->closed)
         return;
-    this->db.set_re_len(DbBlock::BLOCK_SZ); // record length - will be ignored if file already exists
-    this->db.open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags, 0644);
+    this->db = new Db(_DB_ENV, 0);
+    try {
+        this->db->set_re_len(DbBlock::BLOCK_SZ); // record length - will be ignored if file already exists
+        this->db->open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags | DB_THREAD, 0644);
+    } catch (DbException &e) {
+        delete this->db;
+        this->db = nullptr;
+        throw;
+    }
     this->last = flags ? 0 : get_block_count();
     this->closed = false;
 }
 
+/*
+ * *******************
+ * BufferPool class
+ * *******************
+ */
+
+BufferPool &BufferPool::shared() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::BufferPool(uint num_frames) : frames(), block_frames(), page_frames(), writing(), clock_hand(0),
+                                          hits(0), misses(0), evictions(0),
+                                          workers(thread::hardware_concurrency()) {
+    for (uint i = 0; i < num_frames; i++) {
+        Frame frame = {nullptr, 0, nullptr, new char[DbBlock::BLOCK_SZ], 0, false, false, false};
+        this->frames.push_back(frame);
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (auto &frame : this->frames) {
+        delete frame.page;
+        delete[] frame.data;
+    }
+}
+
+// Get the block pinned in a frame, reading it in from the file if it isn't there already.
+// A new block is initialized in the frame and written through so the file knows it exists.
+// The read (and the write-back of the block being evicted) happens outside the latch: the
+// frame is claimed as loading first, and anyone else pinning either block waits for it.
+SlottedPage *BufferPool::pin(HeapFile *file, BlockID block_id, bool is_new) {
+    pair<HeapFile*, BlockID> key(file, block_id);
+    unique_lock<mutex> lock(this->latch);
+    auto found = this->block_frames.find(key);
+    while (this->writing.count(key) > 0
+           || (found != this->block_frames.end() && this->frames[found->second].loading)) {
+        this->loaded.wait(lock);
+        found = this->block_frames.find(key);
+    }
+    if (found != this->block_frames.end() && !is_new) {
+        Frame &frame = this->frames[found->second];
+        frame.pins++;
+        frame.referenced = true;
+        this->hits++;
+        return frame.page;
+    }
+    if (found != this->block_frames.end()) {
+        if (this->frames[found->second].pins > 0)
+            throw DbRelationError("new block is already pinned in the buffer pool");
+        release(found->second);
+    }
+    this->misses++;
+
+    // claim a frame for our block, taking the block it held out of the maps
+    uint frame_id = victim();
+    Frame old = this->frames[frame_id];
+    pair<HeapFile*, BlockID> old_key(old.file, old.block_id);
+    bool written = true;
+    if (old.page != nullptr) {
+        this->block_frames.erase(old_key);
+        this->page_frames.erase(old.page);
+        if (old.dirty && old.file != nullptr) {
+            this->writing.insert(old_key);
+            written = false;
+        }
+    }
+    char *data = old.data;
+    this->frames[frame_id] = {file, block_id, nullptr, data, 1, false, true, true};
+    this->block_frames[key] = frame_id;
+    lock.unlock();
+
+    SlottedPage *page = nullptr;
+    try {
+        if (!written) {
+            old.file->write_block(old.block_id, data);
+            written = true;
+        }
+        if (is_new)
+            memset(data, 0, DbBlock::BLOCK_SZ);
+        else
+            file->read_block(block_id, data);
+        Dbt dbt(data, DbBlock::BLOCK_SZ);
+        page = new SlottedPage(dbt, block_id, is_new);
+        if (is_new)
+            file->write_block(block_id, data);
+    } catch (...) {
+        delete page;
+        lock.lock();
+        if (this->frames[frame_id].file != nullptr)
+            this->block_frames.erase(key);
+        if (written) {
+            delete old.page;
+            this->frames[frame_id] = {nullptr, 0, nullptr, data, 0, false, false, false};
+        } else {
+            // the evicted block never made it out, so it stays in the frame
+            this->frames[frame_id] = old;
+            this->block_frames[old_key] = frame_id;
+            this->page_frames[old.page] = frame_id;
+        }
+        this->writing.erase(old_key);
+        this->loaded.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    delete old.page;
+    this->writing.erase(old_key);
+    Frame &frame = this->frames[frame_id];
+    frame.page = page;
+    frame.loading = false;
+    this->page_frames[page] = frame_id;
+    this->loaded.notify_all();
+    return page;
+}
+
+// Let the frame holding this block be reused once nobody else has it pinned.
+void BufferPool::unpin(DbBlock *block) {
+    lock_guard<mutex> guard(this->latch);
+    auto found = this->page_frames.find(block);
+    if (found == this->page_frames.end())
+        throw DbRelationError("unpin of a block not in the buffer pool");
+    Frame &frame = this->frames[found->second];
+    if (frame.pins > 0)
+        frame.pins--;
+    if (frame.pins == 0 && frame.file == nullptr)
+        release(found->second);  // its file was discarded while we still had it pinned
+}
+
+// Remember that the frame holding this block must be written back.
+void BufferPool::mark_dirty(HeapFile *file, DbBlock *block) {
+    lock_guard<mutex> guard(this->latch);
+    auto found = this->page_frames.find(block);
+    if (found == this->page_frames.end())
+        throw DbRelationError("put of a block not in the buffer pool");
+    Frame &frame = this->frames[found->second];
+    if (frame.file != file)
+        throw DbRelationError("put of a block through a file it doesn't belong to");
+    frame.dirty = true;
+}
+
+// Write back every dirty frame.
+void BufferPool::flush() {
+    unique_lock<mutex> lock(this->latch);
+    this->loaded.wait(lock, [this] { return this->writing.empty(); });
+    for (auto &frame : this->frames)
+        if (frame.file != nullptr)
+            write_back(frame);
+}
+
+// Write back the dirty frames of one file.
+void BufferPool::flush(HeapFile *file) {
+    unique_lock<mutex> lock(this->latch);
+    wait_for_writes(lock, file);
+    for (auto &frame : this->frames)
+        if (frame.file == file)
+            write_back(frame);
+}
+
+// Forget all the frames of a file without writing them back. Frames still pinned are
+// detached from the file and become free when they are unpinned.
+void BufferPool::discard(HeapFile *file) {
+    unique_lock<mutex> lock(this->latch);
+    wait_for_writes(lock, file);
+    for (uint frame_id = 0; frame_id < this->frames.size(); frame_id++) {
+        Frame &frame = this->frames[frame_id];
+        if (frame.file != file)
+            continue;
+        this->block_frames.erase(pair<HeapFile*, BlockID>(frame.file, frame.block_id));
+        frame.file = nullptr;
+        frame.dirty = false;
+        if (frame.pins == 0)
+            release(frame_id);
+    }
+}
+
+// Choose a frame to load a block into: a free one, or else the next unpinned frame that the
+// clock hand finds without its referenced bit set. The caller writes back what it holds.
+uint BufferPool::victim() {
+    uint n = (uint)this->frames.size();
+    for (uint i = 0; i < 2 * n; i++) {
+        uint frame_id = this->clock_hand;
+        this->clock_hand = (this->clock_hand + 1) % n;
+        Frame &frame = this->frames[frame_id];
+        if (frame.pins > 0)
+            continue;
+        if (frame.page == nullptr)
+            return frame_id;
+        if (frame.referenced) {
+            frame.referenced = false;
+            continue;
+        }
+        this->evictions++;
+        return frame_id;
+    }
+    // everything is pinned
+    Frame frame = {nullptr, 0, nullptr, new char[DbBlock::BLOCK_SZ], 0, false, false, false};
+    this->frames.push_back(frame);
+    return n;
+}
+
+// Write the frame's block to its file if it has changed.
+void BufferPool::write_back(Frame &frame) {
+    if (frame.dirty && frame.file != nullptr) {
+        frame.file->write_block(frame.block_id, frame.data);
+        frame.dirty = false;
+    }
+}
+
+// Wait until no evicted block of the file is still being written back outside the latch.
+void BufferPool::wait_for_writes(unique_lock<mutex> &lock, HeapFile *file) {
+    this->loaded.wait(lock, [this, file] {
+        auto next = this->writing.lower_bound(pair<HeapFile*, BlockID>(file, 0));
+        return next == this->writing.end() || next->first != file;
+    });
+}
+
+// Empty out a frame.
+void BufferPool::release(uint frame_id) {
+    Frame &frame = this->frames[frame_id];
+    if (frame.page != nullptr) {
+        if (frame.file != nullptr)
+            this->block_frames.erase(pair<HeapFile*, BlockID>(frame.file, frame.block_id));
+        this->page_frames.erase(frame.page);
+        delete frame.page;
+    }
+    frame.file = nullptr;
+    frame.block_id = 0;
+    frame.page = nullptr;
+    frame.pins = 0;
+    frame.dirty = false;
+    frame.referenced = false;
+}
+
+/*
+ * *******************
+ * FreeSpaceMap class
+ * *******************
+ */
+
+FreeSpaceMap::FreeSpaceMap(string name) : file(name + ".fsm"), closed(true), free(), roomy() {
+}
+
+// Start the map off with an entry for each of heap's blocks.
+void FreeSpaceMap::create(HeapFile &heap) {
+    this->file.create();
+    SlottedPage *page = this->file.get(1);
+    add_entries(page);
+    this->file.unpin(page);
+    this->closed = false;
+    this->free.clear();
+    this->roomy.clear();
+    for (BlockID block_id = 1; block_id <= heap.get_last_block_id(); block_id++) {
+        SlottedPage *block = heap.get(block_id);
+        update(block_id, block->free_space());
+        heap.unpin(block);
+    }
+}
+
+void FreeSpaceMap::drop() {
+    try {
+        this->file.drop();
+    } catch (DbException &e) {
+        // a table from before free-space maps may never have had one
+    }
+    this->closed = true;
+    this->free.clear();
+    this->roomy.clear();
+}
+
+void FreeSpaceMap::open(HeapFile &heap) {
+    if (!this->closed)
+        return;
+    try {
+        this->file.open();
+    } catch (DbException &e) {
+        create(heap);
+        return;
+    }
+    this->closed = false;
+    this->free.assign(heap.get_last_block_id() + 1, 0);
+    this->roomy.clear();
+    for (BlockID map_block_id = 1; map_block_id <= this->file.get_last_block_id(); map_block_id++) {
+        SlottedPage *page = this->file.get(map_block_id);
+        for (RecordID record_id = 1; record_id <= ENTRIES_PER_BLOCK; record_id++) {
+            BlockID block_id = (map_block_id - 1) * ENTRIES_PER_BLOCK + record_id;
+            if (block_id > heap.get_last_block_id())
+                break;
+            u16 size;
+            remember(block_id, *(const u16 *)page->view(record_id, size));
+        }
+        this->file.unpin(page);
+    }
+}
+
+void FreeSpaceMap::close() {
+    this->file.close();
+    this->closed = true;
+    this->free.clear();
+    this->roomy.clear();
+}
+
+BlockID FreeSpaceMap::find(u16 size) const {
+    for (auto const block_id : this->roomy)
+        if (this->free[block_id] >= size)
+            return block_id;
+    return 0;
+}
+
+// Keep the in-memory copy and write the block's entry through to the map's file.
+void FreeSpaceMap::update(BlockID block_id, u16 bytes) {
+    if (block_id < this->free.size() && this->free[block_id] == bytes)
+        return;
+    remember(block_id, bytes);
+    BlockID map_block_id = (block_id - 1) / ENTRIES_PER_BLOCK + 1;
+    while (this->file.get_last_block_id() < map_block_id) {
+        SlottedPage *page = this->file.get_new();
+        add_entries(page);
+        this->file.unpin(page);
+    }
+    SlottedPage *page = this->file.get(map_block_id);
+    Dbt entry(&bytes, sizeof(bytes));
+    page->put((block_id - 1) % ENTRIES_PER_BLOCK + 1, entry);
+    this->file.put(page);
+    this->file.unpin(page);
+}
+
+// Fill a new block of the map with zero entries.
+void FreeSpaceMap::add_entries(SlottedPage *page) {
+    u16 zero = 0;
+    Dbt entry(&zero, sizeof(zero));
+    for (uint i = 0; i < ENTRIES_PER_BLOCK; i++)
+        page->add(&entry);
+    this->file.put(page);
+}
+
+// Just the in-memory copy.
+void FreeSpaceMap::remember(BlockID block_id, u16 bytes) {
+    if (block_id >= this->free.size())
+        this->free.resize(block_id + 1, 0);
+    this->free[block_id] = bytes;
+    if (bytes >= ROOMY)
+        this->roomy.insert(block_id);
+    else
+        this->roomy.erase(block_id);
+}
+
 /*
  * *******************
  * HeapTable class
@@ -280,13 +851,21 @@ void HeapFile::db_open(uint flags) {
  */
 
 HeapTable::HeapTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes)
-                     : DbRelation(table_name, column_names, column_attributes), file(table_name) {
+                     : DbRelation(table_name, column_names, column_attributes), file(table_name),
+                       free_space(table_name), parallelism(DEFAULT_PARALLELISM) {
+}
+
+void HeapTable::set_parallelism(uint workers) {
+    if (workers == 0)
+        throw DbRelationError("parallelism must be at least 1");
+    this->parallelism = workers;
 }
 
 // Execute: CREATE TABLE <table_name> ( <columns> )
 // Is not responsible for metadata storage or validation.
 void HeapTable::create() {
     file.create();
+    free_space.create(file);
 }
 
 // Execute: CREATE TABLE IF NOT EXISTS <table_name> ( <columns> )
@@ -302,16 +881,19 @@ void HeapTable::create_if_not_exists() {
 // Execute: DROP TABLE <table_name>
 void HeapTable::drop() {
     file.drop();
+    free_space.drop();
 }
 
 // Open existing table. Enables: insert, update, delete, select, project
 void HeapTable::open() {
     file.open();
+    free_space.open(file);
 }
 
 // Closes the table. Disables: insert, update, delete, select, project
 void HeapTable::close() {
     file.close();
+    free_space.close();
 }
 
 // Expect row to be a dictionary with column name keys.
@@ -325,12 +907,67 @@ Handle HeapTable::insert(const ValueDict *row) {
     return handle;
 }
 
+// Every row is validated before any of them is written, so a bad row inserts nothing.
+Handles *HeapTable::insert_many(const ValueDicts *rows) {
+    open();
+    ValueDicts full_rows;
+    try {
+        for (auto const row : *rows)
+            full_rows.push_back(validate(row));
+    } catch (DbRelationError &e) {
+        for (auto full_row : full_rows)
+            delete full_row;
+        throw;
+    }
+    Handles *handles;
+    try {
+        handles = append(&full_rows);
+    } catch (...) {
+        for (auto full_row : full_rows)
+            delete full_row;
+        throw;
+    }
+    for (auto full_row : full_rows)
+        delete full_row;
+    return handles;
+}
+
 // Expect new_values to be a dictionary with column name keys.
 // Conceptually, execute: UPDATE INTO <table_name> SET <new_values> WHERE <handle>
 // where handle is sufficient to identify one specific record (e.g., returned from an insert
 // or select).
+// The new record goes over the old one if it fits in the row's block; otherwise it goes into
+// another block and the old one becomes a forwarding stub (see rewrite), so the handle stays
+// good either way.
 void HeapTable::update(const Handle handle, const ValueDict *new_values) {
-    throw DbRelationError("Not implemented");
+    open();
+    ValueDict *row = project(handle);
+    for (auto const &column : *new_values) {
+        if (row->find(column.first) == row->end()) {
+            delete row;
+            throw DbRelationError("table does not have column named '" + column.first + "'");
+        }
+        (*row)[column.first] = column.second;
+    }
+    Dbt *data;
+    try {
+        data = marshal(row);
+    } catch (DbRelationError &e) {
+        delete row;
+        throw;
+    }
+    delete row;
+    try {
+        if (data->get_size() > SlottedPage::MAX_RECORD)
+            throw DbRelationError("row too big to fit in a block");
+        rewrite(handle, *data);
+    } catch (DbRelationError &e) {
+        delete[] (char *)data->get_data();
+        delete data;
+        throw;
+    }
+    delete[] (char *)data->get_data();
+    delete data;
 }
 
 // Conceptually, execute: DELETE FROM <table_name> WHERE <handle>
@@ -341,9 +978,14 @@ void HeapTable::del(const Handle handle) {
     BlockID block_id = handle.first;
     RecordID record_id = handle.second;
     SlottedPage *block = this->file.get(block_id);
+    u16 size;
+    const char *bytes = block->view(record_id, size);
+    if (bytes != nullptr && (block->get_flags(record_id) & SlottedPage::FORWARD))
+        remove(forwarding_address(bytes));
     block->del(record_id);
+    this->free_space.update(block_id, block->free_space());
     this->file.put(block);
-    delete block;
+    this->file.unpin(block);
 }
 
 // Conceptually, execute: SELECT <handle> FROM <table_name> WHERE 1
@@ -354,33 +996,97 @@ Handles *HeapTable::select() {
 
 // Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
 // Returns a list of handles for qualifying rows.
+// With parallelism, each worker scans its own part of the blocks and the parts' handles
+// are concatenated, so they come out in the same order as a single-threaded scan.
 Handles *HeapTable::select(const ValueDict *where) {
     open();
-    Handles *handles = new Handles();
-    BlockIDs *block_ids = file.block_ids();
-    for (auto const &block_id : *block_ids) {
-        SlottedPage *block = file.get(block_id);
-        RecordIDs *record_ids = block->ids();
-        for (auto const &record_id : *record_ids) {
-            Handle handle(block_id, record_id);
-            if (selected(handle, where))
-                handles->push_back(Handle(block_id, record_id));
-        }
-        delete record_ids;
-        delete block;
+    vector<pair<BlockID, BlockID>> parts = partitions();
+    if (parts.size() <= 1) {
+        Handles *handles = new Handles();
+        DbCursor *cursor = select_cursor(where);
+        Handle handle;
+        while (cursor->next(handle))
+            handles->push_back(handle);
+        delete cursor;
+        return handles;
     }
-    delete block_ids;
+    vector<Handles> found(parts.size());
+    run_parallel(BufferPool::shared().get_workers(), (uint)parts.size(), [this, where, &parts, &found](uint part) {
+        HeapTableCursor cursor(*this, resolve(where), parts[part].first, parts[part].second);
+        Handle handle;
+        while (cursor.next(handle))
+            found[part].push_back(handle);
+    });
+    Handles *handles = new Handles();
+    for (auto const &part_handles : found)
+        handles->insert(handles->end(), part_handles.begin(), part_handles.end());
     return handles;
 }
 
+// Conceptually, execute: SELECT <handle> FROM <table_name> WHERE 1
+// Returns a cursor that yields the handles one block at a time.
+DbCursor *HeapTable::select_cursor() {
+    return select_cursor((const ValueDict *)nullptr);
+}
+
+// Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
+// Returns a cursor that yields qualifying handles one block at a time.
+DbCursor *HeapTable::select_cursor(const ValueDict *where) {
+    open();
+    return new HeapTableCursor(*this, resolve(where));
+}
+
+// Refine another selection lazily.
+DbCursor *HeapTable::select_cursor(DbCursor *current_selection, const ValueDict *where) {
+    open();
+    ColumnPredicates *predicates;
+    try {
+        predicates = resolve(where);
+    } catch (DbRelationError &e) {
+        delete current_selection;
+        throw;
+    }
+    return new HeapTableCursor(*this, predicates, current_selection);
+}
+
+// Conceptually, execute: SELECT <column_names> FROM <table_name>
+// Returns a cursor that decodes the records of each block into column batches.
+DbBatchCursor *HeapTable::batch_cursor(const ColumnNames *column_names) {
+    open();
+    return new HeapTableBatchCursor(*this, column_nums(column_names));
+}
+
+// One batch cursor per part of the blocks (see partitions).
+vector<DbBatchCursor*> HeapTable::batch_cursors(const ColumnNames *column_names) {
+    open();
+    vector<uint> nums = column_nums(column_names);
+    vector<DbBatchCursor*> cursors;
+    for (auto const &part : partitions())
+        cursors.push_back(new HeapTableBatchCursor(*this, nums, part.first, part.second));
+    if (cursors.empty())
+        cursors.push_back(new HeapTableBatchCursor(*this, nums));
+    return cursors;
+}
+
 // Refine another selection
+// Consecutive handles in the same block share a single fetch of that block.
 Handles* HeapTable::select(Handles *current_selection, const ValueDict* where) {
+    open();
     Handles* handles = new Handles();
+    ColumnPredicates *predicates = resolve(where);
+    RowView view(this->column_attributes);
+    SlottedPage *block = nullptr;
     for (auto const& handle: *current_selection) {
-        if (selected(handle, where)) {
+        if (block == nullptr || block->get_block_id() != handle.first) {
+            file.unpin(block);
+            block = file.get(handle.first);
+        }
+        if (selected(block, handle.second, predicates, view)) {
             handles->push_back(handle);
         }
     }
+    file.unpin(block);
+    delete predicates;
     return handles;
 }
 
@@ -390,59 +1096,243 @@ ValueDict *HeapTable::project(Handle handle) {
 }
 
 // Return a sequence of values for handle given by column_names.
+// Only the requested fields are copied out of the record, which is read in place.
 ValueDict *HeapTable::project(Handle handle, const ColumnNames *column_names) {
     BlockID block_id = handle.first;
     RecordID record_id = handle.second;
     SlottedPage *block = file.get(block_id);
-    Dbt *data = block->get(record_id);
-    ValueDict *row = unmarshal(data);
-    delete data;
-    delete block;
+    SlottedPage *moved_block;
+    const char *bytes = row_bytes(block, record_id, moved_block);
+    if (bytes == nullptr) {
+        file.unpin(block);
+        throw DbRelationError("no such row (it has been deleted)");
+    }
+    RowView view(this->column_attributes);
+    view.reset(bytes);
+    ValueDict *row;
+    try {
+        row = unmarshal(view, column_names->empty() ? &this->column_names : column_names);
+    } catch (DbRelationError &e) {
+        file.unpin(moved_block);
+        file.unpin(block);
+        throw;
+    }
+    file.unpin(moved_block);
+    file.unpin(block);
+    return row;
+}
+
+// Return the values given by column_names for each of handles, in the same order.
+ValueDicts *HeapTable::project(Handles *handles, const ColumnNames *column_names) {
     if (column_names->empty())
-        return row;
-    ValueDict *result = new ValueDict();
-    for (auto const &column_name : *column_names) {
-        if (row->find(column_name) == row->end())
-            throw DbRelationError("table does not have column named '" + column_name + "'");
-        (*result)[column_name] = (*row)[column_name];
+        column_names = &this->column_names;
+    ValueDicts *rows = new ValueDicts(handles->size(), nullptr);
+    try {
+        read_rows(handles, [this, rows, column_names](size_t i, const RowView &view) {
+            (*rows)[i] = unmarshal(view, column_names);
+        });
+    } catch (DbRelationError &e) {
+        for (auto row : *rows)
+            delete row;
+        delete rows;
+        throw;
     }
-    delete row;
-    return result;
+    return rows;
+}
+
+// The same rows as tuples, with the column names resolved to positions just once.
+Tuples *HeapTable::project_tuples(Handles *handles, const ColumnNames *column_names) {
+    if (column_names->empty())
+        column_names = &this->column_names;
+    vector<uint> nums = column_nums(column_names);
+    Tuples *tuples = new Tuples(handles->size(), nullptr);
+    try {
+        read_rows(handles, [&nums, tuples](size_t i, const RowView &view) {
+            Tuple *tuple = new Tuple();
+            (*tuples)[i] = tuple;
+            tuple->reserve((uint)nums.size());
+            for (uint col_num : nums) {
+                ColumnAttribute::DataType data_type = view.get_data_type(col_num);
+                if (data_type == ColumnAttribute::DataType::INT) {
+                    tuple->push_int(view.get_int(col_num));
+                } else if (data_type == ColumnAttribute::DataType::TEXT) {
+                    u16 size;
+                    const char *text = view.get_text(col_num, size);
+                    tuple->push_text(text, size);
+                } else {
+                    tuple->push_boolean(view.get_boolean(col_num));
+                }
+            }
+        });
+    } catch (DbRelationError &e) {
+        for (auto tuple : *tuples)
+            delete tuple;
+        delete tuples;
+        throw;
+    }
+    return tuples;
+}
+
+// Call read(i, view of handle i's record) for each of handles. The rows are read a block at
+// a time, so each block the handles are in is fetched just once.
+void HeapTable::read_rows(Handles *handles, const std::function<void(size_t, const RowView&)> &read) {
+    std::vector<size_t> order(handles->size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [handles](size_t a, size_t b) {
+        return (*handles)[a].first < (*handles)[b].first;
+    });
+
+    RowView view(this->column_attributes);
+    SlottedPage *block = nullptr;
+    SlottedPage *moved_block = nullptr;
+    try {
+        for (size_t i : order) {
+            const Handle &handle = (*handles)[i];
+            if (block == nullptr || block->get_block_id() != handle.first) {
+                file.unpin(block);
+                block = nullptr;  // not to be unpinned again if the get fails
+                block = file.get(handle.first);
+            }
+            const char *bytes = row_bytes(block, handle.second, moved_block);
+            if (bytes == nullptr)
+                throw DbRelationError("no such row (it has been deleted)");
+            view.reset(bytes);
+            read(i, view);
+            file.unpin(moved_block);
+            moved_block = nullptr;
+        }
+    } catch (DbRelationError &e) {
+        file.unpin(moved_block);
+        file.unpin(block);
+        throw;
+    }
+    file.unpin(block);
 }
 
 // Check if the given row is acceptable to insert. Raise ValueError if not.
 // Otherwise return the full row dictionary.
+// A row too big for an empty block is refused here, before any block is touched.
 ValueDict *HeapTable::validate(const ValueDict *row) const {
     ValueDict *full_row = new ValueDict();
-    for (auto const &column_name : this->column_names) {
+    uint size = 0;
+    for (uint col_num = 0; col_num < this->column_names.size(); col_num++) {
+        const Identifier &column_name = this->column_names[col_num];
         Value value;
         ValueDict::const_iterator column = row->find(column_name);
-        if (column == row->end())
+        if (column == row->end()) {
+            delete full_row;
             throw DbRelationError("don't know how to handle NULLs, defaults, etc. yet");
-        else
+        } else {
             value = column->second;
+        }
+        ColumnAttribute::DataType data_type = this->column_attributes[col_num].get_data_type();
+        if (data_type == ColumnAttribute::DataType::TEXT)
+            size += sizeof(u16) + (uint)value.s.length();
+        else if (data_type == ColumnAttribute::DataType::BOOLEAN)
+            size += sizeof(uint8_t);
+        else
+            size += sizeof(int32_t);
         (*full_row)[column_name] = value;
     }
+    if (size > SlottedPage::MAX_RECORD) {
+        delete full_row;
+        throw DbRelationError("row too big to fit in a block");
+    }
     return full_row;
 }
 
 // Assumes row is fully fleshed-out. Appends a record to the file.
 Handle HeapTable::append(const ValueDict *row) {
     Dbt *data = marshal(row);
-    SlottedPage *block = this->file.get(this->file.get_last_block_id());
+    SlottedPage *block = nullptr;
     RecordID record_id;
     try {
+        block = block_with_room((u16)data->get_size());
         record_id = block->add(data);
-    } catch (DbBlockNoRoomError &e) {
-        // need a new block
-        block = this->file.get_new();
-        record_id = block->add(data);
+    } catch (...) {
+        this->file.unpin(block);
+        delete[] (char *)data->get_data();
+        delete data;
+        throw;
     }
+    BlockID block_id = block->get_block_id();
+    this->free_space.update(block_id, block->free_space());
     this->file.put(block);
-    delete block;
+    this->file.unpin(block);
     delete[] (char *)data->get_data();
     delete data;
-    return Handle(this->file.get_last_block_id(), record_id);
+    return Handle(block_id, record_id);
+}
+
+// Assumes rows are validated. Fills one block with room after another, pinning and
+// marking each block dirty once rather than once per row. If a row can't be written,
+// the rows already written are taken back out before the error is rethrown.
+Handles *HeapTable::append(const ValueDicts *rows) {
+    Handles *handles = new Handles();
+    SlottedPage *block = nullptr;
+    Dbt *data = nullptr;
+    try {
+        for (auto const row : *rows) {
+            data = marshal(row);
+            u16 size = (u16)data->get_size();
+            if (block == nullptr || block->free_space() < size) {
+                if (block != nullptr) {
+                    this->free_space.update(block->get_block_id(), block->free_space());
+                    this->file.put(block);
+                    this->file.unpin(block);
+                    block = nullptr;  // not to be unpinned again if block_with_room fails
+                }
+                block = block_with_room(size);
+            }
+            RecordID record_id = block->add(data);
+            delete[] (char *)data->get_data();
+            delete data;
+            data = nullptr;
+            handles->push_back(Handle(block->get_block_id(), record_id));
+        }
+    } catch (...) {
+        if (data != nullptr) {
+            delete[] (char *)data->get_data();
+            delete data;
+        }
+        if (block != nullptr) {
+            this->free_space.update(block->get_block_id(), block->free_space());
+            this->file.put(block);
+            this->file.unpin(block);
+        }
+        for (auto const &handle : *handles) {
+            try {
+                del(handle);
+            } catch (...) {}
+        }
+        delete handles;
+        throw;
+    }
+    if (block != nullptr) {
+        this->free_space.update(block->get_block_id(), block->free_space());
+        this->file.put(block);
+        this->file.unpin(block);
+    }
+    return handles;
+}
+
+// A pinned block with room for a record of size bytes: the one the free-space map picks,
+// else the last block if it has room, else a new block.
+SlottedPage *HeapTable::block_with_room(u16 size) {
+    BlockID block_id;
+    while ((block_id = this->free_space.find(size)) != 0) {
+        SlottedPage *block = this->file.get(block_id);
+        if (block->free_space() >= size)
+            return block;
+        this->free_space.update(block_id, block->free_space());  // the map was out of date
+        this->file.unpin(block);
+    }
+    SlottedPage *block = this->file.get(this->file.get_last_block_id());
+    if (block->free_space() >= size)
+        return block;
+    this->file.unpin(block);
+    return this->file.get_new();
 }
 
 // return the bits to go into the file
@@ -480,50 +1370,333 @@ Dbt *HeapTable::marshal(const ValueDict *row) const {
             throw DbRelationError("Only know how to marshal INT, BOOLEAN and TEXT");
         }
     }
-    char *right_size_bytes = new char[offset];
+    // pad out to the size of a forwarding stub, so update() can always leave one in its place
+    uint size = max(offset, (uint)FORWARD_SIZE);
+    char *right_size_bytes = new char[size];
     memcpy(right_size_bytes, bytes, offset);
+    memset(right_size_bytes + offset, 0, size - offset);
     delete[] bytes;
-    Dbt *data = new Dbt(right_size_bytes, offset);
+    Dbt *data = new Dbt(right_size_bytes, size);
     return data;
 }
 
 ValueDict *HeapTable::unmarshal(Dbt *data) const {
+    RowView view(this->column_attributes);
+    view.reset((const char *)data->get_data());
+    return unmarshal(view, &this->column_names);
+}
+
+// Copy the named fields out of a record being viewed in place.
+ValueDict *HeapTable::unmarshal(const RowView &view, const ColumnNames *column_names) const {
     ValueDict *row = new ValueDict();
-    Value value;
-    char *bytes = (char *)data->get_data();
-    uint offset = 0;
-    uint col_num = 0;
-    for (auto const &column_name : this->column_names) {
-        ColumnAttribute ca = this->column_attributes[col_num++];
-        value.data_type = ca.get_data_type();
-        if (ca.get_data_type() == ColumnAttribute::DataType::INT) {
-            value.n = *(int32_t *)(bytes + offset);
-            offset += sizeof(int32_t);
-        } else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT) {
-            u16 size = *(u16 *)(bytes + offset);
-            offset += sizeof(u16);
-            char buffer[DbBlock::BLOCK_SZ];
-            memcpy(buffer, bytes + offset, size);
-            buffer[size] = '\0';
-            value.s = string(buffer); // assume ascii for now
-            offset += size;
-        } else if (ca.get_data_type() == ColumnAttribute::DataType::BOOLEAN) {
-            value.n = *(uint8_t*)(bytes + offset);
-            offset += sizeof(uint8_t);
-        } else {
-            throw DbRelationError("Only know how to unmarshal INT, BOOLEAN and TEXT");
+    for (auto const &column_name : *column_names) {
+        auto column = find(this->column_names.begin(), this->column_names.end(), column_name);
+        if (column == this->column_names.end()) {
+            delete row;
+            throw DbRelationError("table does not have column named '" + column_name + "'");
         }
-        (*row)[column_name] = value;
+        (*row)[column_name] = view.get_value((uint)(column - this->column_names.begin()));
     }
     return row;
 }
 
-// See if the row at the given handle satisfies the given where clause
-bool HeapTable::selected(Handle handle, const ValueDict *where) {
+// Resolve the where clause to column positions. Returns nullptr if there is no where clause.
+// Raises DbRelationError if the where clause names a column not in this table.
+ColumnPredicates *HeapTable::resolve(const ValueDict *where) const {
     if (where == nullptr)
+        return nullptr;
+    ColumnPredicates *predicates = new ColumnPredicates();
+    for (uint col_num = 0; col_num < this->column_names.size(); col_num++) {
+        ValueDict::const_iterator column = where->find(this->column_names[col_num]);
+        if (column != where->end())
+            predicates->push_back(pair<uint, const Value*>(col_num, &column->second));
+    }
+    if (predicates->size() != where->size()) {
+        delete predicates;
+        for (auto const &column : *where)
+            if (find(this->column_names.begin(), this->column_names.end(), column.first) == this->column_names.end())
+                throw DbRelationError("table does not have column named '" + column.first + "'");
+    }
+    return predicates;
+}
+
+// See if the given record in an already-fetched block satisfies the resolved where clause.
+// Fields are compared in place through view, so no row dictionary is built.
+bool HeapTable::selected(SlottedPage *block, RecordID record_id, const ColumnPredicates *predicates,
+                         RowView &view) {
+    if (predicates == nullptr)
         return true;
-    ValueDict *row = this->project(handle, where);
-    return *row == *where;
+    SlottedPage *moved_block;
+    const char *bytes = row_bytes(block, record_id, moved_block);
+    if (bytes == nullptr)
+        return false;
+    view.reset(bytes);
+    bool matched = true;
+    for (auto const &predicate : *predicates) {
+        if (!view.matches(predicate.first, *predicate.second)) {
+            matched = false;
+            break;
+        }
+    }
+    this->file.unpin(moved_block);
+    return matched;
+}
+
+// The bytes of a row in an already-fetched block, following its forwarding stub if update()
+// moved it. Returns nullptr if the row has been deleted. If the row was moved, the block it
+// is in now is left pinned in moved_block (otherwise that is nullptr) for the caller to unpin.
+const char *HeapTable::row_bytes(SlottedPage *block, RecordID record_id, SlottedPage *&moved_block) {
+    moved_block = nullptr;
+    u16 size;
+    const char *bytes = block->view(record_id, size);
+    if (bytes == nullptr || !(block->get_flags(record_id) & SlottedPage::FORWARD))
+        return bytes;
+    Handle moved = forwarding_address(bytes);
+    moved_block = this->file.get(moved.first);
+    return moved_block->view(moved.second, size);
+}
+
+// Ids of the rows kept in a block, leaving out records moved there by update(), which are
+// found through their forwarding stubs instead.
+RecordIDs *HeapTable::row_ids(SlottedPage *block) const {
+    RecordIDs *ids = block->ids();
+    ids->erase(remove_if(ids->begin(), ids->end(), [block](RecordID record_id) {
+        return (block->get_flags(record_id) & SlottedPage::MOVED) != 0;
+    }), ids->end());
+    return ids;
+}
+
+// Write a row's new record where its handle will find it. In order of preference: over the
+// record itself (or, for a row already moved, over the moved record); back in the row's own
+// block, over its forwarding stub; or into another block, leaving (or repointing) the stub.
+// Rows are only ever forwarded once, since the stub always points at the row's record.
+void HeapTable::rewrite(Handle handle, const Dbt &data) {
+    SlottedPage *block = this->file.get(handle.first);
+    u16 size;
+    const char *bytes = block->view(handle.second, size);
+    if (bytes == nullptr) {
+        this->file.unpin(block);
+        throw DbRelationError("no such row (it has been deleted)");
+    }
+    bool forwarded = (block->get_flags(handle.second) & SlottedPage::FORWARD) != 0;
+    Handle moved = forwarded ? forwarding_address(bytes) : Handle(0, 0);
+    if (forwarded && put_record(moved, data, SlottedPage::MOVED)) {
+        this->file.unpin(block);
+        return;
+    }
+    if (put_record(block, handle.second, data, 0)) {
+        if (forwarded)
+            remove(moved);
+        this->file.unpin(block);
+        return;
+    }
+
+    SlottedPage *target = block_with_room((u16)data.get_size());
+    RecordID record_id = target->add(&data);
+    target->set_flags(record_id, SlottedPage::MOVED);
+    BlockID target_id = target->get_block_id();
+    char stub[FORWARD_SIZE];
+    memcpy(stub, &target_id, sizeof(BlockID));
+    memcpy(stub + sizeof(BlockID), &record_id, sizeof(RecordID));
+    Dbt stub_data(stub, FORWARD_SIZE);
+    if (!put_record(block, handle.second, stub_data, SlottedPage::FORWARD)) {
+        target->del(record_id);
+        this->file.unpin(target);
+        this->file.unpin(block);
+        throw DbRelationError("no room left in block for a forwarding address");
+    }
+    this->free_space.update(target_id, target->free_space());
+    this->file.put(target);
+    this->file.unpin(target);
+    if (forwarded)
+        remove(moved);
+    this->file.unpin(block);
+}
+
+// Put a record over another one in a pinned block, with the given flags, if it fits there.
+bool HeapTable::put_record(SlottedPage *block, RecordID record_id, const Dbt &data, u16 flags) {
+    if (!block->try_put(record_id, data))
+        return false;
+    block->set_flags(record_id, flags);
+    this->free_space.update(block->get_block_id(), block->free_space());
+    this->file.put(block);
+    return true;
+}
+
+// Same, for a record in a block not yet pinned.
+bool HeapTable::put_record(Handle handle, const Dbt &data, u16 flags) {
+    SlottedPage *block = this->file.get(handle.first);
+    bool fits = put_record(block, handle.second, data, flags);
+    this->file.unpin(block);
+    return fits;
+}
+
+// Delete a moved record (the forwarding stub to it is left to the caller).
+void HeapTable::remove(Handle moved) {
+    SlottedPage *block = this->file.get(moved.first);
+    block->del(moved.second);
+    this->free_space.update(moved.first, block->free_space());
+    this->file.put(block);
+    this->file.unpin(block);
+}
+
+// Where a forwarding stub says its row is now.
+Handle HeapTable::forwarding_address(const char *bytes) const {
+    BlockID block_id;
+    RecordID record_id;
+    memcpy(&block_id, bytes, sizeof(BlockID));
+    memcpy(&record_id, bytes + sizeof(BlockID), sizeof(RecordID));
+    return Handle(block_id, record_id);
+}
+
+// Split the blocks into up to parallelism runs of consecutive blocks, as evenly as
+// possible, for the workers of a parallel scan. Each run is (first block, last block) and,
+// unless the table is smaller than that, at least MIN_PARTITION_BLOCKS blocks long.
+vector<pair<BlockID, BlockID>> HeapTable::partitions() {
+    BlockID last = this->file.get_last_block_id();
+    uint workers = min(this->parallelism, max(1u, (uint)last / MIN_PARTITION_BLOCKS));
+    workers = min(workers, (uint)last);
+    vector<pair<BlockID, BlockID>> parts;
+    for (uint part = 0; part < workers; part++)
+        parts.push_back(make_pair((BlockID)(1 + (u_long)last * part / workers),
+                                  (BlockID)((u_long)last * (part + 1) / workers)));
+    return parts;
+}
+
+// Table positions of the given columns.
+vector<uint> HeapTable::column_nums(const ColumnNames *column_names) const {
+    vector<uint> nums;
+    for (auto const &column_name : *column_names) {
+        auto column = find(this->column_names.begin(), this->column_names.end(), column_name);
+        if (column == this->column_names.end())
+            throw DbRelationError("table does not have column named '" + column_name + "'");
+        nums.push_back((uint)(column - this->column_names.begin()));
+    }
+    return nums;
+}
+
+/*
+ * *******************
+ * HeapTableCursor class
+ * *******************
+ */
+
+HeapTableCursor::HeapTableCursor(HeapTable &table, ColumnPredicates *predicates, DbCursor *current_selection)
+        : table(table), predicates(predicates), current_selection(current_selection), block_id(0),
+          last_block_id(table.file.get_last_block_id()), block(nullptr), record_ids(nullptr), position(0),
+          view(table.column_attributes) {
+}
+
+HeapTableCursor::HeapTableCursor(HeapTable &table, ColumnPredicates *predicates, BlockID first_block_id,
+                                 BlockID last_block_id)
+        : table(table), predicates(predicates), current_selection(nullptr), block_id(first_block_id - 1),
+          last_block_id(last_block_id), block(nullptr), record_ids(nullptr), position(0),
+          view(table.column_attributes) {
+}
+
+HeapTableCursor::~HeapTableCursor() {
+    delete this->record_ids;
+    this->table.file.unpin(this->block);
+    delete this->current_selection;
+    delete this->predicates;
+}
+
+// Make the given block the current one (unless it already is).
+void HeapTableCursor::fetch(BlockID block_id) {
+    if (this->block != nullptr && this->block_id == block_id)
+        return;
+    this->table.file.unpin(this->block);
+    delete this->record_ids;
+    this->record_ids = nullptr;
+    this->block_id = block_id;
+    this->block = this->table.file.get(block_id);
+}
+
+// Yield the next qualifying handle, moving on to the next block when this one is used up.
+bool HeapTableCursor::next(Handle &handle) {
+    if (this->current_selection != nullptr) {
+        while (this->current_selection->next(handle)) {
+            fetch(handle.first);
+            if (this->table.selected(this->block, handle.second, this->predicates, this->view))
+                return true;
+        }
+        return false;
+    }
+    while (true) {
+        if (this->record_ids != nullptr) {
+            while (this->position < this->record_ids->size()) {
+                RecordID record_id = (*this->record_ids)[this->position++];
+                if (this->table.selected(this->block, record_id, this->predicates, this->view)) {
+                    handle = Handle(this->block_id, record_id);
+                    return true;
+                }
+            }
+        }
+        if (this->block_id >= this->last_block_id)
+            return false;
+        fetch(this->block_id + 1);
+        this->record_ids = this->table.row_ids(this->block);
+        this->position = 0;
+    }
+}
+
+/*
+ * *******************
+ * HeapTableBatchCursor class
+ * *******************
+ */
+
+HeapTableBatchCursor::HeapTableBatchCursor(HeapTable &table, const vector<uint> &column_nums)
+        : table(table), column_nums(column_nums), block_id(0), last_block_id(table.file.get_last_block_id()),
+          block(nullptr), record_ids(nullptr), position(0), view(table.column_attributes) {
+}
+
+HeapTableBatchCursor::HeapTableBatchCursor(HeapTable &table, const vector<uint> &column_nums,
+                                           BlockID first_block_id, BlockID last_block_id)
+        : table(table), column_nums(column_nums), block_id(first_block_id - 1), last_block_id(last_block_id),
+          block(nullptr), record_ids(nullptr), position(0), view(table.column_attributes) {
+}
+
+HeapTableBatchCursor::~HeapTableBatchCursor() {
+    delete this->record_ids;
+    this->table.file.unpin(this->block);
+}
+
+// Fill the batch from where the last one left off, crossing blocks as needed.
+bool HeapTableBatchCursor::next(ColumnBatch &batch) {
+    batch.clear();
+    while (!batch.full()) {
+        if (this->record_ids == nullptr || this->position >= this->record_ids->size()) {
+            if (this->block_id >= this->last_block_id)
+                break;
+            this->table.file.unpin(this->block);
+            delete this->record_ids;
+            this->block = this->table.file.get(++this->block_id);
+            this->record_ids = this->table.row_ids(this->block);
+            this->position = 0;
+            continue;
+        }
+        RecordID record_id = (*this->record_ids)[this->position++];
+        u16 size;
+        SlottedPage *moved_block;
+        this->view.reset(this->table.row_bytes(this->block, record_id, moved_block));
+        batch.add_row(Handle(this->block_id, record_id));
+        for (uint i = 0; i < this->column_nums.size(); i++) {
+            uint col_num = this->column_nums[i];
+            ColumnAttribute::DataType data_type = this->view.get_data_type(col_num);
+            if (data_type == ColumnAttribute::DataType::INT) {
+                batch.push_int(i, this->view.get_int(col_num));
+            } else if (data_type == ColumnAttribute::DataType::TEXT) {
+                const char *text = this->view.get_text(col_num, size);
+                batch.push_text(i, text, size);
+            } else {
+                batch.push_boolean(i, this->view.get_boolean(col_num));
+            }
+        }
+        this->table.file.unpin(moved_block);
+    }
+    batch.select_all();
+    return batch.size() > 0;
 }
 
 // heap_storage_test and helper functions implementation
@@ -542,10 +1715,12 @@ bool test_compare(DbRelation &table, Handle handle, int a, string b) {
 		    return false;
 	  }
 	  value = (*result)["b"];
-	  delete result;
-    if (value.s != b)
+    if (value.s != b) {
+        delete result;
         return false;
+    }
     value = (*result)["c"];
+	  delete result;
     if (value.n != (a%2 == 0))
         return false;
     return true;
@@ -568,8 +1743,11 @@ bool test_heap_storage() {
 	  cout << "test_heap_storage: " << endl;
     table1.create();
     cout << "create ok" << endl;
-    table1.drop();  // drop makes the object unusable because of BerkeleyDB restriction -- maybe want to fix this some day
+    table1.drop();
     cout << "drop ok" << endl;
+    table1.create();  // each open gets a new Berkeley DB handle, so the object can be used again
+    table1.drop();
+    cout << "create after drop ok" << endl;
 
 	  HeapTable table("_test_data_cpp", column_names, column_attributes);
     table.create_if_not_exists();
@@ -599,9 +1777,264 @@ bool test_heap_storage() {
     for (auto const& handle: *handles)
         if (!test_compare(table, handle, i++, b))
             return false;
+    Handles reversed(handles->rbegin(), handles->rend());
+    ValueDicts *projected = table.project(&reversed);
+    for (size_t j = 0; j < projected->size(); j++) {
+        if ((*(*projected)[j])["a"] != Value(999 - (int)j))
+            return false;
+        delete (*projected)[j];
+    }
+    delete projected;
+    ColumnNames tuple_columns = {"b", "a"};
+    Tuples *tuples = table.project_tuples(&reversed, &tuple_columns);
+    for (size_t j = 0; j < tuples->size(); j++) {
+        Tuple *tuple = (*tuples)[j];
+        if (tuple->size() != 2 || tuple->get_int(1) != 999 - (int)j || tuple->get_value(0) != Value(b))
+            return false;
+        delete tuple;
+    }
+    delete tuples;
+    HandleBitmap all, evens;
+    for (size_t j = 0; j < reversed.size(); j++) {
+        all.add(reversed[j]);
+        if (j % 2 == 0)
+            evens.add(reversed[j]);
+    }
+    Handles *ordered = all.handles();
+    bool in_order = *ordered == *handles;
+    delete ordered;
+    if (!in_order)
+        return false;
+    HandleBitmap odds = all;
+    all.intersect(evens);
+    odds.intersect(HandleBitmap());
+    if (all.size() != 501 || !odds.empty())
+        return false;
+    for (size_t j = 1; j < reversed.size(); j += 2)
+        odds.add(reversed[j]);
+    all.unite(odds);
+    if (all.size() != 1001)
+        return false;
     cout << "many inserts/select/projects ok" << endl;
 	  delete handles;
 
+    ValueDict where;
+    where["a"] = Value(500);
+    where["b"] = Value(b);
+    handles = table.select(&where);
+    if (handles->size() != 1 || !test_compare(table, (*handles)[0], 500, b))
+        return false;
+    Handles* refined = table.select(handles, &where);
+    bool same = *refined == *handles;
+    delete refined;
+    delete handles;
+    if (!same)
+        return false;
+    cout << "select where ok" << endl;
+
+    ColumnNames batch_columns;
+    batch_columns.push_back("c");
+    batch_columns.push_back("a");
+    ColumnAttributes *batch_attributes = table.get_column_attributes(batch_columns);
+    ColumnBatch batch(batch_columns, *batch_attributes);
+    delete batch_attributes;
+    DbBatchCursor *batches = table.batch_cursor(&batch_columns);
+    Value yes(1);
+    yes.data_type = ColumnAttribute::BOOLEAN;
+    int rows = 0, trues = 0, fives = 0;
+    while (batches->next(batch)) {
+        for (uint row = 0; row < batch.size(); row++)
+            if (batch.get_int(1, row) != rows++ - 1)
+                return false;
+        batch.filter_eq(0, yes);
+        trues += batch.get_selection().size();
+        batch.filter_eq(1, Value(500));
+        fives += batch.get_selection().size();
+    }
+    delete batches;
+    if (rows != 1001 || trues != 500 || fives != 1)
+        return false;
+    cout << "batch scan ok" << endl;
+
+    ValueDict even;
+    even["c"] = yes;
+    handles = table.select(&even);
+    table.set_parallelism(3);
+    Handles *parallel = table.select(&even);
+    same = *parallel == *handles && handles->size() == 500;
+    delete parallel;
+    delete handles;
+    if (!same)
+        return false;
+    vector<DbBatchCursor*> parts = table.batch_cursors(&batch_columns);
+    rows = 0;
+    for (auto part : parts) {
+        while (part->next(batch))
+            rows += batch.size();
+        delete part;
+    }
+    table.set_parallelism(HeapTable::DEFAULT_PARALLELISM);
+    if (parts.size() != 3 || rows != 1001)
+        return false;
+
+    // a table too small to be worth splitting is scanned in one part
+    HeapTable small("_test_small_scan_cpp", column_names, column_attributes);
+    small.create();
+    small.insert(&row);
+    small.set_parallelism(3);
+    parts = small.batch_cursors(&batch_columns);
+    same = parts.size() == 1;
+    for (auto part : parts)
+        delete part;
+    small.drop();
+    if (!same)
+        return false;
+
+    // more parts than pool threads still all get run, and the first failure comes back out
+    WorkerPool workers(2);
+    vector<int> ran(10, 0);
+    run_parallel(workers, 10, [&ran](uint part) { ran[part]++; });
+    same = count(ran.begin(), ran.end(), 1) == 10;
+    try {
+        run_parallel(workers, 10, [](uint part) {
+            if (part >= 7)
+                throw DbRelationError("part " + to_string(part));
+        });
+        same = false;
+    } catch (DbRelationError &e) {
+        same = same && string(e.what()) == "part 7";
+    }
+    if (!same)
+        return false;
+    cout << "parallel scan ok" << endl;
+
+    ValueDicts many;
+    for (int j = 0; j < 200; j++) {
+        ValueDict *many_row = new ValueDict();
+        test_set_row(*many_row, 2000 + j, b);
+        many.push_back(many_row);
+    }
+    handles = table.insert_many(&many);
+    same = handles->size() == 200;
+    for (int j = 0; same && j < 200; j++)
+        same = test_compare(table, (*handles)[j], 2000 + j, b);
+    for (auto const &handle : *handles)
+        table.del(handle);
+    if (!same)
+        return false;
+    // a row too big for any block is refused before the rows ahead of it are written,
+    // and the biggest row that fits goes into a block of its own
+    Handles *before = table.select();
+    ValueDict big_row;
+    test_set_row(big_row, 3000, string(SlottedPage::MAX_RECORD - 6, 'x'));
+    ValueDicts too_big(many.begin(), many.begin() + 3);
+    too_big.push_back(&big_row);
+    try {
+        delete table.insert_many(&too_big);
+        return false;
+    } catch (DbRelationError &e) {}
+    Handles *after = table.select();
+    same = after->size() == before->size();
+    delete before;
+    delete after;
+    if (!same)
+        return false;
+    big_row["b"] = Value(string(SlottedPage::MAX_RECORD - 7, 'x'));
+    Handle biggest = table.insert(&big_row);
+    if (!test_compare(table, biggest, 3000, string(SlottedPage::MAX_RECORD - 7, 'x')))
+        return false;
+    table.del(biggest);
+    cout << "insert many ok" << endl;
+
+    // the same rows again should go into the space the deleted ones left
+    Handles *again = table.insert_many(&many);
+    for (auto many_row : many)
+        delete many_row;
+    same = again->back().first <= handles->back().first;
+    for (auto const &handle : *again)
+        table.del(handle);
+    delete again;
+    delete handles;
+    if (!same)
+        return false;
+    cout << "free space reuse ok" << endl;
+
+    // a deleted slot's id is handed out again, and growing a record past the
+    // contiguous gap compacts the page without disturbing the other records
+    char page_bytes[DbBlock::BLOCK_SZ];
+    Dbt page_data(page_bytes, sizeof(page_bytes));
+    SlottedPage page(page_data, 1, true);
+    string filler(400, 'x');
+    Dbt filler_data((void *)filler.data(), (u_int32_t)filler.size());
+    while (page.free_space() >= filler.size())
+        page.add(&filler_data);
+    page.del(2);
+    page.del(4);
+    string bigger(700, 'y');
+    Dbt bigger_data((void *)bigger.data(), (u_int32_t)bigger.size());
+    page.put(3, bigger_data);
+    if (page.add(&filler_data) != 2)
+        return false;
+    string huge(DbBlock::BLOCK_SZ - 100, 'z');
+    Dbt huge_data((void *)huge.data(), (u_int32_t)huge.size());
+    if (page.try_add(&huge_data) != 0 || page.try_put(3, huge_data))
+        return false;
+    u16 size;
+    const char *bytes = page.view(3, size);
+    if (string(bytes, size) != bigger)
+        return false;
+    bytes = page.view(5, size);
+    if (string(bytes, size) != filler)
+        return false;
+    cout << "slot reuse ok" << endl;
+
+    // a row that no longer fits in its block is moved, but keeps its handle
+    where.clear();
+    where["a"] = Value(500);
+    handles = table.select(&where);
+    Handle moving = (*handles)[0];
+    delete handles;
+    ValueDict new_values;
+    new_values["b"] = Value("short");
+    table.update(moving, &new_values);
+    if (!test_compare(table, moving, 500, "short"))
+        return false;
+    string longer(1500, 'z');
+    new_values["b"] = Value(longer);
+    table.update(moving, &new_values);
+    where["b"] = Value(longer);
+    handles = table.select(&where);
+    same = handles->size() == 1 && (*handles)[0] == moving && test_compare(table, moving, 500, longer);
+    delete handles;
+    new_values["b"] = Value(b);
+    table.update(moving, &new_values);
+    handles = table.select();
+    same = same && handles->size() == 1001 && test_compare(table, moving, 500, b);
+    delete handles;
+    if (!same)
+        return false;
+
+    // a tiny row in a full block still has room for its forwarding stub when it outgrows it
+    ColumnNames tiny_names(1, "t");
+    ColumnAttributes tiny_attributes(1, ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable tiny("_test_tiny_rows_cpp", tiny_names, tiny_attributes);
+    tiny.create();
+    ValueDict empty;
+    empty["t"] = Value("");
+    Handle first = tiny.insert(&empty);
+    while (tiny.insert(&empty).first == first.first)
+        ;
+    new_values.clear();
+    new_values["t"] = Value(string(100, 'w'));
+    tiny.update(first, &new_values);
+    ValueDict *grown = tiny.project(first);
+    same = (*grown)["t"] == Value(string(100, 'w'));
+    delete grown;
+    tiny.drop();
+    if (!same)
+        return false;
+    cout << "update ok" << endl;
+
     table.del(last_handle);
     handles = table.select();
     if (handles->size() != 1000)
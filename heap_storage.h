@@ -12,8 +12,21 @@
  */
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <set>
 #include "db_cxx.h"
 #include "storage_engine.h"
+#include "ColumnBatch.h"
+
+class SlottedPage;
+class HeapFile;
+
+/*
+ * A where-clause resolved against a table's columns: (column position, value to match)
+ * pairs in column order, so a record can be checked in one pass over its bytes.
+ */
+typedef std::vector<std::pair<uint, const Value*>> ColumnPredicates;
 
 /**
  * @class SlottedPage - heap file implementation of DbBlock.
@@ -21,7 +34,7 @@
  * Manage a database block that contains several records.
  * Modeled after slotted-page from Database Systems Concepts, 6ed, Figure 10-9.
  * Record id are handed out sequentially starting with 1 as records are added
-   with add().
+   with add(), except that add() reuses the id of a deleted record if there is one.
  * Each record has a header which is a fixed offset from the beginning of the
    block:
        Bytes 0x00 - Ox01: number of records
@@ -29,10 +42,22 @@
        Bytes 0x04 - 0x05: size of record 1
        Bytes 0x06 - 0x07: offset to record 1
        etc.
+ * A deleted record's header is left as a tombstone (size and offset 0) and its bytes
+   as a hole; a record shrunk by put() leaves a hole too. Holes are only squeezed out
+   (by compact(), in one pass) once an add() or put() needs their room.
+ * The top two bits of a record's size are flags for the block's owner (see FORWARD
+   and MOVED); add() and put() write a record without any.
  *
  */
 class SlottedPage : public DbBlock {
 public:
+	  // record flags, used by HeapTable::update
+	  static const uint16_t FORWARD = 0x8000;  // record is the address of where it was moved
+	  static const uint16_t MOVED = 0x4000;    // record was moved here from another block
+	  static const uint16_t FLAGS = FORWARD | MOVED;
+	  // the largest record an empty page takes (after its block header and one record header)
+	  static const uint16_t MAX_RECORD = DbBlock::BLOCK_SZ - 1 - 4 - 4;
+
     SlottedPage(Dbt &block, BlockID block_id, bool is_new=false);
 	  // Big 5 - we only need the destructor, copy-ctor, move-ctor, and op= are
     // unnecessary but we delete them explicitly just to make sure we don't use
@@ -44,26 +69,69 @@ public:
 	  SlottedPage& operator=(SlottedPage& temp) = delete;
 
 	  virtual RecordID add(const Dbt* data) throw(DbBlockNoRoomError);
+	  virtual RecordID try_add(const Dbt* data);  // 0 instead of DbBlockNoRoomError
 	  virtual Dbt* get(RecordID record_id) const;
+	  virtual const char* view(RecordID record_id, uint16_t &size) const;
 	  virtual void put(RecordID record_id, const Dbt &data) throw (DbBlockNoRoomError);
+	  virtual bool try_put(RecordID record_id, const Dbt &data);  // false instead of DbBlockNoRoomError
 	  virtual void del(RecordID record_id);
 	  virtual RecordIDs* ids(void) const;
     virtual void clear();
     virtual u_int16_t size() const;
+	  virtual uint16_t free_space() const;  // size of the largest record add() would take
+	  virtual uint16_t get_flags(RecordID record_id) const;
+	  virtual void set_flags(RecordID record_id, uint16_t flags);
 
 protected:
 	  uint16_t num_records;
 	  uint16_t end_free;
+	  // not stored in the block; counted when it is read in and kept up to date after
+	  uint16_t holes;          // bytes of deleted or shrunk records not yet compacted away
+	  uint16_t tombstones;     // deleted record ids that add() can reuse
+	  RecordID first_tombstone;  // no tombstone has a lower id than this
 
 	  virtual void get_header(uint16_t &size, uint16_t &loc, RecordID id=0) const;
-	  virtual void put_header(RecordID id=0, uint16_t size=0, uint16_t loc=0);
+	  virtual void put_header(RecordID id=0, uint16_t size=0, uint16_t loc=0, uint16_t flags=0);
 	  virtual bool has_room(uint16_t size) const;
-	  virtual void slide(uint16_t start, uint16_t end);
+	  virtual uint16_t gap() const;
+	  virtual RecordID reuse_tombstone();
+	  virtual uint16_t allocate(uint16_t size);
+	  virtual void compact();
 	  virtual uint16_t get_n(uint16_t offset) const;
 	  virtual void put_n(uint16_t offset, uint16_t n);
 	  virtual void* address(uint16_t offset) const;
 };
 
+/**
+ * @class RowView - a HeapTable record read in place in its block rather than unmarshaled
+ *
+ * Only a TEXT field moves the fields after it, so offsets are worked out from the column
+ * attributes as far as the fields asked for, once per record. The view is only good while
+ * the block stays pinned and the record unchanged; reset() points it at the next record.
+ */
+class RowView {
+public:
+	  RowView(const ColumnAttributes &column_attributes);
+	  virtual ~RowView() {}
+
+	  void reset(const char *bytes);
+
+	  ColumnAttribute::DataType get_data_type(uint col_num) const;
+	  int32_t get_int(uint col_num) const;
+	  bool get_boolean(uint col_num) const;
+	  const char *get_text(uint col_num, uint16_t &size) const;  // not NUL-terminated
+	  Value get_value(uint col_num) const;
+	  bool matches(uint col_num, const Value &value) const;
+
+protected:
+	  const ColumnAttributes &column_attributes;
+	  const char *bytes;
+	  mutable std::vector<uint16_t> offsets;
+	  mutable uint known;  // offsets[0..known] are worked out
+
+	  uint16_t offset(uint col_num) const;
+};
+
 /**
  * @class HeapFile - heap file implementation of DbFile
  *
@@ -75,7 +143,7 @@ protected:
 class HeapFile : public DbFile {
 public:
 	  HeapFile(std::string name);
-	  virtual ~HeapFile() {}
+	  virtual ~HeapFile();
 	  HeapFile(const HeapFile& other) = delete;
 	  HeapFile(HeapFile&& temp) = delete;
 	  HeapFile& operator=(const HeapFile& other) = delete;
@@ -88,8 +156,14 @@ public:
 	  virtual SlottedPage* get_new(void);
 	  virtual SlottedPage* get(BlockID block_id);
 	  virtual void put(DbBlock* block);
+	  virtual void unpin(DbBlock* block);
 	  virtual BlockIDs* block_ids() const;
 
+	  /**
+	   * Write any of this file's blocks that were put but are still only in memory.
+	   */
+	  virtual void flush();
+
 	  /**
 	   * Get the id of the current final block in the heap file.
 	   * @returns  block id of last block
@@ -97,16 +171,149 @@ public:
 	  virtual uint32_t get_last_block_id() {return last;}
 
 protected:
+	  friend class BufferPool;
 	  std::string dbfilename;
 	  uint32_t last;
 	  bool closed;
-	  Db db;
+	  Db *db;  // a new handle each open, since Berkeley DB can't reopen a closed one
 	  virtual void db_open(uint flags=0);
 	  virtual uint32_t get_block_count();
+	  virtual void read_block(BlockID block_id, char *data);
+	  virtual void write_block(BlockID block_id, char *data);
+};
+
+/**
+ * @class BufferPool - in-memory frames caching the blocks of all the HeapFiles
+ *
+ * HeapFile::get hands out the SlottedPage living in a frame and pins it there until
+ * HeapFile::unpin; a block already in a frame is handed out again without going back
+ * to Berkeley DB. HeapFile::put just marks the frame dirty; dirty frames are written
+ * back when they are evicted (clock replacement over unpinned frames), when their file
+ * is flushed or closed, or when the whole pool is flushed at the end of each statement.
+ * If every frame is pinned, the pool grows by a frame rather than fail. Each of these
+ * operations holds the pool's latch, so several threads may scan files at once, but a
+ * block is read (and the block it evicts written back) with the latch let go: the frame
+ * is marked loading meanwhile and other pins of either block wait for it. Frames are
+ * kept by HeapFile, so a file should only have one HeapFile open on it at a time.
+ * The pool also keeps the worker threads that parallel scans of its files run on.
+ */
+class BufferPool {
+public:
+	  static const uint DEFAULT_FRAMES = 256;
+
+	  /**
+	   * The pool used by every HeapFile.
+	   */
+	  static BufferPool& shared();
+
+	  BufferPool(uint num_frames=DEFAULT_FRAMES);
+	  virtual ~BufferPool();
+	  BufferPool(const BufferPool& other) = delete;
+	  BufferPool& operator=(const BufferPool& other) = delete;
+
+	  virtual SlottedPage* pin(HeapFile *file, BlockID block_id, bool is_new=false);
+	  virtual void unpin(DbBlock *block);
+	  virtual void mark_dirty(HeapFile *file, DbBlock *block);
+	  virtual void flush();
+	  virtual void flush(HeapFile *file);
+	  virtual void discard(HeapFile *file);
+
+	  /**
+	   * Standing threads for scanning files in parallel, one per core.
+	   */
+	  WorkerPool& get_workers() {return workers;}
+
+	  // statistics for sizing the pool
+	  u_long get_hits() const {return hits;}
+	  u_long get_misses() const {return misses;}
+	  u_long get_evictions() const {return evictions;}
+	  uint get_size() const {return (uint)frames.size();}
+	  void reset_stats() {hits = misses = evictions = 0;}
+
+protected:
+	  struct Frame {
+	      HeapFile *file;  // nullptr if the frame is free
+	      BlockID block_id;
+	      SlottedPage *page;
+	      char *data;
+	      uint pins;
+	      bool dirty;
+	      bool referenced;
+	      bool loading;  // being read in by a pin that let go of the latch
+	  };
+	  std::vector<Frame> frames;
+	  std::map<std::pair<HeapFile*, BlockID>, uint> block_frames;
+	  std::map<const DbBlock*, uint> page_frames;
+	  std::set<std::pair<HeapFile*, BlockID>> writing;  // evicted dirty blocks on their way out
+	  uint clock_hand;
+	  u_long hits;
+	  u_long misses;
+	  u_long evictions;
+	  std::mutex latch;
+	  std::condition_variable loaded;  // a frame finished loading or an eviction was written
+	  WorkerPool workers;
+
+	  virtual uint victim();
+	  virtual void write_back(Frame &frame);
+	  virtual void wait_for_writes(std::unique_lock<std::mutex> &lock, HeapFile *file);
+	  virtual void release(uint frame_id);
+};
+
+/**
+ * @class FreeSpaceMap - how many bytes each block of a HeapTable has free, so that inserts
+ * can go into blocks that rows were deleted from instead of always into the last block
+ *
+ * The map is kept in a HeapFile of its own, named for the table's file plus ".fsm", as one
+ * 2-byte record per block of the table, and is read into memory when the table is opened.
+ * A table made before it had a map gets one built from its blocks when it is first opened.
+ * The map is just a hint: a block it picks for an insert still gets checked for room.
+ */
+class FreeSpaceMap {
+public:
+	  static const uint ENTRIES_PER_BLOCK = 680;  // (2-byte record + 4-byte header) each
+	  static const uint16_t ROOMY = DbBlock::BLOCK_SZ / 8;  // free bytes worth inserting into
+
+	  FreeSpaceMap(std::string name);
+	  virtual ~FreeSpaceMap() {}
+	  FreeSpaceMap(const FreeSpaceMap& other) = delete;
+	  FreeSpaceMap& operator=(const FreeSpaceMap& other) = delete;
+
+	  // build the map for (a new or existing) heap file
+	  virtual void create(HeapFile &heap);
+	  virtual void drop();
+	  // read in the map for heap (building it if heap doesn't have one yet)
+	  virtual void open(HeapFile &heap);
+	  virtual void close();
+
+	  /**
+	   * Pick a block to insert into.
+	   * @param size  bytes needed
+	   * @returns     the lowest-numbered block with at least ROOMY (and size) bytes free,
+	   *              or 0 if none has
+	   */
+	  virtual BlockID find(uint16_t size) const;
+
+	  // record how many bytes the block now has free
+	  virtual void update(BlockID block_id, uint16_t bytes);
+
+protected:
+	  HeapFile file;
+	  bool closed;
+	  std::vector<uint16_t> free;  // indexed by block id
+	  std::set<BlockID> roomy;     // blocks with at least ROOMY bytes free
+
+	  virtual void add_entries(SlottedPage *page);
+	  virtual void remember(BlockID block_id, uint16_t bytes);
 };
 
 /**
  * @class HeapTable - Heap storage engine (implementation of DbRelation)
+ *
+ * update() rewrites a row in place when its new record fits in the row's block. When it
+ * doesn't, the record goes into another block (flagged SlottedPage::MOVED, so scans skip
+ * it) and the row's own record becomes a forwarding stub (flagged SlottedPage::FORWARD)
+ * holding the new block id and record id, so the row's handle, and every index entry for
+ * it, stay the same.
  */
 class HeapTable : public DbRelation {
 public:
@@ -118,30 +325,133 @@ public:
 	  HeapTable& operator=(const HeapTable& other) = delete;
 	  HeapTable& operator=(HeapTable&& temp) = delete;
 
+	  static const uint DEFAULT_PARALLELISM = 1;
+	  static const uint MIN_PARTITION_BLOCKS = 4;  // fewest blocks worth giving a worker of its own
+	  static const uint16_t FORWARD_SIZE = sizeof(BlockID) + sizeof(RecordID);  // a forwarding stub
+
+	  /**
+	   * Set how many threads a full scan (select with a where clause, or batch_cursors)
+	   * may split the table's blocks across, as long as each gets MIN_PARTITION_BLOCKS
+	   * blocks. 1 scans on the calling thread.
+	   * @param workers  number of threads, at least 1
+	   */
+	  virtual void set_parallelism(uint workers);
+	  virtual uint get_parallelism() const {return parallelism;}
+
     virtual void create();
 	  virtual void create_if_not_exists();
  	  virtual void drop();
 	  virtual void open();
 	  virtual void close();
 	  virtual Handle insert(const ValueDict* row);
+	  virtual Handles* insert_many(const ValueDicts* rows);
 	  virtual void update(const Handle handle, const ValueDict* new_values);
 	  virtual void del(const Handle handle);
 	  virtual Handles* select();
 	  virtual Handles* select(const ValueDict* where);
 		virtual Handles* select(Handles *current_selection, const ValueDict* where);
+	  virtual DbCursor* select_cursor();
+	  virtual DbCursor* select_cursor(const ValueDict* where);
+	  virtual DbCursor* select_cursor(DbCursor* current_selection, const ValueDict* where);
+	  virtual DbBatchCursor* batch_cursor(const ColumnNames* column_names);
+	  virtual std::vector<DbBatchCursor*> batch_cursors(const ColumnNames* column_names);
 	  virtual ValueDict* project(Handle handle);
 	  virtual ValueDict* project(Handle handle, const ColumnNames* column_names);
+	  virtual ValueDicts* project(Handles *handles, const ColumnNames* column_names);
+	  virtual Tuples* project_tuples(Handles *handles, const ColumnNames* column_names);
 
     using DbRelation::project;
 
 protected:
+    friend class HeapTableCursor;
+    friend class HeapTableBatchCursor;
 	  HeapFile file;
+	  FreeSpaceMap free_space;
+	  uint parallelism;
 
     virtual ValueDict* validate(const ValueDict* row) const;
 	  virtual Handle append(const ValueDict* row);
+	  virtual Handles* append(const ValueDicts* rows);
+	  virtual SlottedPage* block_with_room(uint16_t size);
 	  virtual Dbt* marshal(const ValueDict* row) const;
 	  virtual ValueDict* unmarshal(Dbt* data) const;
-	  virtual bool selected(Handle handle, const ValueDict* where);
+	  virtual ValueDict* unmarshal(const RowView &view, const ColumnNames* column_names) const;
+	  virtual ColumnPredicates* resolve(const ValueDict* where) const;
+	  virtual bool selected(SlottedPage* block, RecordID record_id, const ColumnPredicates* predicates,
+	                        RowView &view);
+	  virtual const char* row_bytes(SlottedPage* block, RecordID record_id, SlottedPage* &moved_block);
+	  virtual void read_rows(Handles* handles, const std::function<void(size_t, const RowView&)> &read);
+	  virtual RecordIDs* row_ids(SlottedPage* block) const;
+	  virtual void rewrite(Handle handle, const Dbt &data);
+	  virtual bool put_record(SlottedPage* block, RecordID record_id, const Dbt &data, uint16_t flags);
+	  virtual bool put_record(Handle handle, const Dbt &data, uint16_t flags);
+	  virtual void remove(Handle moved);
+	  virtual Handle forwarding_address(const char* bytes) const;
+	  virtual std::vector<std::pair<BlockID, BlockID>> partitions();
+	  virtual std::vector<uint> column_nums(const ColumnNames* column_names) const;
 };
+/**
+ * @class HeapTableCursor - HeapTable's DbCursor
+ *
+ * Walks the table one block at a time (or, if given a current selection, the blocks of
+ * those rows), checking the where clause against the records in each fetched block.
+ * A cursor may be limited to the blocks first_block_id..last_block_id of the table.
+ */
+class HeapTableCursor : public DbCursor {
+public:
+	  // takes ownership of predicates and current_selection (either may be nullptr)
+	  HeapTableCursor(HeapTable &table, ColumnPredicates *predicates, DbCursor *current_selection=nullptr);
+	  HeapTableCursor(HeapTable &table, ColumnPredicates *predicates, BlockID first_block_id,
+	                  BlockID last_block_id);
+	  virtual ~HeapTableCursor();
+	  HeapTableCursor(const HeapTableCursor& other) = delete;
+	  HeapTableCursor& operator=(const HeapTableCursor& other) = delete;
+
+	  virtual bool next(Handle &handle);
+
+protected:
+	  HeapTable &table;
+	  ColumnPredicates *predicates;
+	  DbCursor *current_selection;
+	  BlockID block_id;
+	  BlockID last_block_id;
+	  SlottedPage *block;
+	  RecordIDs *record_ids;
+	  size_t position;
+	  RowView view;
+
+	  virtual void fetch(BlockID block_id);
+};
+
+/**
+ * @class HeapTableBatchCursor - HeapTable's DbBatchCursor
+ *
+ * Walks the table a block at a time like HeapTableCursor, decoding the wanted fields of
+ * each record straight from the page into the batch's column arrays. Like it, a batch
+ * cursor may be limited to a range of blocks.
+ */
+class HeapTableBatchCursor : public DbBatchCursor {
+public:
+	  // column_nums: table positions of the batch's columns, in batch order
+	  HeapTableBatchCursor(HeapTable &table, const std::vector<uint> &column_nums);
+	  HeapTableBatchCursor(HeapTable &table, const std::vector<uint> &column_nums, BlockID first_block_id,
+	                       BlockID last_block_id);
+	  virtual ~HeapTableBatchCursor();
+	  HeapTableBatchCursor(const HeapTableBatchCursor& other) = delete;
+	  HeapTableBatchCursor& operator=(const HeapTableBatchCursor& other) = delete;
+
+	  virtual bool next(ColumnBatch &batch);
+
+protected:
+	  HeapTable &table;
+	  std::vector<uint> column_nums;
+	  BlockID block_id;
+	  BlockID last_block_id;
+	  SlottedPage *block;
+	  RecordIDs *record_ids;
+	  size_t position;
+	  RowView view;
+};
+
 // test
 bool test_heap_storage();
@@ -8,6 +8,9 @@
 #include "schema_tables.h"
 #include "ParseTreeToString.h"
 #include "btree.h"
+#include "hash_index.h"
+#include <algorithm>
+#include <thread>
 
 
 void initialize_schema_tables() {
@@ -26,12 +29,8 @@ void initialize_schema_tables() {
 bool is_acceptable_identifier(Identifier identifier) {
     if (ParseTreeToString::is_reserved_word(identifier))
         return true;
-    try {
-        std::stoi(identifier);
-        return false;
-    } catch (std::exception& e) {
-        // can't be converted to an integer, so good
-    }
+    if (!identifier.empty() && isdigit((unsigned char)identifier[0]))
+        return false;  // would read as a number
     for (auto const& c: identifier)
         if (!isalnum(c) && c != '$' && c != '_')
             return false;
@@ -51,6 +50,9 @@ bool is_acceptable_data_type(std::string dt) {
 const Identifier Tables::TABLE_NAME = "_tables";
 Columns* Tables::columns_table = nullptr;
 std::map<Identifier,DbRelation*> Tables::table_cache;
+std::set<Identifier> Tables::table_names;
+bool Tables::table_names_loaded = false;
+uint Tables::scan_parallelism = std::max(1u, std::thread::hardware_concurrency());
 
 // get the column name for _tables column
 ColumnNames& Tables::COLUMN_NAMES() {
@@ -90,15 +92,24 @@ void Tables::create() {
 	  insert(&row);
 }
 
-// Manually check that table_name is unique.
+// Manually check that table_name is unique, against the names read in by the first insert.
 Handle Tables::insert(const ValueDict* row) {
-    // Try SELECT * FROM _tables WHERE table_name = row["table_name"] and it should return nothing
-    Handles* handles = select(row);
-    bool unique = handles->empty();
-    delete handles;
-    if (!unique)
-        throw DbRelationError(row->at("table_name").s + " already exists");
-    return HeapTable::insert(row);
+    if (!Tables::table_names_loaded) {
+        Handles* handles = select();
+        for (auto const& handle: *handles) {
+            ValueDict* name_row = project(handle);
+            Tables::table_names.insert(name_row->at("table_name").s);
+            delete name_row;
+        }
+        delete handles;
+        Tables::table_names_loaded = true;
+    }
+    Identifier table_name = row->at("table_name").s;
+    if (Tables::table_names.find(table_name) != Tables::table_names.end())
+        throw DbRelationError(table_name + " already exists");
+    Handle handle = HeapTable::insert(row);
+    Tables::table_names.insert(table_name);
+    return handle;
 }
 
 // Remove a row, but first remove from table cache if there
@@ -107,6 +118,7 @@ void Tables::del(Handle handle) {
     // remove from cache, if there
     ValueDict* row = project(handle);
     Identifier table_name = row->at("table_name").s;
+    Tables::table_names.erase(table_name);
     if (Tables::table_cache.find(table_name) != Tables::table_cache.end()) {
         DbRelation* table = Tables::table_cache.at(table_name);
         Tables::table_cache.erase(table_name);
@@ -117,33 +129,7 @@ void Tables::del(Handle handle) {
 
 // Return a list of column names and column attributes for given table.
 void Tables::get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes) {
-    // SELECT * FROM _columns WHERE table_name = <table_name>
-    ValueDict where;
-    where["table_name"] = table_name;
-    Handles* handles = Tables::columns_table->select(&where);
-
-    ColumnAttribute column_attribute;
-    for (auto const& handle: *handles) {
-        ValueDict* row = Tables::columns_table->project(handle);  // get the row's values: {'column_name': <name>, 'data_type': <type>}
-
-        Identifier column_name = (*row)["column_name"].s;
-        column_names.push_back(column_name);
-
-        ColumnAttribute::DataType data_type;
-        if ((*row)["data_type"].s == "INT")
-            data_type = ColumnAttribute::INT;
-        else if ((*row)["data_type"].s == "TEXT")
-            data_type = ColumnAttribute::TEXT;
-        else if ((*row)["data_type"].s == "BOOLEAN")
-            data_type = ColumnAttribute::BOOLEAN;
-        else
-            throw DbRelationError("Unknown data type");
-        column_attribute.set_data_type(data_type);
-        column_attributes.push_back(column_attribute);
-
-        delete row;
-    }
-    delete handles;
+    Tables::columns_table->get_columns(table_name, column_names, column_attributes);
 }
 
 // Return a table for given table_name.
@@ -152,15 +138,35 @@ DbRelation& Tables::get_table(Identifier table_name) {
     if (Tables::table_cache.find(table_name) != Tables::table_cache.end())
         return  *Tables::table_cache[table_name];
 
-    // otherwise assume it is a HeapTable (for now)
+    // otherwise assume it is a HeapTable (for now); one with no columns isn't in the catalog,
+    // so don't cache it
     ColumnNames column_names;
     ColumnAttributes column_attributes;
     get_columns(table_name, column_names, column_attributes);
-    DbRelation* table = new HeapTable(table_name, column_names, column_attributes);
+    if (column_names.empty())
+        throw DbRelationError("unknown table " + table_name);
+    HeapTable* table = new HeapTable(table_name, column_names, column_attributes);
+    table->set_parallelism(Tables::scan_parallelism);
     Tables::table_cache[table_name] = table;
     return *table;
 }
 
+// Use workers threads for the scans of user tables, including the ones already handed out.
+// The schema tables are small enough that they keep scanning on the calling thread.
+void Tables::set_scan_parallelism(uint workers) {
+    if (workers == 0)
+        throw DbRelationError("parallelism must be at least 1");
+    Tables::scan_parallelism = workers;
+    for (auto const& cached: Tables::table_cache) {
+        if (cached.first == Tables::TABLE_NAME || cached.first == Columns::TABLE_NAME
+            || cached.first == Indices::TABLE_NAME)
+            continue;
+        HeapTable* table = dynamic_cast<HeapTable*>(cached.second);
+        if (table != nullptr)
+            table->set_parallelism(workers);
+    }
+}
+
 
 /*
  * ****************************
@@ -168,6 +174,7 @@ DbRelation& Tables::get_table(Identifier table_name) {
  * ****************************
  */
 const Identifier Columns::TABLE_NAME = "_columns";
+std::map<Identifier,std::pair<ColumnNames,ColumnAttributes>> Columns::column_cache;
 
 // get the column name for _columns column
 ColumnNames& Columns::COLUMN_NAMES() {
@@ -251,7 +258,56 @@ Handle Columns::insert(const ValueDict* row) {
     if (!unique)
         throw DbRelationError("duplicate column " + row->at("table_name").s + "." + row->at("column_name").s);
 
-    return HeapTable::insert(row);
+    Handle handle = HeapTable::insert(row);
+    Columns::column_cache.erase(row->at("table_name").s);
+    return handle;
+}
+
+// Remove a row, forgetting its table's cached columns
+void Columns::del(Handle handle) {
+    ValueDict* row = project(handle);
+    Columns::column_cache.erase(row->at("table_name").s);
+    delete row;
+    HeapTable::del(handle);
+}
+
+// Return a list of column names and column attributes for given table, reading them from
+// _columns only if they aren't cached.
+void Columns::get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes) {
+    auto cached = Columns::column_cache.find(table_name);
+    if (cached == Columns::column_cache.end()) {
+        // SELECT * FROM _columns WHERE table_name = <table_name>
+        ValueDict where;
+        where["table_name"] = table_name;
+        Handles* handles = select(&where);
+
+        std::pair<ColumnNames,ColumnAttributes> columns;
+        ColumnAttribute column_attribute;
+        for (auto const& handle: *handles) {
+            ValueDict* row = project(handle);  // get the row's values: {'column_name': <name>, 'data_type': <type>}
+
+            Identifier column_name = (*row)["column_name"].s;
+            columns.first.push_back(column_name);
+
+            ColumnAttribute::DataType data_type;
+            if ((*row)["data_type"].s == "INT")
+                data_type = ColumnAttribute::INT;
+            else if ((*row)["data_type"].s == "TEXT")
+                data_type = ColumnAttribute::TEXT;
+            else if ((*row)["data_type"].s == "BOOLEAN")
+                data_type = ColumnAttribute::BOOLEAN;
+            else
+                throw DbRelationError("Unknown data type");
+            column_attribute.set_data_type(data_type);
+            columns.second.push_back(column_attribute);
+
+            delete row;
+        }
+        delete handles;
+        cached = Columns::column_cache.insert(std::make_pair(table_name, columns)).first;
+    }
+    column_names.insert(column_names.end(), cached->second.first.begin(), cached->second.first.end());
+    column_attributes.insert(column_attributes.end(), cached->second.second.begin(), cached->second.second.end());
 }
 
 
@@ -262,6 +318,7 @@ Handle Columns::insert(const ValueDict* row) {
  */
 const Identifier Indices::TABLE_NAME = "_indices";
 std::map<std::pair<Identifier,Identifier>,DbIndex*> Indices::index_cache;
+std::map<Identifier,IndexInfos> Indices::index_info_cache;
 
 // get the column name for _indices column
 ColumnNames& Indices::COLUMN_NAMES() {
@@ -295,8 +352,16 @@ ColumnAttributes& Indices::COLUMN_ATTRIBUTES() {
     return cas;
 }
 
-// ctor - we have a fixed table structure
+// ctor - we have a fixed table structure. Like _tables and _columns, we are what get_table
+// hands out for _indices, so there is just one HeapFile (and one set of buffered blocks) for it.
 Indices::Indices() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
+    Tables::table_cache[TABLE_NAME] = this;
+}
+
+Indices::~Indices() {
+    auto cached = Tables::table_cache.find(TABLE_NAME);
+    if (cached != Tables::table_cache.end() && cached->second == this)
+        Tables::table_cache.erase(cached);
 }
 
 // Manually check constraints -- unique on (table, index, column)
@@ -318,7 +383,9 @@ Handle Indices::insert(const ValueDict* row) {
     delete handles;
     if (!unique)
         throw DbRelationError("duplicate index " + row->at("table_name").s + " " + row->at("index_name").s);
-    return HeapTable::insert(row);
+    Handle handle = HeapTable::insert(row);
+    Indices::index_info_cache.erase(row->at("table_name").s);
+    return handle;
 }
 
 // Remove a row, but first remove from index cache if there
@@ -334,50 +401,54 @@ void Indices::del(Handle handle) {
         Indices::index_cache.erase(cache_key);
         delete index;
     }
+    Indices::index_info_cache.erase(table_name);
     HeapTable::del(handle);
 }
 
-// Return a list of column names and column attributes for given table.
-void Indices::get_columns(Identifier table_name, Identifier index_name,
-                          ColumnNames &column_names, bool &is_hash, bool &is_unique) {
-    // SELECT * FROM _indices WHERE table_name = <table_name> AND index_name = <index_name>
+// What _indices says about each index on the table, read in only if it isn't cached.
+const IndexInfos& Indices::get_index_infos(Identifier table_name) {
+    auto cached = Indices::index_info_cache.find(table_name);
+    if (cached != Indices::index_info_cache.end())
+        return cached->second;
+
+    // SELECT * FROM _indices WHERE table_name = <table_name>
     ValueDict where;
-    where["table_name"] = table_name;
-    where["index_name"] = index_name;
+    where["table_name"] = Value(table_name);
     Handles* handles = select(&where);
-
-    Identifier colnames[DbIndex::MAX_COMPOSITE];
-    uint size = 0;
+    IndexInfos &infos = Indices::index_info_cache[table_name];
     for (auto const& handle: *handles) {
         ValueDict *row = project(handle);
-
-        Identifier column_name = (*row)["column_name"].s;
-        uint which = (uint) (*row)["seq_in_index"].n;
-        colnames[which - 1] = column_name;  // seq_in_index is 1-based
-        if (which > size)
-            size = which;
-        is_unique = (*row)["is_unique"].n != 0;
-        is_hash = (*row)["index_type"].s == "HASH";
+        Identifier index_name = (*row)["index_name"].s;
+        auto info = infos.begin();
+        while (info != infos.end() && info->index_name != index_name)
+            info++;
+        if (info == infos.end())
+            info = infos.insert(infos.end(), IndexInfo{index_name, ColumnNames(), false, false});
+
+        uint which = (uint) (*row)["seq_in_index"].n;  // seq_in_index is 1-based
+        if (info->column_names.size() < which)
+            info->column_names.resize(which);
+        info->column_names[which - 1] = (*row)["column_name"].s;
+        info->is_unique = (*row)["is_unique"].n != 0;
+        info->is_hash = (*row)["index_type"].s == "HASH";
         delete row;
     }
-    for (uint i = 0; i < size; i++)
-        column_names.push_back(colnames[i]);
     delete handles;
+    return infos;
 }
 
-// FIXME - use this for now until we have BTreeIndex and HashIndex
-class DummyIndex : public DbIndex {
-public:
-    DummyIndex(DbRelation& rel, Identifier idx, ColumnNames key, bool unq) : DbIndex(rel, idx, key, unq) {}
-    void create() {}
-    void drop() {}
-    void open() {}
-    void close() {}
-    Handles* lookup(ValueDict* key_values) const {return nullptr;}
-    void insert(Handle handle) {}
-    void del(Handle handle) {}
-};
-
+// Return a list of column names and column attributes for given table.
+void Indices::get_columns(Identifier table_name, Identifier index_name,
+                          ColumnNames &column_names, bool &is_hash, bool &is_unique) {
+    for (auto const& info: get_index_infos(table_name)) {
+        if (info.index_name == index_name) {
+            column_names.insert(column_names.end(), info.column_names.begin(), info.column_names.end());
+            is_hash = info.is_hash;
+            is_unique = info.is_unique;
+            return;
+        }
+    }
+}
 
 // Return a table for given table_name.
 DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
@@ -386,16 +457,16 @@ DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
     if (Indices::index_cache.find(cache_key) != Indices::index_cache.end())
         return  *Indices::index_cache[cache_key];
 
-    // otherwise assume it is a DummyIndex (for now)
+    // otherwise construct a HashIndex or BTreeIndex as the catalog says
     ColumnNames column_names;
     bool is_hash, is_unique;
     get_columns(table_name, index_name, column_names, is_hash, is_unique);
     DbRelation& table = Tables::get_table(table_name);
     DbIndex* index;
     if (is_hash) {
-        index = new DummyIndex(table, index_name, column_names, is_unique);  // FIXME - change to HashIndex
+        index = new HashIndex(table, index_name, column_names, is_unique);
     } else {
-        index = new BTreeIndex(table, index_name, column_names, is_unique);  // FIXME - change to BTreeIndex
+        index = new BTreeIndex(table, index_name, column_names, is_unique);
     }
     Indices::index_cache[cache_key] = index;
     return *index;
@@ -403,15 +474,7 @@ DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
 
 IndexNames Indices::get_index_names(Identifier table_name) {
     IndexNames ret;
-    ValueDict where;
-    where["table_name"] = Value(table_name);
-    where["seq_in_index"] = Value(1);  // only get the row for the first column if composite index
-    Handles* handles = select(&where);
-    for (auto const& handle: *handles) {
-        ValueDict* row = project(handle);
-        ret.push_back((*row)["index_name"].s);
-        delete row;
-    }
-    delete handles;
+    for (auto const& info: get_index_infos(table_name))
+        ret.push_back(info.index_name);
     return ret;
 }
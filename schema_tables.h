@@ -24,7 +24,9 @@ class Columns; // forward declare
 /**
  * @class Tables - The singleton table that stores the metadata for all other tables.
  * For now, we are not indexing anything, so a query requires sequential scan
- * of the table.
+ * of the table. The schema tables each keep what they are asked for in memory
+ * once they have scanned for it, and forget it when their own insert or del
+ * changes it (which only DDL does), so DML never reads their files.
  */
 class Tables : public HeapTable {
 public:
@@ -59,6 +61,14 @@ public:
 	   */
     static DbRelation& get_table(Identifier table_name);
 
+	  /**
+	   * Set how many threads the full scans of the tables from get_table are split across
+	   * (see HeapTable::set_parallelism). Starts out as the number of cores.
+	   * @param workers  number of threads, at least 1
+	   */
+    static void set_scan_parallelism(uint workers);
+    static uint get_scan_parallelism() {return scan_parallelism;}
+
 protected:
 	  // hard-coded columns for _tables table
     static ColumnNames& COLUMN_NAMES();
@@ -68,8 +78,16 @@ protected:
     static Columns* columns_table;
 
 private:
+    friend class Indices;  // registers itself in table_cache
+
 	  // keep a cache of all the tables we've instantiated so far
     static std::map<Identifier,DbRelation*> table_cache;
+
+	  // names of all the tables, read in on the first insert
+    static std::set<Identifier> table_names;
+    static bool table_names_loaded;
+
+    static uint scan_parallelism;
 };
 
 
@@ -90,15 +108,34 @@ public:
 	  // HeapTable overrides
     virtual void create();
     virtual Handle insert(const ValueDict* row);
+    virtual void del(Handle handle);
+
+	  /**
+	   * Get the columns and their attributes for a given table (see Tables::get_columns).
+	   */
+    void get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes);
 
 protected:
 	  // hard-coded columns for the _columns table
     static ColumnNames& COLUMN_NAMES();
     static ColumnAttributes& COLUMN_ATTRIBUTES();
+
+private:
+	  // each table's columns once they have been read
+    static std::map<Identifier,std::pair<ColumnNames,ColumnAttributes>> column_cache;
 };
 
 typedef ColumnNames IndexNames;
 
+// what _indices says about an index
+struct IndexInfo {
+    Identifier index_name;
+    ColumnNames column_names;
+    bool is_hash;
+    bool is_unique;
+};
+typedef std::vector<IndexInfo> IndexInfos;
+
 class Indices : public HeapTable {
 public:
 	  /**
@@ -108,7 +145,7 @@ public:
 
 	  // ctor/dtor
 	  Indices();
-	  virtual ~Indices() {}
+	  virtual ~Indices();
 
 	  /**
 	   * Get the search key for the given index.
@@ -146,6 +183,11 @@ protected:
 	  static ColumnNames& COLUMN_NAMES();
 	  static ColumnAttributes& COLUMN_ATTRIBUTES();
 
+	  const IndexInfos& get_index_infos(Identifier table_name);
+
 private:
 	  static std::map<std::pair<Identifier,Identifier>,DbIndex*> index_cache;
+
+	  // each table's indices once they have been read
+	  static std::map<Identifier,IndexInfos> index_info_cache;
 };
@@ -18,6 +18,8 @@
 #include "ParseTreeToString.h"
 #include "SQLExec.h"
 #include "btree.h"
+#include "hash_index.h"
+#include "column_filters.h"
 
 using namespace std;
 using namespace hsql;
@@ -59,6 +61,12 @@ public:
                      << (test_heap_storage() ? "ok" : "failed") << endl;
                 cout << "test btree: "
                      << (test_btree() ? "ok" : "failed") << endl;
+                cout << "test hash index: "
+                     << (test_hash_index() ? "ok" : "failed") << endl;
+                cout << "test sql exec: "
+                     << (test_sql_exec() ? "ok" : "failed") << endl;
+                cout << "test column filters (" << int_eq_kernel_name() << " kernel): "
+                     << (test_column_filters() ? "ok" : "failed") << endl;
                 continue;
             }
 
@@ -90,25 +98,34 @@ public:
 
 // main functino of the SQL database management program  project
 int main(int argc, char *argv[]) {
-    // check for command line input
+    // check for command line input: the database directory, then optionally how many
+    // threads to scan each table with (the number of cores if left out)
     if (argc <= 1) {
         fprintf(stderr, "This program requires command line parameters\n");
         return 1;
     }
+    if (argc > 2) {
+        int workers = atoi(argv[2]);
+        if (workers <= 0) {
+            fprintf(stderr, "The number of scan threads must be at least 1\n");
+            return 1;
+        }
+        Tables::set_scan_parallelism((uint)workers);
+    }
 
     // store command line argument as the path to the directory
     char* pathToDir = argv[1];
 
     // display directory path
     cout << "(sql5300: running with database environment at " << pathToDir
-         << ")" << std::endl;
+         << ", scanning with " << Tables::get_scan_parallelism() << " threads)" << std::endl;
 
     //  open database environment
     DbEnv *myEnv = new DbEnv(0u);
     myEnv->set_message_stream(&cout);
     myEnv->set_error_stream(&cerr);
     try {
-        myEnv->open(pathToDir, DB_CREATE | DB_INIT_MPOOL, 0);
+        myEnv->open(pathToDir, DB_CREATE | DB_INIT_MPOOL | DB_THREAD, 0);
     } catch (DbException &e) {
         cerr << "(sql5300: " << e.what() << ")" << endl;
         exit(1);
@@ -5,7 +5,51 @@
  */
 
 #include <algorithm>
+#include <thread>
 #include "storage_engine.h"
+#include "ColumnBatch.h"
+
+void Tuple::push_int(int32_t n) {
+    Field field = {ColumnAttribute::INT, 0, n};
+    this->fields.push_back(field);
+}
+
+void Tuple::push_boolean(bool b) {
+    Field field = {ColumnAttribute::BOOLEAN, 0, b ? 1 : 0};
+    this->fields.push_back(field);
+}
+
+void Tuple::push_text(const char *text, uint16_t size) {
+    Field field = {ColumnAttribute::TEXT, size, (int32_t)this->chars.size()};
+    this->chars.append(text, size);
+    this->fields.push_back(field);
+}
+
+void Tuple::push_value(const Value &value) {
+    if (value.data_type == ColumnAttribute::TEXT)
+        push_text(value.s.data(), (uint16_t)value.s.size());
+    else if (value.data_type == ColumnAttribute::BOOLEAN)
+        push_boolean(value.n != 0);
+    else
+        push_int(value.n);
+}
+
+const char *Tuple::get_text(uint ordinal, uint16_t &size) const {
+    const Field &field = this->fields[ordinal];
+    size = field.size;
+    return this->chars.data() + field.n;
+}
+
+Value Tuple::get_value(uint ordinal) const {
+    const Field &field = this->fields[ordinal];
+    Value value;
+    value.data_type = (ColumnAttribute::DataType)field.data_type;
+    if (value.data_type == ColumnAttribute::TEXT)
+        value.s.assign(this->chars.data() + field.n, field.size);
+    else
+        value.n = field.n;
+    return value;
+}
 
 bool Value::operator==(const Value &other) const {
     if (this->data_type != other.data_type)
@@ -52,6 +96,92 @@ ColumnAttributes* DbRelation::get_column_attributes(const ColumnNames &select_co
     return ret;
 }
 
+// Filters the rows of another cursor by projecting each one and comparing it to the where clause.
+class DbRelationFilterCursor : public DbCursor {
+public:
+    DbRelationFilterCursor(DbRelation &relation, DbCursor *current_selection, const ValueDict *where)
+            : relation(relation), current_selection(current_selection), where(where) {}
+    virtual ~DbRelationFilterCursor() { delete current_selection; }
+
+    virtual bool next(Handle &handle) {
+        while (current_selection->next(handle)) {
+            if (where == nullptr)
+                return true;
+            ValueDict *row = relation.project(handle, where);
+            bool selected = *row == *where;
+            delete row;
+            if (selected)
+                return true;
+        }
+        return false;
+    }
+
+protected:
+    DbRelation &relation;
+    DbCursor *current_selection;
+    const ValueDict *where;
+};
+
+// Default inserts the rows one at a time.
+Handles* DbRelation::insert_many(const ValueDicts* rows) {
+    Handles *handles = new Handles();
+    for (auto const row : *rows)
+        handles->push_back(insert(row));
+    return handles;
+}
+
+// Default cursor just materializes the selection.
+DbCursor* DbRelation::select_cursor() {
+    return new HandlesCursor(select());
+}
+
+// Default cursor just materializes the selection.
+DbCursor* DbRelation::select_cursor(const ValueDict* where) {
+    return new HandlesCursor(select(where));
+}
+
+// Default refinement checks each row from current_selection with project().
+DbCursor* DbRelation::select_cursor(DbCursor* current_selection, const ValueDict* where) {
+    return new DbRelationFilterCursor(*this, current_selection, where);
+}
+
+// Fills batches by projecting each row of select_cursor().
+class DbRelationBatchCursor : public DbBatchCursor {
+public:
+    DbRelationBatchCursor(DbRelation &relation, const ColumnNames *column_names)
+            : relation(relation), rows(relation.select_cursor()), column_names(*column_names) {}
+    virtual ~DbRelationBatchCursor() { delete rows; }
+
+    virtual bool next(ColumnBatch &batch) {
+        batch.clear();
+        Handle handle;
+        while (!batch.full() && rows->next(handle)) {
+            ValueDict *row = relation.project(handle, &column_names);
+            batch.add_row(handle);
+            for (uint col_num = 0; col_num < column_names.size(); col_num++)
+                batch.push_value(col_num, (*row)[column_names[col_num]]);
+            delete row;
+        }
+        batch.select_all();
+        return batch.size() > 0;
+    }
+
+protected:
+    DbRelation &relation;
+    DbCursor *rows;
+    ColumnNames column_names;
+};
+
+// Default batches are built a row at a time from project().
+DbBatchCursor* DbRelation::batch_cursor(const ColumnNames* column_names) {
+    return new DbRelationBatchCursor(*this, column_names);
+}
+
+// Default is a single part.
+std::vector<DbBatchCursor*> DbRelation::batch_cursors(const ColumnNames* column_names) {
+    return std::vector<DbBatchCursor*>(1, batch_cursor(column_names));
+}
+
 // Just pulls out the column names from a ValueDict and passes that to the usual form of project().
 ValueDict* DbRelation::project(Handle handle, const ValueDict* where) {
     ColumnNames t;
@@ -60,12 +190,9 @@ ValueDict* DbRelation::project(Handle handle, const ValueDict* where) {
     return this->project(handle, &t);
 }
 
-// Do a projection for each of a list of handles
+// Do a projection of all the columns for each of a list of handles
 ValueDicts* DbRelation::project(Handles *handles) {
-    ValueDicts *ret = new ValueDicts();
-    for (auto const& handle: *handles)
-        ret->push_back(project(handle));
-    return ret;
+    return this->project(handles, &this->column_names);
 }
 
 // Do a projection for each of a list of handles
@@ -81,8 +208,206 @@ ValueDicts* DbRelation::project(Handles *handles, const ValueDict* where) {
     ColumnNames t;
     for (auto const& column: *where)
         t.push_back(column.first);
-    ValueDicts *ret = new ValueDicts();
-    for (auto const& handle: *handles)
-        ret->push_back(project(handle, &t));
+    return this->project(handles, &t);
+}
+
+// Build each tuple from a projection of its row.
+Tuples* DbRelation::project_tuples(Handles *handles, const ColumnNames *column_names) {
+    ValueDicts *rows = project(handles, column_names);
+    Tuples *ret = new Tuples();
+    for (auto row : *rows) {
+        Tuple *tuple = new Tuple();
+        tuple->reserve((uint)column_names->size());
+        for (auto const &column_name : *column_names)
+            tuple->push_value(row->at(column_name));
+        ret->push_back(tuple);
+        delete row;
+    }
+    delete rows;
+    return ret;
+}
+
+WorkerPool::WorkerPool(uint num_threads) : num_threads(std::max(1u, num_threads)), threads(), tasks(),
+                                           next_id(0), idle(0), stopping(false) {
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(this->latch);
+        this->stopping = true;
+    }
+    this->changed.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+}
+
+// Queue the task, starting another thread for it if none is waiting and there is room.
+WorkerPool::TaskID WorkerPool::submit(const std::function<void()> &task) {
+    std::unique_lock<std::mutex> lock(this->latch);
+    TaskID task_id = ++this->next_id;
+    this->tasks.push_back(std::make_pair(task_id, task));
+    if (this->idle < this->tasks.size() && this->threads.size() < this->num_threads) {
+        try {
+            this->threads.push_back(std::thread(&WorkerPool::work, this));
+        } catch (...) {
+            if (this->threads.empty()) {
+                this->tasks.pop_back();
+                throw;
+            }
+            // the threads we have will get to it
+        }
+    }
+    lock.unlock();
+    this->changed.notify_one();
+    return task_id;
+}
+
+bool WorkerPool::cancel(TaskID task_id) {
+    std::lock_guard<std::mutex> guard(this->latch);
+    for (auto task = this->tasks.begin(); task != this->tasks.end(); task++) {
+        if (task->first == task_id) {
+            this->tasks.erase(task);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A pool thread: run tasks as they come until the pool is destroyed.
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> lock(this->latch);
+    while (true) {
+        this->idle++;
+        this->changed.wait(lock, [this] { return this->stopping || !this->tasks.empty(); });
+        this->idle--;
+        if (this->stopping)
+            return;
+        std::function<void()> task = this->tasks.front().second;
+        this->tasks.pop_front();
+        lock.unlock();
+        try {
+            task();
+        } catch (...) {}
+        lock.lock();
+    }
+}
+
+void run_parallel(WorkerPool &pool, uint count, const std::function<void(uint)> &work) {
+    std::vector<std::exception_ptr> errors(count);
+    auto run = [&work, &errors](uint part) {
+        try {
+            work(part);
+        } catch (...) {
+            errors[part] = std::current_exception();
+        }
+    };
+
+    // hand parts 1 and up to the pool; the ones it runs count themselves off when done
+    std::mutex latch;
+    std::condition_variable finished;
+    uint running = 0;
+    std::vector<WorkerPool::TaskID> task_ids;
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        try {
+            for (uint part = 1; part < count; part++) {
+                task_ids.push_back(pool.submit([&run, &latch, &finished, &running, part]() {
+                    run(part);
+                    std::lock_guard<std::mutex> guard(latch);
+                    running--;
+                    finished.notify_all();
+                }));
+                running++;
+            }
+        } catch (...) {
+            // the rest are run here
+        }
+    }
+
+    run(0);
+    for (uint part = (uint)task_ids.size() + 1; part < count; part++)
+        run(part);
+    for (uint i = 0; i < task_ids.size(); i++) {
+        if (pool.cancel(task_ids[i])) {
+            run(i + 1);
+            std::lock_guard<std::mutex> guard(latch);
+            running--;
+        }
+    }
+    std::unique_lock<std::mutex> lock(latch);
+    finished.wait(lock, [&running] { return running == 0; });
+    lock.unlock();
+
+    for (auto const &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+void HandleBitmap::add(Handle handle) {
+    Bits &bits = this->blocks[handle.first];
+    uint word = handle.second / 64;
+    if (bits.size() <= word)
+        bits.resize(word + 1, 0);
+    bits[word] |= (uint64_t)1 << (handle.second % 64);
+}
+
+void HandleBitmap::add(DbCursor &cursor) {
+    Handle handle;
+    while (cursor.next(handle))
+        add(handle);
+}
+
+// Blocks the other bitmap lacks, and blocks left with no bits set, are dropped.
+void HandleBitmap::intersect(const HandleBitmap &other) {
+    for (auto it = this->blocks.begin(); it != this->blocks.end();) {
+        auto found = other.blocks.find(it->first);
+        bool any = false;
+        if (found != other.blocks.end()) {
+            Bits &bits = it->second;
+            const Bits &other_bits = found->second;
+            if (bits.size() > other_bits.size())
+                bits.resize(other_bits.size());
+            for (size_t word = 0; word < bits.size(); word++) {
+                bits[word] &= other_bits[word];
+                any = any || bits[word] != 0;
+            }
+        }
+        if (any)
+            it++;
+        else
+            it = this->blocks.erase(it);
+    }
+}
+
+void HandleBitmap::unite(const HandleBitmap &other) {
+    for (auto const &block : other.blocks) {
+        Bits &bits = this->blocks[block.first];
+        if (bits.size() < block.second.size())
+            bits.resize(block.second.size(), 0);
+        for (size_t word = 0; word < block.second.size(); word++)
+            bits[word] |= block.second[word];
+    }
+}
+
+size_t HandleBitmap::size() const {
+    size_t count = 0;
+    for (auto const &block : this->blocks)
+        for (uint64_t word : block.second)
+            count += __builtin_popcountll(word);
+    return count;
+}
+
+Handles *HandleBitmap::handles() const {
+    Handles *ret = new Handles();
+    for (auto const &block : this->blocks) {
+        for (size_t word = 0; word < block.second.size(); word++) {
+            uint64_t bits = block.second[word];
+            while (bits != 0) {
+                uint bit = (uint)__builtin_ctzll(bits);
+                ret->push_back(Handle(block.first, (RecordID)(word * 64 + bit)));
+                bits &= bits - 1;
+            }
+        }
+    }
     return ret;
 }
@@ -11,8 +11,13 @@
  */
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <thread>
 #include <utility>
 #include <vector>
 #include "db_cxx.h"
@@ -141,6 +146,7 @@ typedef std::vector<BlockID> BlockIDs;
  * 	get_new()
  *	get(block_id)
  *	put(block)
+ *	unpin(block)
  *	block_ids()
  */
 class DbFile {
@@ -171,23 +177,30 @@ public:
 
     /**
      * Add a new block for this file.
-     * @returns  the newly appended block
+     * @returns  the newly appended block (pinned until passed to unpin)
      */
     virtual DbBlock* get_new() = 0;
 
     /**
      * Get a specific block in this file.
      * @param block_id  which block to get
-     * @returns         pointer to the DbBlock (freed by caller)
+     * @returns         pointer to the DbBlock (pinned until passed to unpin)
      */
     virtual DbBlock* get(BlockID block_id) = 0;
 
     /**
      * Write a block to this file (the block knows its BlockID)
-     * @param block  block to write (overwrites existing block on disk)
+     * @param block  block to write (overwrites existing block on disk, possibly
+     *               deferred until the block leaves memory)
      */
     virtual void put(DbBlock* block) = 0;
 
+    /**
+     * Release a block gotten from get or get_new. The caller must not use it afterwards.
+     * @param block  block to release
+     */
+    virtual void unpin(DbBlock* block) = 0;
+
     /**
      * Get a list of all the valid BlockID's in the file
      * FIXME - not a good long-term approach, but we'll do this until we put in iterators
@@ -214,7 +227,7 @@ public:
     ColumnAttribute(DataType data_type) : data_type(data_type) {}
     virtual ~ColumnAttribute() {}
 
-    virtual DataType get_data_type() { return data_type; }
+    virtual DataType get_data_type() const { return data_type; }
     virtual void set_data_type(DataType data_type) {this->data_type = data_type;}
 
 protected:
@@ -249,6 +262,109 @@ typedef std::vector<Handle> Handles;   // FIXME: will need to turn this into an
 typedef std::map<Identifier, Value> ValueDict;
 typedef std::vector<ValueDict*> ValueDicts;
 
+/**
+ * @class Tuple - one row's values by position in a column list resolved once (e.g., when the
+ * plan is made) instead of keyed by column name. Each field is a small tag plus an inline
+ * INT or BOOLEAN, or for TEXT an offset and length into the one character buffer the tuple
+ * owns. Fields are pushed in column order.
+ */
+class Tuple {
+public:
+    Tuple() : fields(), chars() {}
+
+    void reserve(uint count) { this->fields.reserve(count); }
+    void push_int(int32_t n);
+    void push_boolean(bool b);
+    void push_text(const char *text, uint16_t size);
+    void push_value(const Value &value);
+
+    uint size() const { return (uint)this->fields.size(); }
+    ColumnAttribute::DataType get_data_type(uint ordinal) const {
+        return (ColumnAttribute::DataType)this->fields[ordinal].data_type;
+    }
+    int32_t get_int(uint ordinal) const { return this->fields[ordinal].n; }
+    bool get_boolean(uint ordinal) const { return this->fields[ordinal].n != 0; }
+    const char *get_text(uint ordinal, uint16_t &size) const;  // not NUL-terminated
+    Value get_value(uint ordinal) const;
+
+protected:
+    struct Field {
+        uint8_t data_type;  // a ColumnAttribute::DataType
+        uint16_t size;      // TEXT: length in chars
+        int32_t n;          // INT or BOOLEAN: the value; TEXT: offset in chars
+    };
+    std::vector<Field> fields;
+    std::string chars;
+};
+typedef std::vector<Tuple*> Tuples;
+
+
+class DbBatchCursor;
+
+/**
+ * @class DbCursor - abstract base class for pull-based iteration over the handles
+ * of qualifying rows (handed out by DbRelation and DbIndex; freed by caller)
+ *
+ * Methods:
+ * 	next(handle)
+ */
+class DbCursor {
+public:
+    virtual ~DbCursor() {}
+
+    /**
+     * Advance to the next qualifying row.
+     * @param handle  returned by reference: handle of the next row
+     * @returns       false if there are no more rows
+     */
+    virtual bool next(Handle &handle) = 0;
+};
+
+/**
+ * @class HandlesCursor - DbCursor over an already materialized list of handles
+ */
+class HandlesCursor : public DbCursor {
+public:
+    // takes ownership of handles (which may be nullptr for no rows)
+    HandlesCursor(Handles *handles) : handles(handles), position(0) {}
+    virtual ~HandlesCursor() { delete handles; }
+
+    virtual bool next(Handle &handle) {
+        if (handles == nullptr || position >= handles->size())
+            return false;
+        handle = (*handles)[position++];
+        return true;
+    }
+
+protected:
+    Handles *handles;
+    size_t position;
+};
+
+/**
+ * @class HandleBitmap - a set of handles kept as one bitmap of record ids per block, so sets
+ * from different indices can be ANDed or ORed a word at a time and read back in physical order
+ */
+class HandleBitmap {
+public:
+    HandleBitmap() : blocks() {}
+    virtual ~HandleBitmap() {}
+
+    void add(Handle handle);
+    void add(DbCursor &cursor);  // every handle the cursor has left
+    void intersect(const HandleBitmap &other);  // AND
+    void unite(const HandleBitmap &other);  // OR
+    bool empty() const { return this->blocks.empty(); }
+    size_t size() const;
+
+    // the handles by block id and then record id (freed by caller)
+    Handles *handles() const;
+
+protected:
+    typedef std::vector<uint64_t> Bits;  // bit r % 64 of word r / 64 is record id r
+    std::map<BlockID, Bits> blocks;  // only blocks with at least one handle
+};
+
 
 /**
  * @class DbRelationError - generic exception class for DbRelation
@@ -321,6 +437,13 @@ public:
      */
     virtual Handle insert(const ValueDict* row) = 0;
 
+    /**
+     * Execute: INSERT INTO <table_name> VALUES ( <row> ), ( <row> ), ...
+     * @param rows  dictionaries keyed by column names
+     * @returns     handles to the new rows, in the same order (freed by caller)
+     */
+    virtual Handles* insert_many(const ValueDicts* rows);
+
     /**
      * Conceptually, execute: UPDATE INTO <table_name> SET <new_valus> WHERE <handle>
      * where handle is sufficient to identify one specific record (e.g., returned
@@ -360,6 +483,47 @@ public:
      */
     virtual Handles* select(Handles* current_selection, const ValueDict* where) = 0;
 
+    /**
+     * Conceptually, execute: SELECT <handle> FROM <table_name> WHERE 1
+     * but yield the qualifying rows one at a time rather than all at once.
+     * @returns  a cursor over handles for qualifying rows (freed by caller)
+     */
+    virtual DbCursor* select_cursor();
+
+    /**
+     * Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
+     * but yield the qualifying rows one at a time rather than all at once.
+     * @param where  where-clause predicates (must outlive the returned cursor)
+     * @returns      a cursor over handles for qualifying rows (freed by caller)
+     */
+    virtual DbCursor* select_cursor(const ValueDict* where);
+
+    /**
+     * Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
+     * This version does a restricted selection based on current_selection.
+     * @param current_selection  restrict selection to be from these rows
+     *                           (owned by the returned cursor)
+     * @param where              where-clause predicates (must outlive the returned cursor)
+     * @returns                  a cursor over handles for qualifying rows (freed by caller)
+     */
+    virtual DbCursor* select_cursor(DbCursor* current_selection, const ValueDict* where);
+
+    /**
+     * Conceptually, execute: SELECT <column_names> FROM <table_name>
+     * but yield the rows a ColumnBatch (see ColumnBatch.h) at a time.
+     * @param column_names  columns to put in the batches, in this order
+     * @returns             a cursor over batches of all the rows (freed by caller)
+     */
+    virtual DbBatchCursor* batch_cursor(const ColumnNames* column_names);
+
+    /**
+     * The rows of batch_cursor split into parts that may be scanned at the same time,
+     * each on its own thread (see WorkerPool).
+     * @param column_names  columns to put in the batches, in this order
+     * @returns             one cursor per part, in row order (each freed by caller)
+     */
+    virtual std::vector<DbBatchCursor*> batch_cursors(const ColumnNames* column_names);
+
     /**
      * Return a sequence of all values for handle (SELECT *).
      * @param handle  row to get values from
@@ -390,6 +554,15 @@ public:
     virtual ValueDicts* project(Handles *handles, const ColumnNames* column_names);
     virtual ValueDicts* project(Handles *handles, const ValueDict* column_names);
 
+    /**
+     * Return the values given by column_names for each of handles, as tuples.
+     * @param handles       rows to get values from
+     * @param column_names  list of column names to project
+     * @returns             one tuple per handle, in the same order, with fields in the
+     *                      order of column_names (freed by caller)
+     */
+    virtual Tuples* project_tuples(Handles *handles, const ColumnNames* column_names);
+
     /**
      * Accessor for column_names.
      * @returns column_names   list of column names for this relation, in order
@@ -470,14 +643,39 @@ public:
 
     /**
      * Lookup a range of search keys.
-     * @param min_key  dictionary of min (inclusive) search key
-     * @param max_key  dictionary of max (inclusive) search key
-     * @returns        list of DbFile handles for records in range
-     */
-    virtual Handles* range(ValueDict* min_key, ValueDict* max_key) const {
+     * @param min_key        dictionary of min search key (nullptr for no lower bound)
+     * @param max_key        dictionary of max search key (nullptr for no upper bound)
+     * @param min_inclusive  true if keys equal to min_key are in the range
+     * @param max_inclusive  true if keys equal to max_key are in the range
+     * @returns              list of DbFile handles for records in range
+     */
+    virtual Handles* range(ValueDict* min_key, ValueDict* max_key,
+                           bool min_inclusive = true, bool max_inclusive = true) const {
         throw DbRelationError("range index query not supported");
     }
 
+    /**
+     * Lookup a specific search key, yielding matches one at a time.
+     * @param key_values  dictionary of values for the search key
+     * @returns           cursor over DbFile handles for records with key_values (freed by caller)
+     */
+    virtual DbCursor* lookup_cursor(ValueDict* key_values) const {
+        return new HandlesCursor(lookup(key_values));
+    }
+
+    /**
+     * Lookup a range of search keys, yielding matches one at a time.
+     * @param min_key        dictionary of min search key (nullptr for no lower bound)
+     * @param max_key        dictionary of max search key (nullptr for no upper bound)
+     * @param min_inclusive  true if keys equal to min_key are in the range
+     * @param max_inclusive  true if keys equal to max_key are in the range
+     * @returns              cursor over DbFile handles for records in range (freed by caller)
+     */
+    virtual DbCursor* range_cursor(ValueDict* min_key, ValueDict* max_key,
+                                   bool min_inclusive = true, bool max_inclusive = true) const {
+        return new HandlesCursor(range(min_key, max_key, min_inclusive, max_inclusive));
+    }
+
     /**
      * Insert the index entry for the given record.
      * @param record  handle (into relation) to the record to insert
@@ -485,6 +683,15 @@ public:
      */
     virtual void insert(Handle record) = 0;
 
+    /**
+     * Insert the index entries for many records, e.g., after a bulk load of the relation.
+     * @param records  handles (into relation) to the records to insert
+     */
+    virtual void insert_many(const Handles* records) {
+        for (auto const &record : *records)
+            insert(record);
+    }
+
     /**
      * Delete the index entry for the given record.
      * @param record  handle (into relation) to the record to remove
@@ -492,9 +699,71 @@ public:
      */
     virtual void del(Handle record) = 0;
 
+    /**
+     * Accessor for key_columns.
+     * @returns  the columns this index is keyed on, in key order
+     */
+    virtual const ColumnNames& get_key_columns() const {
+        return key_columns;
+    }
+
 protected:
     DbRelation& relation;
     Identifier name;
     ColumnNames key_columns;
     bool unique;
 };
+
+/**
+ * @class WorkerPool - standing threads that run submitted tasks in the order they came in
+ *
+ * Threads are started as tasks arrive, up to the pool's size, and then kept waiting for
+ * later tasks until the pool is destroyed. A task that no thread has started yet can be
+ * taken back with cancel, so that whoever is waiting for it can run it itself instead.
+ * Tasks should catch their own exceptions; any that get out are dropped.
+ */
+class WorkerPool {
+public:
+    typedef u_long TaskID;
+
+    WorkerPool(uint num_threads);
+    virtual ~WorkerPool();
+    WorkerPool(const WorkerPool& other) = delete;
+    WorkerPool& operator=(const WorkerPool& other) = delete;
+
+    /**
+     * Queue a task for the next free thread.
+     * @param task  what to run
+     * @returns     id to cancel the task by
+     */
+    virtual TaskID submit(const std::function<void()> &task);
+
+    /**
+     * Take back a task that no thread has started.
+     * @param task_id  as returned by submit
+     * @returns        true if it was taken back (and so will never run here)
+     */
+    virtual bool cancel(TaskID task_id);
+
+    uint get_size() const {return num_threads;}
+
+protected:
+    uint num_threads;
+    std::vector<std::thread> threads;
+    std::deque<std::pair<TaskID, std::function<void()>>> tasks;
+    TaskID next_id;
+    uint idle;  // threads waiting for a task
+    bool stopping;
+    std::mutex latch;
+    std::condition_variable changed;
+
+    virtual void work();
+};
+
+/**
+ * Run work(0), ..., work(count - 1) on the pool's threads and wait for all of them. The
+ * calling thread runs work(0) itself, then any of the rest no pool thread has got to, so
+ * a single part never leaves the calling thread and a busy pool can't hold the work up.
+ * If any of them threw, the exception from the lowest-numbered one is rethrown here.
+ */
+void run_parallel(WorkerPool &pool, uint count, const std::function<void(uint)> &work);